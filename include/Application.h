@@ -1,15 +1,21 @@
 #pragma once
 
+#include "BufferPass.h"
 #include "Renderer.h"
+#include "Playlist.h"
 #include "Program.h"
 
 class Application
 {
 private:
   void initWindow();
+  GLuint channelTexture(const ChannelInput& input) const;
+  void bindPass(const Program* program, const ChannelInputs& channels, std::array<float, 2> resolution, float time, int frame) const;
 public:
   GLFWwindow *window = nullptr;
   Renderer *renderer = nullptr;
+  // Switches the renderer's decoder, instead of a single video.
+  Playlist *playlist = nullptr;
 
   Program *mainShaderProgram = nullptr;
 
@@ -18,6 +24,20 @@ public:
   Program *bufferCShaderProgram = nullptr;
   Program *bufferDShaderProgram = nullptr;
 
+  // Render targets of Buffer A to D, drawn in that order before the image
+  // whenever the buffer has a shader. Created with the defaults if not set.
+  BufferPass *bufferPasses[4] = {};
+  // What the image shader samples on iChannel0 to iChannel3.
+  ChannelInputs imageChannels = DEFAULT_CHANNEL_INPUTS;
+
+  // Print decoder pipeline statistics once per second.
+  bool printStats = false;
+  // Don't draw a shader that doesn't use iTime again until one of its
+  // channels changed.
+  bool skipUnchangedRedraws = true;
+  // Display refresh interval, how long an idle loop waits between checks.
+  double refreshInterval = 1.0 / 60.0;
+
   Application();
   ~Application();
 
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "Decoder.h"
+
+/**
+ * @brief Decode `filename` as fast as possible for `seconds` with each of
+ * `modes`, and print frames per second and time per stage for each.
+ *
+ * Runs without a window: frames are converted as `options` asks but never
+ * uploaded, and catching up is off so every frame is decoded.
+ *
+ * @return bool false if the video can't be decoded, or a forward playing
+ * decoder still allocated frames, packets or planes after its first frame
+ */
+bool RunDecoderBenchmark(const std::string& filename, const DecoderOptions& options,
+  const std::vector<DecoderThreading>& modes, double seconds);
+
+/**
+ * @brief Play the frames of a video prepared with PrepareCompressedVideo as
+ * fast as possible for `seconds` and print frames per second. Measures the
+ * CPU side of playback, paging frames in and copying them into the upload
+ * buffers, to compare with RunDecoderBenchmark on the source video.
+ *
+ * @return bool false if the file isn't a prepared video
+ */
+bool RunCompressedVideoBenchmark(const std::string& filename, double seconds);
+
+/**
+ * @brief Convert the first frames of `filename` to RGBA for `seconds` with
+ * swscale and with ColorConverter, and print megapixels per second for each.
+ *
+ * Both run at the source size on the calling thread (plus the converter's
+ * workers), as the convert stage would. Every frame is first converted by
+ * both and compared, which doubles as the converter's correctness check.
+ *
+ * @return bool false if the video can't be decoded, its format isn't handled
+ * by ColorConverter, or the two conversions differ by more than rounding
+ */
+bool RunConverterBenchmark(const std::string& filename, const DecoderOptions& options, double seconds);
+
+/**
+ * @brief Name of a threading mode, as accepted on the command line.
+ */
+const char* ToString(DecoderThreading threading);
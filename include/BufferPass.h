@@ -0,0 +1,96 @@
+#pragma once
+
+#include <array>
+
+#include "glad/gl.h"
+
+enum class BufferFormat {
+  RGBA8,
+  RGBA16F,
+  RGBA32F,
+  // Packed unsigned floats without alpha, a quarter of RGBA32F's bandwidth.
+  R11G11B10F,
+};
+
+enum class ChannelSource {
+  None,
+  // One of the renderer's textures, iChannel0 to iChannel3.
+  Texture,
+  // The last frame of Buffer A to D.
+  Buffer,
+};
+
+/**
+ * @brief What a pass samples on one of its iChannels.
+ */
+struct ChannelInput {
+  ChannelSource source = ChannelSource::None;
+  int index = 0;
+};
+
+using ChannelInputs = std::array<ChannelInput, 4>;
+
+// Every iChannel on the texture of the same number.
+const ChannelInputs DEFAULT_CHANNEL_INPUTS = { {
+  { ChannelSource::Texture, 0 },
+  { ChannelSource::Texture, 1 },
+  { ChannelSource::Texture, 2 },
+  { ChannelSource::Texture, 3 },
+} };
+
+/**
+ * @brief Render target of a Shadertoy buffer pass, Buffer A to D.
+ *
+ * The pass draws into one of two textures while its last frame stays in the
+ * other, and they swap once it is done, so a buffer can sample itself
+ * (feedback) without reading the texture it writes. Other passes sample the
+ * last finished frame: this frame's for buffers drawn before them, the
+ * frame before's for the rest, like Shadertoy.
+ */
+class BufferPass
+{
+private:
+  GLuint framebuffer = 0;
+  GLuint textures[2] = {};
+  // Texture holding the last finished frame, the other one is drawn into.
+  int front = 0;
+  int width = 0;
+  int height = 0;
+  BufferFormat format;
+  float scale;
+
+public:
+  // What the buffer's shader samples on iChannel0 to iChannel3.
+  ChannelInputs channels;
+
+  /**
+   * @param scale size of the buffer relative to the screen
+   */
+  BufferPass(BufferFormat format = BufferFormat::RGBA32F, float scale = 1.0f,
+    const ChannelInputs& channels = DEFAULT_CHANNEL_INPUTS);
+  ~BufferPass();
+
+  BufferPass(const BufferPass&) = delete;
+  BufferPass& operator=(const BufferPass&) = delete;
+
+  /**
+   * @brief Size the textures for a `screenWidth` x `screenHeight` screen.
+   * Textures that had to be reallocated start out cleared to 0.
+   */
+  void Resize(int screenWidth, int screenHeight);
+
+  /**
+   * @brief Bind the texture to draw the next frame into, and the viewport
+   * covering it.
+   */
+  void Bind();
+
+  /**
+   * @brief Make the frame drawn since Bind the last frame.
+   */
+  void Swap();
+
+  inline GLuint Texture() const { return textures[front]; }
+  inline int Width() const { return width; }
+  inline int Height() const { return height; }
+};
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __cplusplus
+extern "C" {
+#include <libavutil/frame.h>
+}
+#endif // __cplusplus
+
+/**
+ * @brief Fixed-point YUV to RGB matrix, in 1/8192 units, for 8-bit samples.
+ */
+struct ColorCoefficients {
+  int16_t y = 0;
+  int16_t rv = 0;
+  int16_t gu = 0;
+  int16_t gv = 0;
+  int16_t bu = 0;
+  // Subtracted from luma before the matrix, 16 for limited range.
+  int16_t yOffset = 0;
+
+  /**
+   * @brief Matrix for `colorspace` and `range`; unspecified content is
+   * guessed from its height like the GPU conversion does, BT.709 for HD.
+   */
+  static ColorCoefficients For(AVColorSpace colorspace, AVColorRange range, int height);
+};
+
+/**
+ * @brief Converts 8-bit YUV420P, NV12 and YUV444P frames (and their full
+ * range J variants) to RGBA at the same size, as a faster alternative to
+ * sws_scale for frames that need no scaling.
+ *
+ * Rows are converted with SSE2 or AVX2 (picked at runtime) on x86-64, NEON
+ * on ARM, plain C++ elsewhere. A frame is split into bands of rows that the
+ * calling thread and `threads - 1` workers convert at the same time.
+ * Subsampled chroma is repeated for both pixels and rows it covers, like
+ * swscale's unscaled converters.
+ *
+ * Convert is meant to be called from one thread at a time.
+ */
+class ColorConverter
+{
+private:
+  struct Band {
+    const AVFrame* frame = nullptr;
+    uint8_t* destination = nullptr;
+    int destinationStride = 0;
+    int firstRow = 0;
+    int rows = 0;
+  };
+
+  ColorCoefficients coefficients;
+  // Index of the row kernel among those the machine can run, 0 the fastest.
+  size_t kernel = 0;
+  std::vector<std::thread> workers;
+  // Full width chroma rows of each band, per worker and one for the caller.
+  std::vector<std::vector<uint8_t>> chromaRows;
+
+  std::mutex mutex;
+  std::condition_variable workCond;
+  std::condition_variable doneCond;
+  // Bands of the frame being converted, and those not taken by a worker yet
+  std::vector<Band> frameBands;
+  std::vector<Band> bands;
+  size_t pendingBands = 0;
+  bool stopping = false;
+
+  void WorkerLoop(size_t worker);
+  void ConvertBand(const Band& band, std::vector<uint8_t>& chroma) const;
+
+public:
+  /**
+   * @param threads threads converting each frame, including the caller;
+   * 0 for half the cores, at most 4
+   */
+  explicit ColorConverter(int threads = 0);
+  ~ColorConverter();
+
+  ColorConverter(const ColorConverter&) = delete;
+  ColorConverter& operator=(const ColorConverter&) = delete;
+
+  /**
+   * @brief Convert `frame` to tightly packed RGBA rows, `destinationStride`
+   * bytes apart, honoring its colorspace and range.
+   *
+   * @return bool false if the frame's format isn't supported, nothing is
+   * written then
+   */
+  bool Convert(const AVFrame* frame, uint8_t* destination, int destinationStride);
+
+  inline int ThreadCount() const { return int(workers.size()) + 1; }
+
+  static bool IsSupported(int format);
+
+  /**
+   * @brief Instruction set the rows are converted with by default: "avx2",
+   * "sse2", "neon" or "scalar".
+   */
+  static const char* KernelName();
+
+  /**
+   * @brief Every kernel this machine can run, the default first and
+   * "scalar" last.
+   */
+  static std::vector<const char*> KernelNames();
+
+  /**
+   * @brief Convert rows with one of KernelNames() instead of the default,
+   * e.g. to compare it with "scalar".
+   *
+   * @return bool false if the kernel isn't available here
+   */
+  bool SelectKernel(const char* name);
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Decoder.h"
+#include "InputFile.h"
+
+/**
+ * @brief A video transcoded once into frames of GPU-compressed blocks, played
+ * back straight from a memory mapping.
+ *
+ * Every frame is intra-only YCoCg: luma at full resolution as RGTC1 (BC4)
+ * blocks and Co/Cg at half resolution as RGTC2 (BC5) blocks, 0.75 bytes per
+ * pixel. Playing a frame is a glCompressedTexSubImage2D of two mapped ranges
+ * and a shader pass to RGB: no codec, no swscale, and any frame can be shown
+ * without decoding the ones before it.
+ *
+ * File layout, in host byte order:
+ *
+ *   header | frames, each `frameBytes` apart from `dataOffset` | frame pts
+ *
+ * Frames start on page boundaries so each one can be paged in on its own.
+ */
+class CompressedVideo
+{
+private:
+  InputFile input;
+  int64_t loopMicroseconds = 0;
+  uint64_t dataOffset = 0;
+  uint64_t frameBytes = 0;
+  // Presentation time of each frame in the loop, ascending.
+  std::vector<int64_t> framePts;
+  int lastFrame = -1;
+
+public:
+  int width = 0;
+  int height = 0;
+
+  explicit CompressedVideo(const std::string& filename);
+
+  CompressedVideo(const CompressedVideo&) = delete;
+  CompressedVideo& operator=(const CompressedVideo&) = delete;
+
+  inline bool IsOpen() const { return !framePts.empty(); }
+  inline int FrameCount() const { return int(framePts.size()); }
+  inline int64_t FramePts(int frame) const { return framePts[frame]; }
+
+  /**
+   * @brief Frame on screen `displayTime` after playback started, looping.
+   * Pages in the frames that follow it when it changes.
+   */
+  int FrameAt(std::chrono::nanoseconds displayTime);
+
+  /**
+   * @brief RGTC1 luma blocks of `frame`, LumaBytes() long, and its RGTC2
+   * Co/Cg blocks, ChromaBytes() long, in the mapping.
+   */
+  const uint8_t* LumaBlocks(int frame) const;
+  const uint8_t* ChromaBlocks(int frame) const;
+  size_t LumaBytes() const;
+  size_t ChromaBytes() const;
+  inline int ChromaWidth() const { return (width + 1) / 2; }
+  inline int ChromaHeight() const { return (height + 1) / 2; }
+
+  /**
+   * @brief Whether `filename` names a prepared video, by its extension.
+   */
+  static bool IsCompressedVideo(const std::string& filename);
+};
+
+/**
+ * @brief Decode one loop of `source` and write it as a CompressedVideo to
+ * `destination`, printing progress. Runs without a window; frames keep the
+ * size `options` converts them to.
+ *
+ * @return bool false if the source can't be decoded or the file written
+ */
+bool PrepareCompressedVideo(const std::string& source, const std::string& destination, const DecoderOptions& options);
@@ -1,4 +1,12 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
 #include <string>
+#include <thread>
+#include <vector>
 
 #ifdef __cplusplus
 extern "C" {
@@ -8,28 +16,577 @@ extern "C" {
 }
 #endif // __cplusplus
 
+#include "ColorConverter.h"
+#include "DirtyTiles.h"
+#include "FrameCache.h"
+#include "InputFile.h"
+#include "KeyframeIndex.h"
+#include "LoadGovernor.h"
+#include "MediaPool.h"
+#include "PacketCache.h"
+#include "SPSCQueue.hpp"
+
+/**
+ * @brief Memory lent to the decoder to convert one RGBA frame into, usually
+ * a mapped pixel unpack buffer, so a frame is written exactly once before the
+ * GPU reads it.
+ *
+ * Lifetime: the lender hands a buffer over with Decoder::LendBuffer and must
+ * not touch, unmap or free it until the decoder returns it as the `buffer`
+ * of a frame from GetFrame. From then on the buffer belongs to the lender
+ * again, filled with that frame's pixels; the decoder never writes to it
+ * after returning it. Buffers still lent when the decoder is destroyed are
+ * abandoned, the lender reclaims them after the decoder is gone.
+ */
+struct FrameBuffer {
+  uint8_t* data = nullptr;
+  size_t size = 0;
+  // Opaque to the decoder, identifies the buffer for the lender.
+  uintptr_t handle = 0;
+};
+
+/**
+ * @brief A frame ready for upload, owned by the decoder.
+ *
+ * `format` is AV_PIX_FMT_RGBA for frames converted on the CPU, otherwise one
+ * of the planar layouts the renderer converts on the GPU: YUV420P, NV12,
+ * P010 or YUV444P. Full-range (YUVJ) frames are reported with their base
+ * format and `color_range` set to AVCOL_RANGE_JPEG.
+ */
+struct VideoFrame {
+  AVPixelFormat format = AV_PIX_FMT_RGBA;
+  int width = 0;
+  int height = 0;
+  uint8_t* data[3] = {};
+  int linesize[3] = {};
+  AVColorSpace colorspace = AVCOL_SPC_UNSPECIFIED;
+  AVColorRange color_range = AVCOL_RANGE_UNSPECIFIED;
+  // Presentation timestamp on the looping timeline, in the decoder's `time_base`.
+  int64_t pts = 0;
+
+  // Lent buffer holding data[0], if the frame was converted into one.
+  FrameBuffer buffer;
+  // Same picture as the frame queued before it, so it was not converted.
+  // GetFrame keeps returning that frame in its place.
+  bool unchanged = false;
+
+  // Unique among the frames of all decoders, never 0.
+  uint64_t id = 0;
+  // Frame that `dirtyTiles` are relative to: where a texture still holds
+  // that frame, uploading the dirty tiles is enough. 0 if every pixel has
+  // to be uploaded.
+  uint64_t dirtyBase = 0;
+  DirtyTiles dirtyTiles;
+
+  // Backing memory: an RGBA buffer, or a reference to the decoded planes.
+  uint8_t* rgba = nullptr;
+  AVFrame* source = nullptr;
+};
+
+enum class VideoOutput {
+  // Convert to RGBA on the convert thread, see ColorConverter.
+  RGBA,
+  // Hand the decoder's native planes to the renderer, which converts them to
+  // RGB on the GPU. Formats without a GPU path still fall back to RGBA.
+  Planar,
+};
+
+enum class ScaleMode {
+  // The whole frame is stretched over the screen.
+  Stretch,
+  // The whole frame is shown with its aspect ratio, letterboxed.
+  Fit,
+  // The frame covers the screen with its aspect ratio, the overhanging
+  // parts are cropped before conversion.
+  Fill,
+};
+
+enum class PlaybackDirection {
+  Forward,
+  Reverse,
+  // Forward and reverse passes alternate, starting forward.
+  PingPong,
+};
+
+enum class DecoderThreading {
+  // Frame and slice threading, libavcodec picks what the codec supports.
+  Auto,
+  // Frame threading: best throughput, each thread adds a frame of delay.
+  Frame,
+  // Slice threading: no added delay, but only scales with slices per frame.
+  Slice,
+  // Decode on the decode stage's thread only, libavcodec's own default.
+  None,
+};
+
+struct DecoderOptions {
+  VideoOutput output = VideoOutput::RGBA;
+  DecoderThreading threading = DecoderThreading::Auto;
+  // Codec threads, 0 for one per core.
+  int decodeThreads = 0;
+  // Threads converting each RGBA frame that needs no scaling, 0 for half the
+  // cores (at most 4). Frames that are scaled, or in a format ColorConverter
+  // doesn't handle, go through swscale on the convert thread alone.
+  int convertThreads = 0;
+  // Convert every RGBA frame with swscale, for comparison.
+  bool swscaleConvert = false;
+  // Size the video is displayed at. Larger videos are decoded (codec lowres,
+  // where supported) and converted at the smallest size that still covers
+  // it, keeping their aspect ratio. 0 keeps the source size.
+  int targetWidth = 0;
+  int targetHeight = 0;
+  // How frames map onto the target; with Fill only the visible rectangle is
+  // converted and uploaded.
+  ScaleMode scaleMode = ScaleMode::Stretch;
+  // Downscale to the target size, otherwise only crop for it.
+  bool downscale = true;
+  // Where playback starts, in seconds into the clip, modulo its duration.
+  // Only the GOP around it is decoded.
+  double startSeconds = 0.0;
+  // Start at the local time of day modulo the clip duration instead, so
+  // every run (and every screen) shows the same frame at the same time.
+  bool syncTimeOfDay = false;
+  PlaybackDirection direction = PlaybackDirection::Forward;
+  // Decoded frames held while playing a GOP backwards. A GOP longer than
+  // this is decoded again for every chunk of it.
+  size_t reverseChunkFrames = 16;
+  // Limits for probing the file when opening it, in bytes and AV_TIME_BASE
+  // units. Only the video stream is probed, which needs far less than
+  // libavformat's defaults (5 MB, 5 s).
+  int64_t probeSize = 1 << 20;
+  int64_t analyzeDuration = AV_TIME_BASE;
+  // Where probe results and keyframe indexes are kept between starts, see
+  // ProbeCache; empty to probe every time.
+  std::string probeCacheDirectory;
+  // Read local files through a memory mapping, or a read-ahead thread when
+  // false, see InputFile. The window is paged in or buffered this far ahead
+  // of the demuxer.
+  bool mapInput = true;
+  size_t readAheadBytes = 8 << 20;
+  // CPUs the demux, decode and convert threads are pinned to, empty to let
+  // the OS schedule them.
+  std::vector<int> cpus;
+  // Memory cap: converted frames alive at once, including the displayed one.
+  size_t maxBufferedFrames = 4;
+  // Compressed packets buffered between the demux and decode stages.
+  size_t packetQueueSize = 64;
+  // Decoded (not yet converted) frames buffered between decode and convert.
+  size_t decodedQueueSize = 2;
+  // Decoded frames from the start of the clip kept for the loop point, 0 to
+  // disable. They are played while the codec re-primes after the rewind,
+  // which has to take less than their duration to be invisible.
+  size_t loopPrewarmFrames = 8;
+  // Memory budget in bytes for keeping the compressed video stream after the
+  // first pass, so later loops never read the file again. 0 to disable.
+  size_t packetCacheBytes = 64 << 20;
+  // Memory budget in bytes for keeping decoded frames of a whole loop, so
+  // later loops are replayed without decoding. Clips that don't fit keep
+  // every second (fourth, ...) GOP. 0 to disable.
+  size_t frameCacheBytes = 0;
+  // Hash the decoded pictures and skip converting (and uploading) the ones
+  // identical to the frame before, e.g. the still stretches of a clip.
+  bool skipUnchangedFrames = true;
+  // Compare each frame with the one before in tiles, so only the changed
+  // tiles are uploaded. Frames that are downscaled on the CPU for RGBA
+  // output are always uploaded whole.
+  bool diffTiles = true;
+  // Skip, discard and seek when playback falls behind the display time.
+  // Benchmarks turn it off to decode every frame.
+  bool catchUp = true;
+  // Give up decoding work step by step while decoding takes most of each
+  // frame's display time, and take it back once there is headroom again,
+  // see LoadGovernor.
+  bool adaptiveQuality = false;
+  // Convert RGBA frames into buffers lent with LendBuffer instead of the
+  // decoder's own memory. The convert stage waits until a buffer is lent.
+  bool lentBuffers = false;
+};
+
+/**
+ * @brief Cumulative work done by one pipeline stage.
+ */
+struct StageStats {
+  uint64_t count = 0;
+  uint64_t totalNanoseconds = 0;
+
+  inline double AverageMilliseconds() const {
+    return count == 0 ? 0.0 : double(totalNanoseconds) / double(count) / 1e6;
+  }
+};
+
+struct DecoderStats {
+  // Gauges, sampled when the snapshot was taken.
+  size_t packetQueueDepth = 0;
+  size_t decodedQueueDepth = 0;
+  size_t readyQueueDepth = 0;
+  size_t maxBufferedFrames = 0;
+  int outputWidth = 0;
+  int outputHeight = 0;
+  int lowres = 0;
+  size_t packetCacheBytes = 0;
+  size_t frameCacheBytes = 0;
+  // Time it took to open the file and the codec, and whether the stream
+  // parameters came from the probe cache.
+  double openMilliseconds = 0.0;
+  bool probeCached = false;
+  // Quality the load governor settled on, and the decode time per frame
+  // over its display time it went by.
+  DecodeQuality quality = DecodeQuality::Full;
+  double decodeLoad = 0.0;
+
+  // Counters, cumulative since the decoder was opened.
+  StageStats demux;
+  StageStats decode;
+  StageStats convert;
+  uint64_t framesPresented = 0;
+  // Converted frames that were already late and replaced before display.
+  uint64_t framesDropped = 0;
+  // Decoded frames not converted because a later frame was already due.
+  uint64_t framesSkipped = 0;
+  // Decoded frames identical to the frame before them, neither converted
+  // nor uploaded.
+  uint64_t framesUnchanged = 0;
+  // Packets the codec didn't output a frame for while discarding
+  // non-reference frames to catch up (an estimate with B-frame delay).
+  uint64_t framesDiscarded = 0;
+  // Jumps to a keyframe closer to the display time, or to a later loop.
+  uint64_t catchUpSeeks = 0;
+  // Time from a seek (start offset or catch-up) until the frame at its
+  // target was decoded, and the frames decoded to get there.
+  StageStats seek;
+  uint64_t seekFrames = 0;
+  // Loop points bridged with pre-decoded frames from the start of the clip.
+  uint64_t loopsPrewarmed = 0;
+  // Video packets replayed from the packet cache, and read from the file.
+  uint64_t packetsFromCache = 0;
+  uint64_t packetsFromDemuxer = 0;
+  // Frames replayed from the decoded-frame cache instead of decoded.
+  uint64_t framesFromCache = 0;
+  // Bytes read from the file, and packets of other streams the demuxer
+  // still returned.
+  uint64_t bytesRead = 0;
+  uint64_t foreignPackets = 0;
+  // Pages of the mapped file that weren't resident when the demuxer read
+  // them.
+  uint64_t pageFaults = 0;
+  // Quality steps taken by the load governor, down or up.
+  uint64_t qualityChanges = 0;
+  // Frames, packets and plane buffers the pipeline's pool had to create,
+  // see MediaPool. Stops growing once the working set exists.
+  uint64_t poolMisses = 0;
+
+  /**
+   * @brief Counters relative to an earlier snapshot, gauges as they are now.
+   */
+  DecoderStats Since(const DecoderStats& previous) const;
+};
+
+std::ostream& operator<<(std::ostream& os, const DecoderStats& stats);
+
+/**
+ * @brief Set up `context` for the matrix ColorConverter picks for `frame`,
+ * swscale ignores the frame's colorspace otherwise.
+ */
+void MatchColorspace(SwsContext* context, const AVFrame* frame);
+
+/**
+ * @brief Video decoder running demux, decode and color conversion on their
+ * own threads.
+ *
+ * Stages are connected by bounded SPSC queues:
+ *
+ *   demux --packets--> decode --AVFrames--> convert --RGBA--> GetFrame
+ *
+ * Converted frames come from a fixed pool of `maxBufferedFrames` buffers; the
+ * convert stage stalls when all of them are queued or on screen, which in turn
+ * back-pressures decode and demux.
+ */
 class Decoder
 {
 private:
-  AVFormatContext* pFormatContext;
-  AVCodecContext* pCodecContext;
+  enum class PacketKind {
+    Data,
+    // End of file: drain the codec, the next loop starts where this one ends.
+    EndOfPass,
+    // The demuxer jumped ahead within the pass: drop the codec's delayed
+    // frames and restart at the keyframe that follows.
+    Seek,
+    // The demuxer gave up on the rest of this pass and rewound; the next
+    // pass starts `passes` clip durations after the current one.
+    SkipPasses,
+    // Packets of a GOP with cached decoded frames were left out: drain the
+    // codec and replay the GOP's frames instead.
+    CachedGop,
+    // Reverse passes: the packets since the previous marker form a GOP,
+    // decode it and queue its frames backwards.
+    EndOfReverseGop,
+  };
+
+  struct DemuxedPacket {
+    PacketKind kind = PacketKind::Data;
+    AVPacket* packet = nullptr;
+    int64_t passes = 0;
+    int gop = 0;
+    // EndOfPass and SkipPasses: the next pass leaves out cached GOPs, or
+    // plays backwards.
+    bool cachedPass = false;
+    bool reversePass = false;
+    // Seek: timeline pts the jump aims at.
+    int64_t target = AV_NOPTS_VALUE;
+  };
+
+  class StageCounter {
+  public:
+    std::atomic<uint64_t> count{ 0 };
+    std::atomic<uint64_t> totalNanoseconds{ 0 };
+
+    void Add(std::chrono::steady_clock::duration elapsed, uint64_t items = 1);
+    StageStats Load() const;
+  };
+
+  AVFormatContext* pFormatContext = nullptr;
+  AVCodecContext* pCodecContext = nullptr;
+  // Decoder of the video stream, to reopen the context with another lowres.
+  const AVCodec* codec = nullptr;
   SwsContext* pSwsContext = nullptr;
-  AVPacket* pPacket;
-  AVFrame* pFrame;
-  AVFrame* pFrameRGBA32;
+  // Downscales planar frames, keeping their pixel format.
+  SwsContext* pPlanarSwsContext = nullptr;
+  // Visible source rectangle, in full resolution pixels.
+  int cropX = 0;
+  int cropY = 0;
+  int cropWidth = 0;
+  int cropHeight = 0;
   int video_stream_index = -1;
 
-  uint8_t *rgbaBuffer;
+  DecoderOptions options;
+  InputFile input;
+  // Frames and packets of the pipeline, and downscaled planes.
+  MediaPool mediaPool;
+  // Converts unscaled RGBA frames, idle without RGBA output.
+  ColorConverter colorConverter;
+
+  std::vector<VideoFrame> framePool;
+  VideoFrame* currentFrame = nullptr;
+
+  SPSCQueue<DemuxedPacket> packetQueue;
+  SPSCQueue<AVFrame*> decodedQueue;
+  SPSCQueue<VideoFrame*> readyQueue;
+  // Converted frame buffers handed back by GetFrame.
+  SPSCQueue<VideoFrame*> freeQueue;
+  // Destination buffers lent by the renderer.
+  SPSCQueue<FrameBuffer> lentQueue;
+
+  StageCounter demuxCounter;
+  StageCounter decodeCounter;
+  StageCounter convertCounter;
+  StageCounter seekCounter;
+  std::atomic<uint64_t> seekFrames{ 0 };
+  std::atomic<uint64_t> framesPresented{ 0 };
+  std::atomic<uint64_t> framesDropped{ 0 };
+  std::atomic<uint64_t> framesSkipped{ 0 };
+  std::atomic<uint64_t> framesUnchanged{ 0 };
+  std::atomic<uint64_t> framesDiscarded{ 0 };
+  std::atomic<uint64_t> catchUpSeeks{ 0 };
+  std::atomic<uint64_t> loopsPrewarmed{ 0 };
+  std::atomic<uint64_t> packetsFromCache{ 0 };
+  std::atomic<uint64_t> packetsFromDemuxer{ 0 };
+  std::atomic<size_t> packetCacheBytes{ 0 };
+  std::atomic<uint64_t> framesFromCache{ 0 };
+  std::atomic<uint64_t> bytesRead{ 0 };
+  std::atomic<uint64_t> foreignPackets{ 0 };
+
+  // Timeline state, owned by the decode stage.
+  int64_t startPts = AV_NOPTS_VALUE;
+  int64_t loopOffset = 0;
+  int64_t passEnd = 0;
+  int64_t frameDuration = 1;
+  int64_t lastDecodedPts = 0;
+
+  // First frames of the clip, pts relative to the start of the pass. Owned
+  // by the decode stage.
+  std::vector<AVFrame*> loopStartFrames;
+  bool loopStartComplete = false;
+  bool passFromStart = true;
+  int64_t replayedUntil = AV_NOPTS_VALUE;
+
+  // Catch-up state shared between the stages. The display time is published
+  // by GetFrame; the mapping from stream to timeline by the decode stage,
+  // once per pass, before it bumps `decodePass`.
+  std::atomic<int64_t> displayPts{ 0 };
+  std::atomic<int64_t> streamToTimeline{ AV_NOPTS_VALUE };
+  std::atomic<int64_t> passStart{ 0 };
+  std::atomic<int64_t> clipDuration{ 0 };
+  std::atomic<uint64_t> decodePass{ 0 };
+  std::atomic<bool> seekPending{ false };
+  uint64_t demuxPass = 0;
+
+  // Owned by the demux stage.
+  PacketCache packetCache;
+  bool cachedDemuxPass = false;
+  bool reverseDemuxPass = false;
+  // Stream pts the first pass starts at, AV_NOPTS_VALUE for the start.
+  int64_t startTarget = AV_NOPTS_VALUE;
+
+  // Built before the threads start when seeking is needed, read-only after.
+  KeyframeIndex keyframeIndex;
+
+  // Owned by the decode stage; published for the statistics.
+  LoadGovernor governor;
+  std::chrono::nanoseconds frameBudget{ 0 };
+  int maxLowres = 0;
+  std::atomic<int> decodeQuality{ 0 };
+  std::atomic<double> decodeLoad{ 0.0 };
+  std::atomic<uint64_t> qualityChanges{ 0 };
+  std::atomic<int> activeLowres{ 0 };
+
+  // Owned by the decode stage.
+  bool reverseDecodePass = false;
+  std::vector<AVPacket*> reverseGop;
+  int64_t seekTarget = AV_NOPTS_VALUE;
+  std::chrono::steady_clock::time_point seekStart;
+  uint64_t seekDecoded = 0;
+
+  // Owned by the convert stage: hash of the last frame queued with its
+  // pixels, 0 for none, and its picture at the output size for diffing the
+  // next one against (with its id, 0 if there is none).
+  uint64_t lastQueuedHash = 0;
+  AVFrame* lastQueuedPicture = nullptr;
+  uint64_t lastQueuedId = 0;
+
+  // Recorded by the decode stage, read by both once ready.
+  FrameCache frameCache;
+  bool cachedDecodePass = false;
+
+  std::atomic<bool> running{ false };
+  std::thread demuxThread;
+  std::thread decodeThread;
+  std::thread convertThread;
+
+  void DemuxLoop();
+  int ReadPacket(AVPacket* packet);
+  void RewindPass();
+  void PrefetchGop(int keyframe);
+  bool SeekToKeyframe(int keyframe);
+  bool DemuxReversePass();
+  bool BeforeSeekTarget(const AVFrame* frame);
+  bool CatchUp(const AVPacket* packet, int64_t gopDuration);
+  void DecodeLoop();
+  void ApplyQuality();
+  AVCodecContext* OpenCodec(int codecLowres);
+  void ApplyLowres();
+  bool PrewarmLoopStart(AVFrame* frame);
+  bool ReplayLoopStart();
+  void ReleaseLoopStart();
+  bool ReplayGop(int gop);
+  bool DecodeReverseGop();
+  bool QueueReversed(std::vector<AVFrame*>& frames);
+  void ConvertLoop();
+  bool ConvertToRGBA(AVFrame* frame, VideoFrame* target, uint8_t* destination);
+  bool ScalePlanes(AVFrame* frame, AVFrame* destination);
+  void DiffTiles(const AVFrame* picture, VideoFrame* target, bool tiled);
+  void CropFrame(AVFrame* frame);
 
 public:
-  int width;
-  int height;
-  int64_t duration;
-  int avg_frame_rate;
-  int64_t nb_frames;
+  int width = 0;
+  int height = 0;
+  // Size of converted frames, `width` x `height` unless cropped or
+  // downscaled for `targetWidth` x `targetHeight`.
+  int output_width = 0;
+  int output_height = 0;
+  // Codec lowres factor: frames are decoded at 1 / 2^lowres of the size.
+  int lowres = 0;
+  double open_milliseconds = 0.0;
+  bool probe_cached = false;
+  int64_t duration = 0;
+  // Nominal rate, only used to estimate frame durations. nb_frames may be 0.
+  AVRational avg_frame_rate = { 0, 1 };
+  int64_t nb_frames = 0;
+  AVRational time_base = { 1, AV_TIME_BASE };
+  // Threading libavcodec settled on, FF_THREAD_FRAME or FF_THREAD_SLICE (0
+  // when decoding on a single thread).
+  int active_thread_type = 0;
+  int thread_count = 1;
 
-  Decoder(const std::string &filename);
+  Decoder(const std::string &filename, const DecoderOptions& options = DecoderOptions());
   ~Decoder();
 
-  void* GetFrame(float seconds);
+  /**
+   * @brief Get the frame whose presentation time covers `displayTime`,
+   * without blocking.
+   *
+   * Frames are timestamped from `best_effort_timestamp` on a timeline that
+   * keeps growing across loops, so variable frame rates and files without a
+   * frame count play at their real pace. Converted frames that became due
+   * before `displayTime` are skipped, and frames marked `unchanged` leave
+   * the frame before them in place. The returned frame stays valid until
+   * the next call that returns a different frame.
+   *
+   * When playback falls behind `displayTime`, the pipeline catches up
+   * instead of working through every missed frame: conversion is skipped for
+   * frames that are already superseded, the codec discards non-reference
+   * frames, and a lag of more than a GOP seeks to the keyframe before the
+   * display time (or straight into a later loop after a long stall).
+   *
+   * @param displayTime time since playback started
+   * @return const VideoFrame* the current frame, nullptr before the first
+   * frame was converted
+   */
+  const VideoFrame* GetFrame(std::chrono::nanoseconds displayTime);
+
+  /**
+   * @brief Take the next converted frame regardless of its presentation
+   * time, for processing every frame offline (with `catchUp` and
+   * `skipUnchangedFrames` off). Replaces the frame returned before, like
+   * GetFrame.
+   *
+   * @return const VideoFrame* nullptr if no frame is ready yet
+   */
+  const VideoFrame* NextFrame();
+
+  /**
+   * @brief Duration of one loop in `time_base` units, as measured at the end
+   * of the first pass; 0 until the first pass was decoded.
+   */
+  int64_t LoopDuration() const;
+
+  /**
+   * @brief Lend a buffer of at least `output_width * output_height * 4` bytes to the
+   * convert stage, see FrameBuffer. Only used with `lentBuffers`, and only
+   * from the thread calling GetFrame.
+   *
+   * @return bool false if more than MaxLentBuffers() buffers are lent
+   */
+  bool LendBuffer(const FrameBuffer& buffer);
+
+  /**
+   * @brief How many buffers the decoder can use at once: one per buffered
+   * frame. Lending more only adds latency.
+   */
+  inline size_t MaxLentBuffers() const { return options.lentBuffers ? options.maxBufferedFrames : 0; }
+
+  /**
+   * @brief Whether the file was opened and the pipeline threads run.
+   */
+  inline bool IsRunning() const { return demuxThread.joinable(); }
+
+  /**
+   * @brief Converted frames waiting for GetFrame, e.g. to tell whether a
+   * decoder opened ahead of time is primed.
+   */
+  inline size_t ReadyFrames() const { return readyQueue.Size(); }
+
+  /**
+   * @brief Stop and join the pipeline threads; GetFrame returns no new
+   * frames afterwards. Called by the destructor, may be called earlier from
+   * any thread to retire the decoder off the render thread.
+   */
+  void Stop();
+
+  /**
+   * @brief Lent buffers the decoder still holds, to be given back to their
+   * lender. Only after Stop(), from the thread that lent them.
+   */
+  void ReclaimLentBuffers(std::vector<FrameBuffer>* buffers);
+
+  DecoderStats GetStats() const;
 };
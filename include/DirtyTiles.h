@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#ifdef __cplusplus
+extern "C" {
+#include <libavutil/frame.h>
+}
+#endif // __cplusplus
+
+/**
+ * @brief A rectangle of texels, in the pixels of one plane.
+ */
+struct TileRect {
+  int x = 0;
+  int y = 0;
+  int width = 0;
+  int height = 0;
+};
+
+/**
+ * @brief Which tiles of a picture changed since an earlier picture of the
+ * same size, one flag per TILE_SIZE x TILE_SIZE block of (luma) pixels.
+ *
+ * Sized once per picture size; comparing and merging don't allocate.
+ */
+class DirtyTiles
+{
+private:
+  int width = 0;
+  int height = 0;
+  int columns = 0;
+  int rows = 0;
+  std::vector<uint8_t> tiles;
+
+public:
+  static const int TILE_SIZE = 64;
+
+  /**
+   * @brief Size the grid for a `width` x `height` picture, every tile dirty.
+   */
+  void Reset(int width, int height);
+
+  /**
+   * @brief Mark the tiles where `current` differs from `previous`, in any
+   * plane, and clear the others. Both must be software frames of the same
+   * format and size; the grid is resized to them.
+   *
+   * @return bool false if the frames can't be compared, every tile is
+   * dirty then
+   */
+  bool Compare(const AVFrame* previous, const AVFrame* current);
+
+  /**
+   * @brief Also mark the tiles dirty in `other`, of the same size.
+   */
+  void Merge(const DirtyTiles& other);
+
+  /**
+   * @brief Share of dirty tiles, 0 to 1.
+   */
+  double DirtyFraction() const;
+
+  /**
+   * @brief The dirty tiles as rectangles of a plane subsampled by `shiftX`
+   * and `shiftY`, neighbouring tiles of a row joined into one.
+   */
+  void Rects(int shiftX, int shiftY, std::vector<TileRect>* rects) const;
+};
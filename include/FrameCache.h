@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#ifdef __cplusplus
+extern "C" {
+#include <libavutil/frame.h>
+}
+#endif // __cplusplus
+
+/**
+ * @brief Decoded frames of one pass, in the codec's own pixel format, kept
+ * per GOP so later loops replay them instead of decoding.
+ *
+ * A pass read from the start of the file is recorded by the decode stage;
+ * frames are assigned to the GOP whose keyframe precedes their timestamp.
+ * When the frames exceed the budget, every other kept GOP is evicted and
+ * only GOPs on the doubled stride are recorded from then on. A looping
+ * access pattern defeats LRU, while a fixed stride spreads the remaining
+ * decode work evenly over the loop.
+ *
+ * Recording is single threaded. Once Ready() the cache is immutable and may
+ * be read from any thread.
+ */
+class FrameCache
+{
+private:
+  struct Gop {
+    int64_t keyPts = 0;
+    std::vector<AVFrame*> frames;
+    size_t bytes = 0;
+  };
+
+  size_t budget = 0;
+  std::vector<Gop> gops;
+  size_t stride = 1;
+  size_t bytes = 0;
+
+  bool recording = false;
+  bool disabled = false;
+  std::atomic<bool> ready{ false };
+  std::atomic<size_t> residentBytes{ 0 };
+
+  void Evict(size_t gop);
+  void Discard();
+
+public:
+  explicit FrameCache(size_t budget);
+  ~FrameCache();
+
+  FrameCache(const FrameCache&) = delete;
+  FrameCache& operator=(const FrameCache&) = delete;
+
+  /**
+   * @brief Start recording a pass decoded from the start of the file, unless
+   * the cache is ready or nothing fits the budget.
+   */
+  void BeginRecording();
+
+  /**
+   * @brief A keyframe packet of the recorded pass was sent to the codec.
+   */
+  void AddKeyframe(int64_t pts);
+
+  /**
+   * @brief Keep a reference to a decoded frame with stream timestamp `pts`.
+   */
+  void Record(const AVFrame* frame, int64_t pts);
+
+  /**
+   * @brief The pass jumped, drop what was recorded of it.
+   */
+  void AbortRecording();
+
+  /**
+   * @brief The recorded pass was fully decoded, publish the cache.
+   */
+  void FinishRecording();
+
+  inline bool Ready() const { return ready.load(std::memory_order_acquire); }
+
+  /**
+   * @brief GOP starting with the keyframe at `keyPts`, -1 if unknown.
+   */
+  int FindGop(int64_t keyPts) const;
+
+  /**
+   * @brief GOP a frame with stream timestamp `pts` belongs to.
+   */
+  int GopOf(int64_t pts) const;
+
+  inline bool IsCached(int gop) const {
+    return gop >= 0 && size_t(gop) < gops.size() && !gops[gop].frames.empty();
+  }
+
+  /**
+   * @brief Frames of a cached GOP in presentation order, their `pts` is the
+   * stream timestamp.
+   */
+  inline const std::vector<AVFrame*>& Frames(int gop) const { return gops[gop].frames; }
+
+  inline size_t ResidentBytes() const { return residentBytes.load(std::memory_order_relaxed); }
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __cplusplus
+extern "C" {
+#include <libavformat/avio.h>
+}
+#endif // __cplusplus
+
+/**
+ * @brief Custom I/O for the demuxer, reading a local file through a memory
+ * mapping or, where the file can't be mapped, through a read-ahead thread.
+ *
+ * A mapped file is served straight from the page cache, without a read
+ * syscall per buffer. The kernel is asked to page in the window ahead of the
+ * read position (and any range announced with Prefetch) before the demuxer
+ * gets there. Reads count the pages that were not resident yet, i.e. the
+ * page faults the demuxer took.
+ *
+ * Touching a mapping past the end of a file truncated since is fatal
+ * (SIGBUS), so only regular files nobody but their owner can write are
+ * mapped, and the file's size and modification time are checked on every
+ * seek and read-ahead step. A changed file is read by the thread below from
+ * then on.
+ *
+ * Without a mapping, a thread keeps up to `readAheadBytes` of the file
+ * buffered ahead of the read position; seeking drops the buffer.
+ *
+ * Other sources (URLs) are left to FFmpeg's protocols, Context() is null.
+ * Used from the demux thread only, except for the counters.
+ */
+class InputFile
+{
+private:
+  struct Chunk {
+    int64_t offset = 0;
+    std::vector<uint8_t> data;
+  };
+
+  AVIOContext* context = nullptr;
+  std::string path;
+  int64_t size = -1;
+  int64_t position = 0;
+  size_t readAheadBytes = 0;
+
+  // Mapped file
+  const uint8_t* mapping = nullptr;
+  int64_t advisedUntil = 0;
+#if defined( WIN32 ) || defined( _WIN32 )
+  void* fileHandle = nullptr;
+  void* mappingHandle = nullptr;
+#else
+  // Kept open to notice the file changing under the mapping
+  int descriptor = -1;
+  int64_t mappedModified = 0;
+#if defined( __APPLE__ )
+  // mincore results of the pages a read covers, kept across reads
+  std::vector<char> residentPages;
+#else
+  std::vector<unsigned char> residentPages;
+#endif
+#endif
+
+  // Read-ahead thread, for files that can't be mapped
+  FILE* file = nullptr;
+  std::thread readThread;
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::deque<Chunk> chunks;
+  size_t bufferedBytes = 0;
+  // Where the thread continues reading, and a counter bumped by every seek
+  // so chunks read before it are dropped
+  int64_t readOffset = 0;
+  uint64_t generation = 0;
+  bool readEnd = false;
+  bool stopping = false;
+
+  std::atomic<uint64_t> pageFaults{ 0 };
+  std::atomic<uint64_t> bytesServed{ 0 };
+
+  bool Map(const std::string& filename);
+  void Unmap();
+  bool MappingChanged() const;
+  // Falls back to the read-ahead thread if the mapped file changed
+  bool KeepMapping();
+  bool StartReadAhead();
+  void ReadAheadLoop();
+
+  int ReadMapped(uint8_t* buf, int bufSize);
+  int ReadBuffered(uint8_t* buf, int bufSize);
+  int64_t Seek(int64_t offset, int whence);
+
+  static int ReadCallback(void* opaque, uint8_t* buf, int bufSize);
+  static int64_t SeekCallback(void* opaque, int64_t offset, int whence);
+
+public:
+  /**
+   * @param map false to always use the read-ahead thread
+   * @param readAheadBytes how far ahead of the read position data is paged
+   * in or buffered
+   */
+  InputFile(const std::string& filename, bool map, size_t readAheadBytes);
+  ~InputFile();
+
+  InputFile(const InputFile&) = delete;
+  InputFile& operator=(const InputFile&) = delete;
+
+  /**
+   * @brief I/O context for AVFormatContext::pb, null if the source isn't a
+   * local file.
+   */
+  inline AVIOContext* Context() const { return context; }
+
+  inline bool IsMapped() const { return mapping != nullptr; }
+
+  /**
+   * @brief The whole file when mapped, for readers that don't go through
+   * Context(). Null otherwise.
+   */
+  inline const uint8_t* Data() const { return mapping; }
+  inline int64_t Size() const { return size; }
+
+  /**
+   * @brief Ask for a byte range that will be read soon, e.g. the next GOP,
+   * to be paged in. A no-op without a mapping, and on Windows before 8.
+   */
+  void Prefetch(int64_t offset, int64_t length);
+
+  inline uint64_t PageFaults() const { return pageFaults.load(std::memory_order_relaxed); }
+  inline uint64_t BytesServed() const { return bytesServed.load(std::memory_order_relaxed); }
+};
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#ifdef __cplusplus
+extern "C" {
+#include <libavformat/avformat.h>
+}
+#endif // __cplusplus
+
+/**
+ * @brief Keyframes of the video stream, to find the keyframe at or before
+ * any time in constant time.
+ *
+ * Built from the container's index when it has one (MP4, MKV with cues),
+ * otherwise by reading the stream's packets once. Lookups go through a table
+ * of equally long time buckets, each pointing at the last keyframe before
+ * it, so at most a bucket's worth of keyframes is scanned.
+ */
+class KeyframeIndex
+{
+public:
+  struct Entry {
+    // Stream time base, as the container reports it (the DTS for some).
+    int64_t timestamp = 0;
+    // Byte offset in the file, -1 if unknown.
+    int64_t pos = -1;
+  };
+
+private:
+  std::vector<Entry> entries;
+  std::vector<int> buckets;
+  int64_t bucketDuration = 1;
+
+  void BuildBuckets();
+
+public:
+  /**
+   * @brief Index `streamIndex` of an opened file. Reading packets leaves
+   * the demuxer rewound to the start.
+   *
+   * @return bool false if no keyframe was found
+   */
+  bool Build(AVFormatContext* pFormatContext, int streamIndex);
+
+  /**
+   * @brief Index of the last keyframe at or before `timestamp`, -1 if it is
+   * before the first keyframe.
+   */
+  int Find(int64_t timestamp) const;
+
+  /**
+   * @brief Use keyframes indexed before, e.g. loaded from the probe cache.
+   */
+  void Assign(std::vector<Entry> keyframes);
+
+  inline const std::vector<Entry>& Entries() const { return entries; }
+
+  inline bool Empty() const { return entries.empty(); }
+  inline size_t Size() const { return entries.size(); }
+  inline const Entry& operator[](size_t i) const { return entries[i]; }
+};
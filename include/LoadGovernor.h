@@ -0,0 +1,80 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief How much decoding work is given up, from none to the most.
+ * Every level keeps the savings of the levels before it.
+ */
+enum class DecodeQuality {
+  Full,
+  // Skip the deblocking filter of non-reference frames, whose artifacts
+  // don't propagate.
+  SkipLoopFilterNonRef,
+  // Skip the deblocking filter of every frame.
+  SkipLoopFilter,
+  // Skip the inverse transform of non-reference frames.
+  SkipIdct,
+  // Decode at half the size, for codecs that support lowres.
+  Lowres,
+  // Don't decode non-reference frames at all, lowering the frame rate.
+  Decimate,
+};
+
+/**
+ * @brief Name of a quality level, as printed in the statistics.
+ */
+const char* ToString(DecodeQuality quality);
+
+/**
+ * @brief Picks a decode quality from the time the decode stage spends per
+ * frame, against the frame's display duration.
+ *
+ * A running average above `highLoad` of the budget steps the quality down,
+ * one level at a time, once it lasted `degradeFrames`; below `lowLoad` for
+ * `recoverFrames` it steps back up. Recovering is deliberately slower, so a
+ * machine that is only briefly idle doesn't make the quality flap.
+ *
+ * Owned by the decode stage.
+ */
+class LoadGovernor
+{
+private:
+  std::vector<DecodeQuality> levels;
+  size_t level = 0;
+  double highLoad = 0.75;
+  double lowLoad = 0.35;
+  uint64_t degradeFrames = 15;
+  uint64_t recoverFrames = 150;
+
+  double averageLoad = 0.0;
+  uint64_t framesOver = 0;
+  uint64_t framesUnder = 0;
+  // Decode time of packets that didn't output a frame yet.
+  std::chrono::steady_clock::duration pending = std::chrono::steady_clock::duration::zero();
+
+public:
+  /**
+   * @param lowresAvailable whether the codec can decode at a lower size,
+   * the Lowres level is left out otherwise
+   */
+  explicit LoadGovernor(bool lowresAvailable = false);
+
+  /**
+   * @brief Account for `elapsed` decode time that produced `frames` frames
+   * of `budget` display time each.
+   *
+   * @return bool true if the quality changed
+   */
+  bool Update(std::chrono::steady_clock::duration elapsed, uint64_t frames, std::chrono::nanoseconds budget);
+
+  inline DecodeQuality Quality() const { return levels[level]; }
+
+  /**
+   * @brief Running average of decode time over the frame budget, 1.0 being
+   * exactly real time.
+   */
+  inline double Load() const { return averageLoad; }
+};
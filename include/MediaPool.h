@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#ifdef __cplusplus
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+}
+#endif // __cplusplus
+
+/**
+ * @brief Recycles the AVFrames, AVPackets and downscaled planes that flow
+ * through the decoder's pipeline, so a playing decoder stops allocating once
+ * its working set exists.
+ *
+ * Frames and packets are handed out unreferenced and go back to the pool
+ * unreferenced (their buffers return to whichever pool they came from, e.g.
+ * libavcodec's own frame pools). Planes come from an AVBufferPool sized for
+ * one format and size at a time.
+ *
+ * Every object the pool has to create counts as a pool miss, including the
+ * working set created up front; a pipeline that reached its steady state
+ * adds none. Only the pool's own objects are counted: the buffers codecs
+ * attach to frames and packets, and FFmpeg's internal allocations, are
+ * not.
+ *
+ * Thread safe: packets are taken by the demux stage and released by the
+ * decode stage, frames travel from the decode stage to the convert stage.
+ */
+class MediaPool
+{
+private:
+  std::mutex mutex;
+  std::vector<AVFrame*> frames;
+  std::vector<AVPacket*> packets;
+  size_t framesCreated = 0;
+  size_t packetsCreated = 0;
+
+  // Only touched by the stage downscaling frames.
+  AVBufferPool* planePool = nullptr;
+  int planeFormat = -1;
+  int planeWidth = 0;
+  int planeHeight = 0;
+  int planeBytes = 0;
+
+  std::atomic<uint64_t> poolMisses{ 0 };
+
+  static AVBufferRef* AllocatePlanes(void* opaque, size_t size);
+
+public:
+  /**
+   * @param frames frames created up front
+   * @param packets packets created up front
+   */
+  MediaPool(size_t frames, size_t packets);
+  ~MediaPool();
+
+  MediaPool(const MediaPool&) = delete;
+  MediaPool& operator=(const MediaPool&) = delete;
+
+  /**
+   * @return AVFrame* a blank frame, nullptr if out of memory
+   */
+  AVFrame* GetFrame();
+
+  /**
+   * @brief New reference to `source`, like av_frame_clone.
+   */
+  AVFrame* CloneFrame(const AVFrame* source);
+
+  /**
+   * @brief Unreference `frame` and keep it for reuse, like av_frame_free.
+   */
+  void Release(AVFrame*& frame);
+
+  /**
+   * @return AVPacket* a blank packet, nullptr if out of memory
+   */
+  AVPacket* GetPacket();
+
+  /**
+   * @brief Unreference `packet` and keep it for reuse, like av_packet_free.
+   */
+  void Release(AVPacket*& packet);
+
+  /**
+   * @brief Give the blank `frame` planes of `format` and size from the
+   * pool, like av_frame_get_buffer. The pool is rebuilt when the format or
+   * size changes and filled with `reserve` buffers right away.
+   *
+   * @return bool false if out of memory
+   */
+  bool GetPlanes(AVFrame* frame, int format, int width, int height, size_t reserve);
+
+  /**
+   * @brief Frames, packets and plane buffers the pool had to create so far
+   * because none was free.
+   */
+  inline uint64_t PoolMisses() const { return poolMisses.load(std::memory_order_relaxed); }
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#ifdef __cplusplus
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+#endif // __cplusplus
+
+/**
+ * @brief Compressed packets of one full pass over the video stream, kept in a
+ * single contiguous arena so later loops are fed from memory.
+ *
+ * A pass is recorded while it is read from the start of the file to its end.
+ * Once complete, replayed packets reference the arena instead of copying it,
+ * each with the zeroed padding decoders expect behind the data. Recording is
+ * abandoned for good if the stream does not fit the budget.
+ *
+ * Not thread safe, owned by the demux stage.
+ */
+class PacketCache
+{
+private:
+  struct Entry {
+    size_t offset = 0;
+    int size = 0;
+    int64_t pts = 0;
+    int64_t dts = 0;
+    int64_t duration = 0;
+    int flags = 0;
+  };
+
+  size_t budget = 0;
+  AVBufferRef* arena = nullptr;
+  size_t used = 0;
+  std::vector<Entry> entries;
+  size_t cursor = 0;
+
+  bool recording = false;
+  bool complete = false;
+  bool overflowed = false;
+
+  void Discard();
+
+public:
+  explicit PacketCache(size_t budget);
+  ~PacketCache();
+
+  PacketCache(const PacketCache&) = delete;
+  PacketCache& operator=(const PacketCache&) = delete;
+
+  /**
+   * @brief Start recording a pass read from the start of the file, unless
+   * one was recorded already or the stream is known not to fit.
+   *
+   * @param sizeHint upper bound of the stream size in bytes, e.g. the file
+   * size, to allocate the arena once; 0 if unknown
+   */
+  void BeginRecording(int64_t sizeHint);
+
+  /**
+   * @brief Copy a packet of the recorded pass into the arena.
+   */
+  void Record(const AVPacket* packet);
+
+  /**
+   * @brief The pass jumped or failed, drop what was recorded of it.
+   */
+  void AbortRecording();
+
+  /**
+   * @brief The recorded pass reached the end of the file, from now on the
+   * cache replaces the demuxer.
+   */
+  void FinishRecording();
+
+  inline bool IsComplete() const { return complete; }
+
+  /**
+   * @brief Next packet of the cached pass, referencing the arena.
+   *
+   * @return bool false at the end of the pass
+   */
+  bool Read(AVPacket* packet, int streamIndex);
+
+  inline void Rewind() { cursor = 0; }
+
+  /**
+   * @brief Continue at the last keyframe at or before `pts`.
+   *
+   * @return bool false if there is no such keyframe
+   */
+  bool Seek(int64_t pts);
+
+  /**
+   * @brief Continue at the first keyframe at or after `timestamp`, e.g. a
+   * KeyframeIndex entry's. Packets without a pts are matched by their dts.
+   *
+   * @return bool false if no keyframe follows it
+   */
+  bool SeekKeyframe(int64_t timestamp);
+
+  /**
+   * @brief Memory held by the arena and the packet index.
+   */
+  size_t ResidentBytes() const;
+};
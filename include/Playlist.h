@@ -0,0 +1,89 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Decoder.h"
+
+class Renderer;
+
+/**
+ * @brief Plays videos one after the other, switching every `interval`.
+ *
+ * The next video's Decoder is opened on a worker thread right after a
+ * switch, and primed (lent buffers and converting) while the current one
+ * plays, so the switch itself only swaps pointers, or crossfades on the GPU
+ * over `crossfade`. A video that isn't primed in time keeps the current one
+ * playing a little longer instead of stalling.
+ *
+ * Outgoing decoders are stopped and destroyed on the worker thread, and
+ * only their lent buffers are taken back on the render thread.
+ */
+class Playlist
+{
+private:
+  std::vector<std::string> files;
+  DecoderOptions options;
+  std::chrono::nanoseconds interval;
+  std::chrono::nanoseconds crossfade;
+
+  // Render thread
+  Decoder* current = nullptr;
+  Decoder* next = nullptr;
+  std::chrono::nanoseconds currentStart{ 0 };
+  std::chrono::nanoseconds nextStart{ 0 };
+  bool fading = false;
+  // Videos on screen and opened ahead, and how many failed to open in a row
+  size_t index = 0;
+  size_t requested = 0;
+  size_t failedOpens = 0;
+
+  // Shared with the worker thread
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable cond;
+  bool stopping = false;
+  int openIndex = -1;
+  Decoder* prepared = nullptr;
+  std::deque<Decoder*> stopQueue;
+  std::deque<Decoder*> stoppedQueue;
+  std::deque<Decoder*> deleteQueue;
+
+  void WorkerLoop();
+  void RequestOpen(size_t file);
+  void Retire(Decoder* decoder);
+  void ReclaimStopped(Renderer* renderer);
+  void FinishSwitch(Renderer* renderer);
+
+public:
+  Playlist(const std::vector<std::string>& files, const DecoderOptions& options,
+    std::chrono::nanoseconds interval, std::chrono::nanoseconds crossfade);
+  ~Playlist();
+
+  Playlist(const Playlist&) = delete;
+  Playlist& operator=(const Playlist&) = delete;
+
+  /**
+   * @brief Switch videos when due and put the frame for `displayTime` on
+   * iChannel0. Called once per rendered frame, on the render thread.
+   */
+  void Present(Renderer* renderer, std::chrono::nanoseconds displayTime);
+
+  /**
+   * @brief Decoder of the video on screen, null until the first one opened.
+   */
+  inline Decoder* Current() const { return current; }
+
+  /**
+   * @brief Read a playlist file: one video per line, blank lines and lines
+   * starting with '#' are skipped.
+   *
+   * @return bool false if the file can't be read
+   */
+  static bool ReadFile(const std::string& filename, std::vector<std::string>* files);
+};
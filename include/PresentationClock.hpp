@@ -0,0 +1,33 @@
+#pragma once
+
+#include <chrono>
+
+/**
+ * @brief Monotonic wall clock that drives what is on screen.
+ *
+ * Time is kept as integer nanoseconds since Start(), so it neither jumps with
+ * system time changes nor loses precision after the wallpaper ran for days.
+ */
+class PresentationClock
+{
+private:
+  using Clock = std::chrono::steady_clock;
+
+  Clock::time_point start;
+
+public:
+  PresentationClock() : start(Clock::now()) {}
+
+  inline void Start() { start = Clock::now(); }
+
+  inline std::chrono::nanoseconds Now() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start);
+  }
+
+  /**
+   * @brief Convert a clock reading to seconds, for shader uniforms and logs.
+   */
+  static inline double ToSeconds(std::chrono::nanoseconds time) {
+    return std::chrono::duration<double>(time).count();
+  }
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#ifdef __cplusplus
+extern "C" {
+#include <libavformat/avformat.h>
+}
+#endif // __cplusplus
+
+#include "KeyframeIndex.h"
+
+/**
+ * @brief What probing a video file found out about its video stream, enough
+ * to open the codec without calling avformat_find_stream_info again.
+ */
+struct ProbeInfo {
+  unsigned int streamCount = 0;
+  int streamIndex = -1;
+
+  // Codec parameters
+  AVCodecID codecId = AV_CODEC_ID_NONE;
+  uint32_t codecTag = 0;
+  int format = -1;
+  int64_t bitRate = 0;
+  int bitsPerCodedSample = 0;
+  int bitsPerRawSample = 0;
+  int profile = 0;
+  int level = 0;
+  int width = 0;
+  int height = 0;
+  AVRational sampleAspectRatio{ 0, 1 };
+  int colorRange = 0;
+  int colorPrimaries = 0;
+  int colorTrc = 0;
+  int colorSpace = 0;
+  int chromaLocation = 0;
+  int fieldOrder = 0;
+  int videoDelay = 0;
+  std::vector<uint8_t> extradata;
+
+  // Stream and container timing
+  AVRational timeBase{ 0, 1 };
+  AVRational avgFrameRate{ 0, 1 };
+  AVRational rFrameRate{ 0, 1 };
+  int64_t startTime = AV_NOPTS_VALUE;
+  int64_t duration = AV_NOPTS_VALUE;
+  int64_t nbFrames = 0;
+  int64_t formatDuration = AV_NOPTS_VALUE;
+
+  // Empty unless the index was built when the entry was stored
+  std::vector<KeyframeIndex::Entry> keyframes;
+
+  /**
+   * @brief Take the parameters of a probed stream.
+   */
+  void Capture(const AVFormatContext* pFormatContext, int streamIndex);
+
+  /**
+   * @brief Fill the streams of a freshly opened file with the cached
+   * parameters.
+   *
+   * @return bool false if the file's streams don't match the entry, it has
+   * to be probed
+   */
+  bool Apply(AVFormatContext* pFormatContext) const;
+};
+
+/**
+ * @brief Probe results persisted on disk, one small file per video, keyed
+ * by the video's absolute path, size and modification time. Any change to
+ * the video makes its entry miss, and the next store replaces it.
+ *
+ * Only local files are cached.
+ */
+class ProbeCache
+{
+private:
+  std::string directory;
+
+  std::string EntryPath(const std::string& key) const;
+
+public:
+  /**
+   * @param directory where entries are kept, created on the first store;
+   * empty disables the cache
+   */
+  explicit ProbeCache(std::string directory);
+
+  /**
+   * @brief Per-user cache directory of the platform.
+   */
+  static std::string DefaultDirectory();
+
+  /**
+   * @return bool false if there is no valid entry for the file as it is now
+   */
+  bool Load(const std::string& filename, ProbeInfo* info) const;
+
+  /**
+   * @brief Write the entry of a file, replacing any older one. Failures are
+   * reported and otherwise ignored.
+   */
+  void Store(const std::string& filename, const ProbeInfo& info) const;
+};
@@ -29,7 +29,18 @@ public:
   ~Program();
 
   void Use() const;
+  /**
+   * @brief Whether the shader uses `uniform_name`; unused uniforms are
+   * optimized away by the driver.
+   */
+  bool HasUniform(const std::string& uniform_name) const;
+  /**
+   * @brief Type `uniform_name` is declared with, e.g. GL_INT or GL_FLOAT;
+   * GL_NONE if it isn't an active uniform.
+   */
+  GLenum UniformType(const std::string& uniform_name) const;
   void BindInt(const std::string& uniform_name, int value) const;
+  void BindUint(const std::string& uniform_name, unsigned int value) const;
   void BindFloat(const std::string& uniform_name, float value) const;
   void BindVec2(const std::string& uniform_name, std::array<float, 2> value) const;
   void BindVec3(const std::string& uniform_name, std::array<float, 3> value) const;
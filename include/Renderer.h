@@ -4,11 +4,26 @@
 #include "glm/vec4.hpp"
 #include "glad/gl.h"
 
+#include "CompressedVideo.h"
 #include "Decoder.h"
+#include "TextureUploader.h"
+
+class Program;
 
 class Renderer
 {
 private:
+  // A texture that video frames are uploaded to, and what is on it.
+  struct VideoLayer {
+    GLuint texture = 0;
+    const VideoFrame* lastFrame = nullptr;
+    int64_t lastPts = 0;
+    // VideoFrame::id of the frame the texture holds, 0 if none
+    uint64_t lastId = 0;
+    int width = 0;
+    int height = 0;
+  };
+
   GLuint emptyVAO = 0;
 
   GLuint texture0 = 0;
@@ -16,10 +31,59 @@ private:
   GLuint texture2 = 0;
   GLuint texture3 = 0;
 
+  // Single path for every texture whose content comes from the CPU.
+  TextureUploader uploader;
+
+  // Native video planes, converted to RGB into texture0 by a GPU pass.
+  GLuint planeTextures[3] = {};
+  // VideoFrame::id of the frame the plane textures hold, 0 if none
+  uint64_t planeFrameId = 0;
+  GLuint videoFramebuffer = 0;
+  // Reads a layer being copied into another one.
+  GLuint copyFramebuffer = 0;
+  Program* colorConversionProgram = nullptr;
+
+  // texture0 when showing a single video. While crossfading, both videos
+  // go to their own layer and are mixed into texture0.
+  VideoLayer videoLayer;
+  VideoLayer fadeLayers[2];
+  // texture1 to texture3, for videos on iChannel1 to iChannel3.
+  VideoLayer channelLayers[3];
+  Program* crossfadeProgram = nullptr;
+
+  // Luma and Co/Cg blocks of a prepared video, converted into texture0.
+  GLuint compressedTextures[2] = {};
+  Program* ycocgProgram = nullptr;
+  int compressedFrame = -1;
+
+  // Whether any iChannel texture changed since TakeContentChanged.
+  bool contentChanged = true;
+
+  // Parts of the frame being uploaded that differ from the texture.
+  std::vector<TileRect> dirtyRects;
+
+  const std::vector<TileRect>* DirtyRects(const VideoFrame* frame, uint64_t textureId, int shiftX, int shiftY);
+
+  void UploadVideoFrame(const VideoFrame* frame, VideoLayer& layer);
+  void ConvertVideoPlanes(const VideoFrame* frame, VideoLayer& layer);
+  void BindVideoFramebuffer(VideoLayer& layer, int width, int height);
+  const VideoLayer* FindVideoLayer(const VideoFrame* frame, const VideoLayer& except) const;
+  void CopyVideoLayer(const VideoLayer& source, VideoLayer& target);
+  void LendVideoBuffers();
+  void LendVideoBuffers(Decoder* target, size_t maxLent);
+
 public:
   glm::vec4 viewport;
   glm::vec4 clearColor;
   Decoder* decoder = nullptr;
+  // A decoder opened ahead of time that is to follow `decoder`. It is lent
+  // buffers too, so it is primed before it is shown.
+  Decoder* nextDecoder = nullptr;
+  // Videos on iChannel1 to iChannel3, null for still images. All decoders
+  // run on their own threads and are presented from the same clock.
+  Decoder* channelDecoders[3] = {};
+  // A prepared video played instead of `decoder`, see CompressedVideo.
+  CompressedVideo* compressedVideo = nullptr;
 
   Renderer();
   ~Renderer();
@@ -33,12 +97,64 @@ public:
   void SetTexture2(void* pixels, int width, int height);
   void SetTexture3(void* pixels, int width, int height);
 
+  /**
+   * @brief Make `frame` the content of iChannel0.
+   *
+   * RGBA frames are uploaded as is. Planar YUV frames are uploaded plane by
+   * plane and converted to RGB on the GPU, honoring the frame's colorspace
+   * and range, so shaders always sample RGB. Passing the frame that is
+   * already on the texture is a no-op.
+   *
+   * If `decoder` converts into lent buffers, this is also where mapped pixel
+   * unpack buffers are lent to it and where the filled ones are taken back.
+   */
+  void SetVideoFrame(const VideoFrame* frame);
+
+  /**
+   * @brief Make a mix of two frames the content of iChannel0, `outgoing`
+   * from `decoder` and `incoming` from `nextDecoder`, weighted by `mix` from
+   * 0 (only `outgoing`) to 1. Either frame may be null while its decoder has
+   * none yet.
+   */
+  void SetVideoFrames(const VideoFrame* outgoing, const VideoFrame* incoming, float mix);
+
+  /**
+   * @brief Make `frame` the content of iChannel`channel`, 1 to 3, like
+   * SetVideoFrame does for iChannel0.
+   */
+  void SetChannelVideoFrame(int channel, const VideoFrame* frame);
+
+  /**
+   * @brief Make `frame` of `compressedVideo` the content of iChannel0: its
+   * blocks are uploaded as they are and converted from YCoCg to RGB on the
+   * GPU. Passing the frame that is already shown is a no-op.
+   */
+  void SetCompressedVideoFrame(int frame);
+
+  /**
+   * @brief Take back buffers lent to a decoder that was stopped.
+   */
+  void ReleaseLentBuffers(const std::vector<FrameBuffer>& buffers);
+
   void SetTexture(int unit, const std::string& filename);
   void SetTexture0(const std::string& filename);
   void SetTexture1(const std::string& filename);
   void SetTexture2(const std::string& filename);
   void SetTexture3(const std::string& filename);
 
+  /**
+   * @brief Whether an iChannel texture got new content since the last call,
+   * i.e. whether a shader that doesn't animate by itself has to be drawn.
+   */
+  inline bool TakeContentChanged() {
+    bool changed = contentChanged;
+    contentChanged = false;
+    return changed;
+  }
+
+  inline const UploadStats& GetUploadStats() const { return uploader.GetStats(); }
+  inline void EndFrame() { uploader.EndFrame(); }
+
   void DrawQuad();
   void SetRenderState();
 };
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/**
+ * @brief Bounded lock-free single-producer/single-consumer ring buffer.
+ *
+ * Exactly one thread may call Push and exactly one (other) thread may call
+ * Pop/Front. Size() may be called from any thread and is only a snapshot.
+ *
+ * @tparam T trivially copyable payload, usually a pointer
+ */
+template <typename T>
+class SPSCQueue
+{
+private:
+  // One slot is kept empty to tell a full ring from an empty one.
+  std::vector<T> slots;
+
+  // Consumer and producer indices live on separate cache lines so the two
+  // threads don't false-share.
+  alignas(64) std::atomic<size_t> head{ 0 };
+  alignas(64) std::atomic<size_t> tail{ 0 };
+
+  inline size_t Next(size_t index) const { return index + 1 == slots.size() ? 0 : index + 1; }
+
+public:
+  explicit SPSCQueue(size_t capacity) : slots(capacity + 1) {}
+
+  SPSCQueue(const SPSCQueue&) = delete;
+  SPSCQueue& operator=(const SPSCQueue&) = delete;
+
+  /**
+   * @brief Producer side. Returns false if the queue is full.
+   */
+  bool Push(const T& value) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t next = Next(t);
+    if (next == head.load(std::memory_order_acquire)) {
+      return false;
+    }
+    slots[t] = value;
+    tail.store(next, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief Consumer side. Returns false if the queue is empty.
+   */
+  bool Pop(T& value) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    value = slots[h];
+    head.store(Next(h), std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief Consumer side. Peek the oldest element without removing it.
+   *
+   * @return T* nullptr if the queue is empty
+   */
+  T* Front() {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    return &slots[h];
+  }
+
+  size_t Size() const {
+    size_t h = head.load(std::memory_order_acquire);
+    size_t t = tail.load(std::memory_order_acquire);
+    return t >= h ? t - h : t + slots.size() - h;
+  }
+
+  inline size_t Capacity() const { return slots.size() - 1; }
+};
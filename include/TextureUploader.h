@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+#include "glad/gl.h"
+
+#include "DirtyTiles.h"
+
+struct TextureFormat {
+  GLint internalFormat;
+  GLenum format;
+  GLenum type;
+  int bytesPerPixel;
+};
+
+const TextureFormat TEXTURE_FORMAT_RGBA8 = { GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, 4 };
+const TextureFormat TEXTURE_FORMAT_R8 = { GL_R8, GL_RED, GL_UNSIGNED_BYTE, 1 };
+const TextureFormat TEXTURE_FORMAT_RG8 = { GL_RG8, GL_RG, GL_UNSIGNED_BYTE, 2 };
+const TextureFormat TEXTURE_FORMAT_R16 = { GL_R16, GL_RED, GL_UNSIGNED_SHORT, 2 };
+const TextureFormat TEXTURE_FORMAT_RG16 = { GL_RG16, GL_RG, GL_UNSIGNED_SHORT, 4 };
+
+struct UploadStats {
+  uint64_t frames = 0;
+  uint64_t uploads = 0;
+  uint64_t bytes = 0;
+  // CPU time spent in Upload, including waits on fences.
+  uint64_t nanoseconds = 0;
+  // Uploads that had to wait for the GPU to release a pixel buffer.
+  uint64_t fenceWaits = 0;
+  // Texture storage (re)allocations, only on the first upload or a resize.
+  uint64_t allocations = 0;
+  // Uploads from buffers filled directly by another thread, without a copy.
+  uint64_t zeroCopyUploads = 0;
+  // Uploads of only the tiles that changed, and the bytes they left out.
+  uint64_t partialUploads = 0;
+  uint64_t bytesSkipped = 0;
+
+  UploadStats Since(const UploadStats& previous) const;
+};
+
+/**
+ * @brief Per-frame averages.
+ */
+std::ostream& operator<<(std::ostream& os, const UploadStats& stats);
+
+/**
+ * @brief Streams CPU pixels into textures through a ring of pixel unpack
+ * buffers.
+ *
+ * Texture storage is allocated once per size and then only updated with
+ * glTexSubImage2D. Each upload copies into the next buffer of the ring, which
+ * is reused only after the fence placed behind its last glTexSubImage2D has
+ * signalled, so the copy never waits on a transfer the GPU is still doing.
+ *
+ * Besides copying, buffers can be mapped and lent to producers on other
+ * threads (MapLendableBuffer), which write a frame into them directly. A lent
+ * buffer goes back through UploadLent or ReleaseLent and is lent again once
+ * its transfer is fenced off. Every lending gets a new handle, so a handle
+ * that was given back already is ignored rather than taken for the buffer's
+ * next lending.
+ *
+ * Must be used on the thread that owns the GL context.
+ */
+class TextureUploader
+{
+private:
+  struct PixelBuffer {
+    GLuint buffer = 0;
+    GLsizeiptr size = 0;
+    GLsync fence = nullptr;
+    // Lendable buffers only: mapped and owned by another thread, and how
+    // many times it was lent, part of the handle.
+    bool lent = false;
+    uintptr_t lendings = 0;
+  };
+
+  struct TextureStorage {
+    int width = 0;
+    int height = 0;
+    GLint internalFormat = 0;
+  };
+
+  std::vector<PixelBuffer> ring;
+  size_t next = 0;
+
+  std::vector<PixelBuffer> lendable;
+
+  std::unordered_map<GLuint, TextureStorage> storages;
+
+  UploadStats stats;
+
+  bool EnsureStorage(GLuint texture, const TextureFormat& format, int width, int height);
+  PixelBuffer& AcquireBuffer(GLsizeiptr size);
+  PixelBuffer* LentBuffer(uintptr_t handle);
+  void TransferFromBuffer(PixelBuffer& pixelBuffer, GLuint texture, const TextureFormat& format, int width, int height, int linesize,
+    const std::vector<TileRect>* rects);
+
+public:
+  static const size_t DEFAULT_RING_SIZE = 6;
+
+  explicit TextureUploader(size_t ringSize = DEFAULT_RING_SIZE);
+  ~TextureUploader();
+
+  TextureUploader(const TextureUploader&) = delete;
+  TextureUploader& operator=(const TextureUploader&) = delete;
+
+  /**
+   * @brief Upload `height` rows of `pixels`, each `linesize` bytes apart.
+   *
+   * @param linesize row pitch in bytes, 0 for tightly packed rows
+   * @param rects only these parts of the image changed since the last upload
+   * to `texture`, nullptr for the whole image. Ignored when the texture
+   * storage is (re)allocated.
+   */
+  void Upload(GLuint texture, const TextureFormat& format, int width, int height, const void* pixels, int linesize = 0,
+    const std::vector<TileRect>* rects = nullptr);
+
+  /**
+   * @brief Copy `height` rows of `rowBytes`, `linesize` bytes apart, to the
+   * same place in `destination`; only `rects` if given. Nothing past the
+   * `rowBytes` of a row is read, the rest of the pitch may not belong to
+   * the image (a frame cropped on the left, where the last row ends early).
+   */
+  static void CopyRows(uint8_t* destination, const uint8_t* pixels, int linesize, int rowBytes, int height,
+    int bytesPerPixel, const std::vector<TileRect>* rects = nullptr);
+
+  /**
+   * @brief Upload a whole image of pre-compressed blocks, `size` bytes in
+   * `internalFormat` (e.g. GL_COMPRESSED_RED_RGTC1), through the same ring.
+   */
+  void UploadCompressed(GLuint texture, GLenum internalFormat, int width, int height, const void* blocks, GLsizei size);
+
+  /**
+   * @brief Map an idle buffer of at least `size` bytes for writing on any
+   * thread. At most `maxLent` buffers are lent at a time; a buffer becomes
+   * idle once the GPU finished reading it.
+   *
+   * @return bool false if no buffer can be lent right now
+   */
+  bool MapLendableBuffer(GLsizeiptr size, size_t maxLent, uint8_t** data, uintptr_t* handle);
+
+  /**
+   * @brief Upload a lent buffer that was filled with `height` rows of
+   * `linesize` bytes, and take it back. Only `rects` are transferred, if
+   * given, like with Upload.
+   *
+   * @return bool false if `handle` isn't lent (any more), nothing is
+   * uploaded then
+   */
+  bool UploadLent(uintptr_t handle, GLuint texture, const TextureFormat& format, int width, int height, int linesize = 0,
+    const std::vector<TileRect>* rects = nullptr);
+
+  /**
+   * @brief Take a lent buffer back without uploading it.
+   */
+  void ReleaseLent(uintptr_t handle);
+
+  /**
+   * @brief Mark the end of a rendered frame, for per-frame statistics.
+   */
+  inline void EndFrame() { stats.frames++; }
+
+  inline const UploadStats& GetStats() const { return stats; }
+};
@@ -13,65 +13,171 @@
 #include <glad/gl.h>
 
 #include "Application.h"
+#include "PresentationClock.hpp"
 #include "put_window_behind_desktop_icons.h"
 
-namespace {
-
-float GetElapsedSeconds(std::chrono::system_clock::time_point start) {
-  auto now = std::chrono::system_clock::now();
-  return float(
-      std::chrono::duration_cast<std::chrono::milliseconds>( now - start ).count()
-    ) / 1000.0;
-}
-
-} // anonymous namespace
-
 void Application::run() {
   if ( mainShaderProgram == nullptr ) {
     throw std::runtime_error("mainShaderProgram is nullptr, setting it before running.");
     return;
   }
 
-  std::chrono::system_clock::time_point start = std::chrono::system_clock::now();
+  PresentationClock clock;
+
+  Decoder* stats_decoder = nullptr;
+  DecoderStats prev_stats;
+  DecoderStats prev_channel_stats[3];
+  UploadStats prev_upload_stats;
+  double prev_stats_seconds = 0.0;
+  Program* buffer_programs[4] = { bufferAShaderProgram, bufferBShaderProgram, bufferCShaderProgram, bufferDShaderProgram };
+  for ( int buffer = 0; buffer < 4; buffer++ ) {
+    if ( buffer_programs[buffer] && bufferPasses[buffer] == nullptr ) {
+      bufferPasses[buffer] = new BufferPass();
+    }
+  }
 
-  Decoder* decoder = renderer->decoder;
-  int prev_frames = -1;
-  void* pixels = nullptr;
+  // Without iTime the picture only changes with the channels, unless
+  // buffers feed back into themselves
+  bool animated = mainShaderProgram->HasUniform( "iTime" ) || mainShaderProgram->HasUniform( "iFrame" );
+  for ( Program* program : buffer_programs ) {
+    animated = animated || program != nullptr;
+  }
+  int frame = 0;
+  uint64_t redraws = 0;
+  uint64_t redraws_skipped = 0;
   while ( !glfwWindowShouldClose( window ) ) {
-    float elapsed_seconds = GetElapsedSeconds(start);
+    std::chrono::nanoseconds display_time = clock.Now();
+    double elapsed_seconds = PresentationClock::ToSeconds( display_time );
     std::array<float, 2> resolution = { renderer->viewport.z, renderer->viewport.w };
 
-    if ( decoder ) {
-      int curr_frames = elapsed_seconds * decoder->avg_frame_rate;
-      curr_frames = curr_frames % decoder->nb_frames;
-      int n = curr_frames - prev_frames;
+    if ( playlist ) {
+      playlist->Present( renderer, display_time );
+    } else if ( renderer->decoder ) {
+      renderer->SetVideoFrame( renderer->decoder->GetFrame( display_time ) );
+    } else if ( renderer->compressedVideo ) {
+      renderer->SetCompressedVideoFrame( renderer->compressedVideo->FrameAt( display_time ) );
+    }
+    for ( int channel = 1; channel <= 3; channel++ ) {
+      Decoder* channel_decoder = renderer->channelDecoders[channel - 1];
+      if ( channel_decoder ) {
+        renderer->SetChannelVideoFrame( channel, channel_decoder->GetFrame( display_time ) );
+      }
+    }
 
-      while (n > 0) {
-        pixels = decoder->GetFrame( elapsed_seconds );
-        --n;
+    if ( printStats && elapsed_seconds - prev_stats_seconds >= 1.0 ) {
+      Decoder* decoder = renderer->decoder;
+      if ( decoder != stats_decoder ) {
+        // Counters of a new video start from zero
+        prev_stats = DecoderStats();
+        stats_decoder = decoder;
       }
+      if ( decoder ) {
+        DecoderStats stats = decoder->GetStats();
+        std::cout << "[decoder] " << stats.Since( prev_stats ) << std::endl;
+        prev_stats = stats;
+      }
+      for ( int channel = 1; channel <= 3; channel++ ) {
+        Decoder* channel_decoder = renderer->channelDecoders[channel - 1];
+        if ( channel_decoder ) {
+          DecoderStats stats = channel_decoder->GetStats();
+          std::cout << "[decoder iChannel" << channel << "] " << stats.Since( prev_channel_stats[channel - 1] ) << std::endl;
+          prev_channel_stats[channel - 1] = stats;
+        }
+      }
+      const UploadStats& upload_stats = renderer->GetUploadStats();
+      std::cout << "[upload] " << upload_stats.Since( prev_upload_stats ) << std::endl;
+      std::cout << "[render] drawn " << redraws << ", skipped unchanged " << redraws_skipped << std::endl;
+      prev_upload_stats = upload_stats;
+      prev_stats_seconds = elapsed_seconds;
+      redraws = 0;
+      redraws_skipped = 0;
+    }
 
-      renderer->SetTexture0(pixels, decoder->width, decoder->height);
-      prev_frames = curr_frames;
+    bool changed = renderer->TakeContentChanged();
+    if ( skipUnchangedRedraws && !animated && !changed ) {
+      // The last picture is still up to date, check again after a refresh
+      ++redraws_skipped;
+      glfwWaitEventsTimeout( refreshInterval );
+      continue;
     }
+    ++redraws;
+
+    // Buffers hold raw values, they are neither blended nor cleared
+    glDisable( GL_BLEND );
+    for ( int buffer = 0; buffer < 4; buffer++ ) {
+      BufferPass* pass = bufferPasses[buffer];
+      if ( buffer_programs[buffer] == nullptr ) {
+        continue;
+      }
+      pass->Resize( int( resolution[0] ), int( resolution[1] ) );
+      pass->Bind();
+      bindPass( buffer_programs[buffer], pass->channels, { float( pass->Width() ), float( pass->Height() ) },
+        float( elapsed_seconds ), frame );
+      renderer->DrawQuad();
+      pass->Swap();
+    }
+    glBindFramebuffer( GL_FRAMEBUFFER, 0 );
 
-    mainShaderProgram->Use();
-    mainShaderProgram->BindFloat( "iTime", elapsed_seconds );
-    mainShaderProgram->BindVec2( "iResolution", resolution );
-    mainShaderProgram->BindTexture2D( "iChannel0", renderer->GetTexture0(), 0 );
-    mainShaderProgram->BindTexture2D( "iChannel1", renderer->GetTexture1(), 1 );
-    mainShaderProgram->BindTexture2D( "iChannel2", renderer->GetTexture2(), 2 );
-    mainShaderProgram->BindTexture2D( "iChannel3", renderer->GetTexture3(), 3 );
+    bindPass( mainShaderProgram, imageChannels, resolution, float( elapsed_seconds ), frame );
 
     renderer->SetRenderState();
     renderer->DrawQuad();
+    renderer->EndFrame();
+    ++frame;
 
     glfwSwapBuffers(window);
     glfwPollEvents();
   }
 }
 
+GLuint Application::channelTexture(const ChannelInput& input) const {
+  if ( input.source == ChannelSource::Buffer ) {
+    const BufferPass* pass = bufferPasses[input.index];
+    return pass ? pass->Texture() : 0;
+  }
+  if ( input.source == ChannelSource::Texture ) {
+    switch ( input.index ) {
+    case 0: return renderer->GetTexture0();
+    case 1: return renderer->GetTexture1();
+    case 2: return renderer->GetTexture2();
+    case 3: return renderer->GetTexture3();
+    }
+  }
+  return 0;
+}
+
+void Application::bindPass(const Program* program, const ChannelInputs& channels, std::array<float, 2> resolution, float time, int frame) const {
+  static const char* channel_names[4] = { "iChannel0", "iChannel1", "iChannel2", "iChannel3" };
+
+  program->Use();
+  program->BindFloat( "iTime", time );
+  // Shaders that declare iFrame themselves may make it a uint or a float
+  switch ( program->UniformType( "iFrame" ) ) {
+  case GL_INT:
+    program->BindInt( "iFrame", frame );
+    break;
+  case GL_UNSIGNED_INT:
+    program->BindUint( "iFrame", unsigned( frame ) );
+    break;
+  case GL_FLOAT:
+    program->BindFloat( "iFrame", float( frame ) );
+    break;
+  default:
+    // Not a uniform (e.g. a #define) or optimized away
+    break;
+  }
+  program->BindVec2( "iResolution", resolution );
+  for ( int channel = 0; channel < 4; channel++ ) {
+    program->BindTexture2D( channel_names[channel], channelTexture( channels[channel] ), channel );
+  }
+}
+
 void Application::terminate() {
+  // The buffers' textures go with the context
+  for ( BufferPass*& pass : bufferPasses ) {
+    delete pass;
+    pass = nullptr;
+  }
   glfwDestroyWindow(window);
   glfwTerminate();
 }
@@ -110,6 +216,9 @@ void Application::initWindow() {
 
   GLFWmonitor* monitor = glfwGetPrimaryMonitor();
   const GLFWvidmode *mode = glfwGetVideoMode(monitor);
+  if (mode->refreshRate > 0) {
+    refreshInterval = 1.0 / mode->refreshRate;
+  }
 
   glfwWindowHint(GLFW_TRANSPARENT_FRAMEBUFFER, GLFW_TRUE);
   glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
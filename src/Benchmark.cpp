@@ -0,0 +1,245 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#ifdef __cplusplus
+extern "C" {
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+#endif // __cplusplus
+
+#include "Benchmark.h"
+#include "ColorConverter.h"
+#include "CompressedVideo.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Decoded frames the converters take turns on
+const size_t CONVERTER_BENCH_FRAMES = 8;
+// Largest channel difference to swscale accepted. Its unscaled converters
+// work from 8-bit lookup tables, rounding a little differently.
+const int CONVERTER_MAX_DIFFERENCE = 6;
+
+const char* ThreadTypeName(int threadType) {
+  if (threadType & FF_THREAD_FRAME) {
+    return "frame";
+  }
+  if (threadType & FF_THREAD_SLICE) {
+    return "slice";
+  }
+  return "single";
+}
+
+} // anonymous namespace
+
+const char* ToString(DecoderThreading threading) {
+  switch (threading) {
+  case DecoderThreading::Auto: return "auto";
+  case DecoderThreading::Frame: return "frame";
+  case DecoderThreading::Slice: return "slice";
+  case DecoderThreading::None: return "none";
+  }
+  return "unknown";
+}
+
+bool RunDecoderBenchmark(const std::string& filename, const DecoderOptions& options,
+  const std::vector<DecoderThreading>& modes, double seconds) {
+  // A display time far ahead makes every GetFrame take all converted frames
+  const std::chrono::nanoseconds displayTime = std::chrono::hours(24 * 365);
+
+  for (DecoderThreading mode : modes) {
+    DecoderOptions benchOptions = options;
+    benchOptions.threading = mode;
+    benchOptions.catchUp = false;
+    benchOptions.lentBuffers = false;
+    // Measure the codec, not the caches
+    benchOptions.loopPrewarmFrames = 0;
+    benchOptions.frameCacheBytes = 0;
+
+    Decoder decoder(filename, benchOptions);
+    if (decoder.width <= 0 || decoder.height <= 0) {
+      std::cerr << "Failed to open video '" << filename << "' for benchmarking" << std::endl;
+      return false;
+    }
+
+    // The first frame comes after the codec primed, start the clock there
+    while (!decoder.GetFrame(displayTime)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    DecoderStats start = decoder.GetStats();
+    Clock::time_point startTime = Clock::now();
+
+    std::chrono::duration<double> elapsed(0.0);
+    while (elapsed.count() < seconds) {
+      decoder.GetFrame(displayTime);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      elapsed = Clock::now() - startTime;
+    }
+
+    DecoderStats stats = decoder.GetStats().Since(start);
+    uint64_t frames = stats.framesPresented + stats.framesDropped;
+    std::cout << "[bench] " << ToString(mode)
+              << " (" << ThreadTypeName(decoder.active_thread_type) << " x" << decoder.thread_count << "): "
+              << double(frames) / elapsed.count() << " fps"
+              << ", decode " << stats.decode.AverageMilliseconds() << " ms/frame"
+              << ", convert " << stats.convert.AverageMilliseconds() << " ms/frame"
+              << ", " << stats.framesUnchanged << " unchanged"
+              << ", " << stats.poolMisses << " pool misses"
+              << std::endl;
+
+    // Past the first frame the working set is complete; playing backwards
+    // still grows it with the longest GOP
+    if (stats.poolMisses > 0 && benchOptions.direction == PlaybackDirection::Forward) {
+      std::cerr << "The decoder's pool had to create " << stats.poolMisses << " frames, packets or planes after warming up" << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool RunCompressedVideoBenchmark(const std::string& filename, double seconds) {
+  CompressedVideo video(filename);
+  if (!video.IsOpen()) {
+    return false;
+  }
+
+  // Stands in for the pixel unpack buffers the renderer copies frames into
+  std::vector<uint8_t> upload(video.LumaBytes() + video.ChromaBytes());
+  Clock::time_point startTime = Clock::now();
+  std::chrono::duration<double> elapsed(0.0);
+  uint64_t frames = 0;
+  while (elapsed.count() < seconds) {
+    // Every frame in turn, at its own presentation time
+    int frame = video.FrameAt(std::chrono::microseconds(video.FramePts(int(frames % uint64_t(video.FrameCount())))));
+    std::memcpy(upload.data(), video.LumaBlocks(frame), video.LumaBytes());
+    std::memcpy(upload.data() + video.LumaBytes(), video.ChromaBlocks(frame), video.ChromaBytes());
+    frames++;
+    elapsed = Clock::now() - startTime;
+  }
+
+  std::cout << "[bench] prepared (" << video.width << "x" << video.height << "): "
+            << double(frames) / elapsed.count() << " fps"
+            << ", " << elapsed.count() * 1e3 / double(frames) << " ms/frame"
+            << ", " << double(upload.size()) / double(1 << 20) << " MiB/frame"
+            << std::endl;
+  return true;
+}
+
+bool RunConverterBenchmark(const std::string& filename, const DecoderOptions& options, double seconds) {
+  // Planar output hands over the decoded frames as they are
+  DecoderOptions benchOptions = options;
+  benchOptions.output = VideoOutput::Planar;
+  benchOptions.targetWidth = 0;
+  benchOptions.targetHeight = 0;
+  benchOptions.scaleMode = ScaleMode::Stretch;
+  benchOptions.direction = PlaybackDirection::Forward;
+  benchOptions.catchUp = false;
+  benchOptions.skipUnchangedFrames = false;
+  benchOptions.adaptiveQuality = false;
+  benchOptions.lentBuffers = false;
+  benchOptions.loopPrewarmFrames = 0;
+  benchOptions.frameCacheBytes = 0;
+
+  std::vector<AVFrame*> frames;
+  {
+    Decoder decoder(filename, benchOptions);
+    if (decoder.width <= 0 || decoder.height <= 0) {
+      std::cerr << "Failed to open video '" << filename << "' for benchmarking" << std::endl;
+      return false;
+    }
+    Clock::time_point deadline = Clock::now() + std::chrono::seconds(10);
+    while (frames.size() < CONVERTER_BENCH_FRAMES && decoder.LoopDuration() == 0 && Clock::now() < deadline) {
+      const VideoFrame* frame = decoder.NextFrame();
+      if (frame) {
+        // Keeps the planes alive once the decoder reuses the frame
+        frames.push_back(av_frame_clone(frame->source));
+      } else {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    }
+  }
+  auto freeFrames = [&frames]() {
+    for (AVFrame*& frame : frames) {
+      av_frame_free(&frame);
+    }
+  };
+  if (frames.empty() || !frames[0]) {
+    std::cerr << "No frames decoded from '" << filename << "' for benchmarking" << std::endl;
+    freeFrames();
+    return false;
+  }
+
+  const AVFrame* first = frames[0];
+  const char* formatName = av_get_pix_fmt_name((AVPixelFormat)first->format);
+  if (!ColorConverter::IsSupported(first->format)) {
+    std::cerr << "ColorConverter doesn't handle " << (formatName ? formatName : "this pixel format") << std::endl;
+    freeFrames();
+    return false;
+  }
+  int width = first->width;
+  int height = first->height;
+  int stride = width * 4;
+
+  SwsContext* swsContext = sws_getContext(width, height, (AVPixelFormat)first->format,
+    width, height, AV_PIX_FMT_RGBA, SWS_BILINEAR, nullptr, nullptr, nullptr);
+  if (!swsContext) {
+    std::cerr << "Failed to create a swscale context for benchmarking" << std::endl;
+    freeFrames();
+    return false;
+  }
+  MatchColorspace(swsContext, first);
+  ColorConverter converter(options.convertThreads);
+
+  std::vector<uint8_t> swsOutput(size_t(stride) * height);
+  std::vector<uint8_t> converterOutput(size_t(stride) * height);
+  uint8_t* dst[4] = { swsOutput.data(), nullptr, nullptr, nullptr };
+  int dstStride[4] = { stride, 0, 0, 0 };
+  auto convertSws = [&](const AVFrame* frame) {
+    sws_scale(swsContext, (const uint8_t* const*)(frame->data), frame->linesize, 0, height, dst, dstStride);
+  };
+
+  int maxDifference = 0;
+  for (const AVFrame* frame : frames) {
+    convertSws(frame);
+    converter.Convert(frame, converterOutput.data(), stride);
+    for (size_t i = 0; i < swsOutput.size(); i++) {
+      maxDifference = std::max(maxDifference, std::abs(int(swsOutput[i]) - int(converterOutput[i])));
+    }
+  }
+
+  // Half the time for each, round robin over the frames
+  auto measure = [&](auto convert) {
+    Clock::time_point startTime = Clock::now();
+    std::chrono::duration<double> elapsed(0.0);
+    uint64_t converted = 0;
+    while (elapsed.count() < seconds / 2.0) {
+      convert(frames[converted % frames.size()]);
+      converted++;
+      elapsed = Clock::now() - startTime;
+    }
+    return double(converted) * width * height / elapsed.count() / 1e6;
+  };
+  double swsRate = measure(convertSws);
+  double converterRate = measure([&](const AVFrame* frame) { converter.Convert(frame, converterOutput.data(), stride); });
+
+  sws_freeContext(swsContext);
+  freeFrames();
+
+  std::cout << "[bench] convert " << (formatName ? formatName : "?") << " " << width << "x" << height
+            << ": swscale " << swsRate << " MP/s"
+            << ", converter (" << ColorConverter::KernelName() << " x" << converter.ThreadCount() << ") "
+            << converterRate << " MP/s (" << converterRate / swsRate << "x)"
+            << ", max difference " << maxDifference
+            << std::endl;
+  if (maxDifference > CONVERTER_MAX_DIFFERENCE) {
+    std::cerr << "Converter output differs from swscale by up to " << maxDifference << std::endl;
+    return false;
+  }
+  return true;
+}
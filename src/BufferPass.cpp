@@ -0,0 +1,83 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include "BufferPass.h"
+
+namespace {
+
+struct BufferTextureFormat {
+  GLint internalFormat;
+  GLenum format;
+  GLenum type;
+};
+
+BufferTextureFormat GetTextureFormat(BufferFormat format) {
+  switch (format) {
+  case BufferFormat::RGBA8:
+    return { GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE };
+  case BufferFormat::RGBA16F:
+    return { GL_RGBA16F, GL_RGBA, GL_HALF_FLOAT };
+  case BufferFormat::R11G11B10F:
+    return { GL_R11F_G11F_B10F, GL_RGB, GL_UNSIGNED_INT_10F_11F_11F_REV };
+  case BufferFormat::RGBA32F:
+  default:
+    return { GL_RGBA32F, GL_RGBA, GL_FLOAT };
+  }
+}
+
+} // anonymous namespace
+
+BufferPass::BufferPass(BufferFormat format, float scale, const ChannelInputs& channels)
+  : format(format), scale(scale), channels(channels) {
+  glGenFramebuffers(1, &framebuffer);
+  glGenTextures(2, textures);
+}
+
+BufferPass::~BufferPass() {
+  glDeleteFramebuffers(1, &framebuffer);
+  glDeleteTextures(2, textures);
+}
+
+void BufferPass::Resize(int screenWidth, int screenHeight) {
+  int scaledWidth = std::max(1, int(std::lround(screenWidth * scale)));
+  int scaledHeight = std::max(1, int(std::lround(screenHeight * scale)));
+  if (scaledWidth == width && scaledHeight == height) {
+    return;
+  }
+  width = scaledWidth;
+  height = scaledHeight;
+
+  BufferTextureFormat textureFormat = GetTextureFormat(format);
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  for (GLuint texture : textures) {
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, textureFormat.internalFormat, width, height, 0,
+      textureFormat.format, textureFormat.type, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    // Feedback starts from black, not from whatever the memory held
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+      std::cerr << "Buffer texture of format " << int(format) << " can't be rendered to" << std::endl;
+    }
+    glViewport(0, 0, width, height);
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+  }
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void BufferPass::Bind() {
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textures[1 - front], 0);
+  glViewport(0, 0, width, height);
+}
+
+void BufferPass::Swap() {
+  front = 1 - front;
+}
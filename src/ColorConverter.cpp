@@ -0,0 +1,452 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined( __x86_64__ ) || defined( _M_X64 )
+  #define COLOR_CONVERTER_X86 1
+  #include <immintrin.h>
+  #if defined( _MSC_VER )
+    #include <intrin.h>
+  #endif
+#elif defined( __ARM_NEON ) || defined( __ARM_NEON__ )
+  #define COLOR_CONVERTER_NEON 1
+  #include <arm_neon.h>
+#endif
+
+#include "ColorConverter.h"
+
+namespace {
+
+// Coefficients are in 1/8192 units; rounding is added before the shift
+const int FRACTION_BITS = 13;
+const int ROUND = 1 << (FRACTION_BITS - 1);
+// Bands shorter than this aren't worth waking a worker for
+const int MIN_BAND_ROWS = 32;
+const int MAX_DEFAULT_THREADS = 4;
+
+using RowKernel = void (*)(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* rgba, int width, const ColorCoefficients& c);
+
+inline uint8_t Clamp(int value) {
+  return uint8_t(std::min(255, std::max(0, value)));
+}
+
+/**
+ * @brief Reference kernel, and the tail of rows the vector kernels leave.
+ * Uses the same integer math, so every kernel gives identical results.
+ */
+void ConvertRowScalar(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* rgba, int width, const ColorCoefficients& c) {
+  for (int x = 0; x < width; x++) {
+    int luma = (y[x] - c.yOffset) * c.y + ROUND;
+    int cb = u[x] - 128;
+    int cr = v[x] - 128;
+    rgba[4 * x + 0] = Clamp((luma + c.rv * cr) >> FRACTION_BITS);
+    rgba[4 * x + 1] = Clamp((luma + c.gu * cb + c.gv * cr) >> FRACTION_BITS);
+    rgba[4 * x + 2] = Clamp((luma + c.bu * cb) >> FRACTION_BITS);
+    rgba[4 * x + 3] = 255;
+  }
+}
+
+#if defined( COLOR_CONVERTER_X86 )
+
+// Two int16 coefficients for _mm_madd_epi16, `first` multiplies the even
+// (low) element of each pair
+inline int32_t Pair(int16_t first, int16_t second) {
+  return int32_t(uint16_t(first)) | (int32_t(second) * 65536);
+}
+
+/**
+ * @brief 8 pixels at a time: (Y, V) and (Y, U) are interleaved into pairs so
+ * one madd computes two terms of a channel in 32 bits.
+ */
+void ConvertRowSse2(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* rgba, int width, const ColorCoefficients& c) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i yOffset = _mm_set1_epi16(c.yOffset);
+  const __m128i chromaOffset = _mm_set1_epi16(128);
+  const __m128i one = _mm_set1_epi16(1);
+  const __m128i round = _mm_set1_epi32(ROUND);
+  const __m128i maxValue = _mm_set1_epi16(255);
+  const __m128i alpha = _mm_set1_epi16(int16_t(0xFF00));
+  const __m128i rCoefficients = _mm_set1_epi32(Pair(c.y, c.rv));
+  const __m128i gCoefficients = _mm_set1_epi32(Pair(c.y, c.gu));
+  // G's V term comes paired with 1, carrying the rounding
+  const __m128i gvCoefficients = _mm_set1_epi32(Pair(c.gv, int16_t(ROUND)));
+  const __m128i bCoefficients = _mm_set1_epi32(Pair(c.y, c.bu));
+
+  int x = 0;
+  for (; x + 8 <= width; x += 8) {
+    __m128i y16 = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(y + x)), zero), yOffset);
+    __m128i u16 = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(u + x)), zero), chromaOffset);
+    __m128i v16 = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(v + x)), zero), chromaOffset);
+
+    __m128i yvLow = _mm_unpacklo_epi16(y16, v16);
+    __m128i yvHigh = _mm_unpackhi_epi16(y16, v16);
+    __m128i yuLow = _mm_unpacklo_epi16(y16, u16);
+    __m128i yuHigh = _mm_unpackhi_epi16(y16, u16);
+    __m128i v1Low = _mm_unpacklo_epi16(v16, one);
+    __m128i v1High = _mm_unpackhi_epi16(v16, one);
+
+    __m128i r = _mm_packs_epi32(
+      _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yvLow, rCoefficients), round), FRACTION_BITS),
+      _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yvHigh, rCoefficients), round), FRACTION_BITS));
+    __m128i g = _mm_packs_epi32(
+      _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yuLow, gCoefficients), _mm_madd_epi16(v1Low, gvCoefficients)), FRACTION_BITS),
+      _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yuHigh, gCoefficients), _mm_madd_epi16(v1High, gvCoefficients)), FRACTION_BITS));
+    __m128i b = _mm_packs_epi32(
+      _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yuLow, bCoefficients), round), FRACTION_BITS),
+      _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yuHigh, bCoefficients), round), FRACTION_BITS));
+    r = _mm_min_epi16(_mm_max_epi16(r, zero), maxValue);
+    g = _mm_min_epi16(_mm_max_epi16(g, zero), maxValue);
+    b = _mm_min_epi16(_mm_max_epi16(b, zero), maxValue);
+
+    // R | G << 8 and B | A << 8 per pixel, interleaved into RGBA
+    __m128i rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+    __m128i ba = _mm_or_si128(b, alpha);
+    _mm_storeu_si128((__m128i*)(rgba + 4 * x), _mm_unpacklo_epi16(rg, ba));
+    _mm_storeu_si128((__m128i*)(rgba + 4 * x + 16), _mm_unpackhi_epi16(rg, ba));
+  }
+  ConvertRowScalar(y + x, u + x, v + x, rgba + 4 * x, width - x, c);
+}
+
+/**
+ * @brief The SSE2 kernel on 16 pixels. AVX2 unpacks within 128-bit lanes,
+ * which the packs undo, so only the final store needs reordering.
+ */
+#if !defined( _MSC_VER )
+__attribute__((target("avx2")))
+#endif
+void ConvertRowAvx2(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* rgba, int width, const ColorCoefficients& c) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i yOffset = _mm256_set1_epi16(c.yOffset);
+  const __m256i chromaOffset = _mm256_set1_epi16(128);
+  const __m256i one = _mm256_set1_epi16(1);
+  const __m256i round = _mm256_set1_epi32(ROUND);
+  const __m256i maxValue = _mm256_set1_epi16(255);
+  const __m256i alpha = _mm256_set1_epi16(int16_t(0xFF00));
+  const __m256i rCoefficients = _mm256_set1_epi32(Pair(c.y, c.rv));
+  const __m256i gCoefficients = _mm256_set1_epi32(Pair(c.y, c.gu));
+  const __m256i gvCoefficients = _mm256_set1_epi32(Pair(c.gv, int16_t(ROUND)));
+  const __m256i bCoefficients = _mm256_set1_epi32(Pair(c.y, c.bu));
+
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    __m256i y16 = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(y + x))), yOffset);
+    __m256i u16 = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(u + x))), chromaOffset);
+    __m256i v16 = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(v + x))), chromaOffset);
+
+    __m256i yvLow = _mm256_unpacklo_epi16(y16, v16);
+    __m256i yvHigh = _mm256_unpackhi_epi16(y16, v16);
+    __m256i yuLow = _mm256_unpacklo_epi16(y16, u16);
+    __m256i yuHigh = _mm256_unpackhi_epi16(y16, u16);
+    __m256i v1Low = _mm256_unpacklo_epi16(v16, one);
+    __m256i v1High = _mm256_unpackhi_epi16(v16, one);
+
+    __m256i r = _mm256_packs_epi32(
+      _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(yvLow, rCoefficients), round), FRACTION_BITS),
+      _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(yvHigh, rCoefficients), round), FRACTION_BITS));
+    __m256i g = _mm256_packs_epi32(
+      _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(yuLow, gCoefficients), _mm256_madd_epi16(v1Low, gvCoefficients)), FRACTION_BITS),
+      _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(yuHigh, gCoefficients), _mm256_madd_epi16(v1High, gvCoefficients)), FRACTION_BITS));
+    __m256i b = _mm256_packs_epi32(
+      _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(yuLow, bCoefficients), round), FRACTION_BITS),
+      _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(yuHigh, bCoefficients), round), FRACTION_BITS));
+    r = _mm256_min_epi16(_mm256_max_epi16(r, zero), maxValue);
+    g = _mm256_min_epi16(_mm256_max_epi16(g, zero), maxValue);
+    b = _mm256_min_epi16(_mm256_max_epi16(b, zero), maxValue);
+
+    __m256i rg = _mm256_or_si256(r, _mm256_slli_epi16(g, 8));
+    __m256i ba = _mm256_or_si256(b, alpha);
+    // Pixels 0-3 and 8-11, then 4-7 and 12-15
+    __m256i low = _mm256_unpacklo_epi16(rg, ba);
+    __m256i high = _mm256_unpackhi_epi16(rg, ba);
+    _mm256_storeu_si256((__m256i*)(rgba + 4 * x), _mm256_permute2x128_si256(low, high, 0x20));
+    _mm256_storeu_si256((__m256i*)(rgba + 4 * x + 32), _mm256_permute2x128_si256(low, high, 0x31));
+  }
+  ConvertRowSse2(y + x, u + x, v + x, rgba + 4 * x, width - x, c);
+}
+
+bool HasAvx2() {
+#if defined( _MSC_VER )
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7) {
+    return false;
+  }
+  __cpuid(info, 1);
+  // The OS has to save the YMM registers too
+  bool osxsave = (info[2] & (1 << 27)) != 0;
+  if (!osxsave || (_xgetbv(0) & 6) != 6) {
+    return false;
+  }
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#else
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // COLOR_CONVERTER_X86
+
+#if defined( COLOR_CONVERTER_NEON )
+
+/**
+ * @brief 8 pixels at a time, widening multiply-accumulates into 32 bits and
+ * an interleaving store.
+ */
+void ConvertRowNeon(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* rgba, int width, const ColorCoefficients& c) {
+  const int16x8_t yOffset = vdupq_n_s16(c.yOffset);
+  const int16x8_t chromaOffset = vdupq_n_s16(128);
+  const int32x4_t round = vdupq_n_s32(ROUND);
+  uint8x8x4_t pixels;
+  pixels.val[3] = vdup_n_u8(255);
+
+  int x = 0;
+  for (; x + 8 <= width; x += 8) {
+    int16x8_t y16 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(y + x))), yOffset);
+    int16x8_t u16 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(u + x))), chromaOffset);
+    int16x8_t v16 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(v + x))), chromaOffset);
+
+    int32x4_t lumaLow = vmlal_n_s16(round, vget_low_s16(y16), c.y);
+    int32x4_t lumaHigh = vmlal_n_s16(round, vget_high_s16(y16), c.y);
+
+    int32x4_t rLow = vmlal_n_s16(lumaLow, vget_low_s16(v16), c.rv);
+    int32x4_t rHigh = vmlal_n_s16(lumaHigh, vget_high_s16(v16), c.rv);
+    int32x4_t gLow = vmlal_n_s16(vmlal_n_s16(lumaLow, vget_low_s16(u16), c.gu), vget_low_s16(v16), c.gv);
+    int32x4_t gHigh = vmlal_n_s16(vmlal_n_s16(lumaHigh, vget_high_s16(u16), c.gu), vget_high_s16(v16), c.gv);
+    int32x4_t bLow = vmlal_n_s16(lumaLow, vget_low_s16(u16), c.bu);
+    int32x4_t bHigh = vmlal_n_s16(lumaHigh, vget_high_s16(u16), c.bu);
+
+    pixels.val[0] = vqmovun_s16(vcombine_s16(vshrn_n_s32(rLow, FRACTION_BITS), vshrn_n_s32(rHigh, FRACTION_BITS)));
+    pixels.val[1] = vqmovun_s16(vcombine_s16(vshrn_n_s32(gLow, FRACTION_BITS), vshrn_n_s32(gHigh, FRACTION_BITS)));
+    pixels.val[2] = vqmovun_s16(vcombine_s16(vshrn_n_s32(bLow, FRACTION_BITS), vshrn_n_s32(bHigh, FRACTION_BITS)));
+    vst4_u8(rgba + 4 * x, pixels);
+  }
+  ConvertRowScalar(y + x, u + x, v + x, rgba + 4 * x, width - x, c);
+}
+
+#endif // COLOR_CONVERTER_NEON
+
+struct Kernel {
+  RowKernel convert;
+  const char* name;
+};
+
+/**
+ * @brief Kernels this machine can run, the fastest first.
+ */
+const std::vector<Kernel>& AvailableKernels() {
+  static const std::vector<Kernel> kernels = []() {
+    std::vector<Kernel> available;
+#if defined( COLOR_CONVERTER_X86 )
+    if (HasAvx2()) {
+      available.push_back({ ConvertRowAvx2, "avx2" });
+    }
+    // Part of x86-64 itself
+    available.push_back({ ConvertRowSse2, "sse2" });
+#elif defined( COLOR_CONVERTER_NEON )
+    available.push_back({ ConvertRowNeon, "neon" });
+#endif
+    available.push_back({ ConvertRowScalar, "scalar" });
+    return available;
+  }();
+  return kernels;
+}
+
+bool IsFullRangeFormat(int format) {
+  return format == AV_PIX_FMT_YUVJ420P || format == AV_PIX_FMT_YUVJ444P;
+}
+
+} // anonymous namespace
+
+ColorCoefficients ColorCoefficients::For(AVColorSpace colorspace, AVColorRange range, int height) {
+  double kr = 0.299, kb = 0.114;
+  switch (colorspace) {
+  case AVCOL_SPC_BT709:
+    kr = 0.2126; kb = 0.0722;
+    break;
+  case AVCOL_SPC_BT2020_NCL:
+  case AVCOL_SPC_BT2020_CL:
+    kr = 0.2627; kb = 0.0593;
+    break;
+  case AVCOL_SPC_SMPTE240M:
+    kr = 0.212; kb = 0.087;
+    break;
+  case AVCOL_SPC_BT470BG:
+  case AVCOL_SPC_SMPTE170M:
+  case AVCOL_SPC_FCC:
+    break;
+  default:
+    if (height >= 720) {
+      kr = 0.2126; kb = 0.0722;
+    }
+    break;
+  }
+  double kg = 1.0 - kr - kb;
+
+  bool full = range == AVCOL_RANGE_JPEG;
+  double yScale = full ? 1.0 : 255.0 / 219.0;
+  double cScale = full ? 1.0 : 255.0 / 224.0;
+  auto fixed = [](double value) { return int16_t(std::lround(value * (1 << FRACTION_BITS))); };
+
+  ColorCoefficients c;
+  c.y = fixed(yScale);
+  c.rv = fixed(2.0 * (1.0 - kr) * cScale);
+  c.gu = fixed(-2.0 * kb * (1.0 - kb) / kg * cScale);
+  c.gv = fixed(-2.0 * kr * (1.0 - kr) / kg * cScale);
+  c.bu = fixed(2.0 * (1.0 - kb) * cScale);
+  c.yOffset = full ? 0 : 16;
+  return c;
+}
+
+ColorConverter::ColorConverter(int threads) {
+  if (threads <= 0) {
+    unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(MAX_DEFAULT_THREADS, int(std::max(1u, cores / 2)));
+  }
+  chromaRows.resize(size_t(threads));
+  for (int i = 0; i + 1 < threads; i++) {
+    workers.emplace_back(&ColorConverter::WorkerLoop, this, size_t(i));
+  }
+}
+
+ColorConverter::~ColorConverter() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  workCond.notify_all();
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+}
+
+bool ColorConverter::IsSupported(int format) {
+  switch (format) {
+  case AV_PIX_FMT_YUV420P:
+  case AV_PIX_FMT_YUVJ420P:
+  case AV_PIX_FMT_NV12:
+  case AV_PIX_FMT_YUV444P:
+  case AV_PIX_FMT_YUVJ444P:
+    return true;
+  default:
+    return false;
+  }
+}
+
+const char* ColorConverter::KernelName() {
+  return AvailableKernels().front().name;
+}
+
+std::vector<const char*> ColorConverter::KernelNames() {
+  std::vector<const char*> names;
+  for (const Kernel& kernel : AvailableKernels()) {
+    names.push_back(kernel.name);
+  }
+  return names;
+}
+
+bool ColorConverter::SelectKernel(const char* name) {
+  const std::vector<Kernel>& kernels = AvailableKernels();
+  for (size_t i = 0; i < kernels.size(); i++) {
+    if (std::strcmp(kernels[i].name, name) == 0) {
+      kernel = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ColorConverter::ConvertBand(const Band& band, std::vector<uint8_t>& chroma) const {
+  const AVFrame* frame = band.frame;
+  const int width = frame->width;
+  const RowKernel convert = AvailableKernels()[kernel].convert;
+  uint8_t* u = chroma.data();
+  uint8_t* v = chroma.data() + width;
+
+  for (int row = band.firstRow; row < band.firstRow + band.rows; row++) {
+    const uint8_t* y = frame->data[0] + size_t(row) * frame->linesize[0];
+    uint8_t* destination = band.destination + size_t(row) * band.destinationStride;
+
+    if (frame->format == AV_PIX_FMT_YUV444P || frame->format == AV_PIX_FMT_YUVJ444P) {
+      convert(y, frame->data[1] + size_t(row) * frame->linesize[1], frame->data[2] + size_t(row) * frame->linesize[2], destination, width, coefficients);
+      continue;
+    }
+
+    // A chroma row covers two rows; bands start on even rows
+    if (row == band.firstRow || (row & 1) == 0) {
+      if (frame->format == AV_PIX_FMT_NV12) {
+        const uint8_t* uv = frame->data[1] + size_t(row / 2) * frame->linesize[1];
+        for (int x = 0; x < width; x++) {
+          u[x] = uv[(x & ~1)];
+          v[x] = uv[(x & ~1) + 1];
+        }
+      } else {
+        const uint8_t* uRow = frame->data[1] + size_t(row / 2) * frame->linesize[1];
+        const uint8_t* vRow = frame->data[2] + size_t(row / 2) * frame->linesize[2];
+        for (int x = 0; x < width; x++) {
+          u[x] = uRow[x >> 1];
+          v[x] = vRow[x >> 1];
+        }
+      }
+    }
+    convert(y, u, v, destination, width, coefficients);
+  }
+}
+
+bool ColorConverter::Convert(const AVFrame* frame, uint8_t* destination, int destinationStride) {
+  if (!IsSupported(frame->format) || frame->width <= 0 || frame->height <= 0) {
+    return false;
+  }
+  AVColorRange range = IsFullRangeFormat(frame->format) ? AVCOL_RANGE_JPEG : frame->color_range;
+  coefficients = ColorCoefficients::For(frame->colorspace, range, frame->height);
+
+  // Workers are idle between frames, their buffers can grow here
+  for (std::vector<uint8_t>& chroma : chromaRows) {
+    if (chroma.size() < size_t(frame->width) * 2) {
+      chroma.resize(size_t(frame->width) * 2);
+    }
+  }
+
+  int count = std::max(1, std::min(ThreadCount(), frame->height / MIN_BAND_ROWS));
+  int rowsPerBand = (((frame->height + count - 1) / count) + 1) & ~1;
+  frameBands.clear();
+  for (int first = 0; first < frame->height; first += rowsPerBand) {
+    Band band;
+    band.frame = frame;
+    band.destination = destination;
+    band.destinationStride = destinationStride;
+    band.firstRow = first;
+    band.rows = std::min(rowsPerBand, frame->height - first);
+    frameBands.push_back(band);
+  }
+
+  // The caller converts the first band itself
+  if (frameBands.size() > 1) {
+    std::lock_guard<std::mutex> lock(mutex);
+    bands.assign(frameBands.begin() + 1, frameBands.end());
+    pendingBands = bands.size();
+  }
+  workCond.notify_all();
+  ConvertBand(frameBands[0], chromaRows.back());
+
+  std::unique_lock<std::mutex> lock(mutex);
+  doneCond.wait(lock, [this] { return pendingBands == 0; });
+  return true;
+}
+
+void ColorConverter::WorkerLoop(size_t worker) {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    workCond.wait(lock, [this] { return stopping || !bands.empty(); });
+    if (stopping) {
+      return;
+    }
+    Band band = bands.back();
+    bands.pop_back();
+    lock.unlock();
+    ConvertBand(band, chromaRows[worker]);
+    lock.lock();
+    if (--pendingBands == 0) {
+      doneCond.notify_all();
+    }
+  }
+}
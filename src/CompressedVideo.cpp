@@ -0,0 +1,353 @@
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <system_error>
+#include <thread>
+
+#include "CompressedVideo.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+const char MAGIC[4] = { 'S', 'Y', 'D', 'V' };
+// Bump whenever the layout changes
+const uint32_t VERSION = 1;
+const char EXTENSION[] = ".sydv";
+// Frames start on this boundary, the largest common page size
+const uint64_t FRAME_ALIGNMENT = 4096;
+// Frames paged in ahead of the one on screen
+const int PREFETCH_FRAMES = 4;
+// How long preparing waits for a frame before giving up on the decoder
+const std::chrono::seconds PREPARE_TIMEOUT(10);
+
+struct Header {
+  char magic[4];
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t frameCount;
+  uint32_t reserved;
+  uint64_t dataOffset;
+  uint64_t frameBytes;
+  int64_t loopMicroseconds;
+};
+
+uint64_t AlignUp(uint64_t value, uint64_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+size_t BlockBytes(int width, int height, size_t bytesPerBlock) {
+  return size_t((width + 3) / 4) * size_t((height + 3) / 4) * bytesPerBlock;
+}
+
+/**
+ * @brief Encode 16 texels as one RGTC1 (BC4) block: both endpoints, then a
+ * 3-bit index per texel, texel 0 in the lowest bits.
+ */
+void EncodeBlock(const uint8_t texels[16], uint8_t* block) {
+  uint8_t low = 255;
+  uint8_t high = 0;
+  for (int i = 0; i < 16; i++) {
+    low = std::min(low, texels[i]);
+    high = std::max(high, texels[i]);
+  }
+  block[0] = high;
+  block[1] = low;
+
+  // A flat block is all index 0
+  uint64_t indices = 0;
+  if (high > low) {
+    int range = high - low;
+    for (int i = 0; i < 16; i++) {
+      // Nearest of the 8 steps from low (0) to high (7). With red0 > red1,
+      // index 0 is red0, 1 is red1 and 2 to 7 step from red0 to red1.
+      int step = ((texels[i] - low) * 14 + range) / (2 * range);
+      uint64_t index = step == 7 ? 0 : step == 0 ? 1 : uint64_t(8 - step);
+      indices |= index << (3 * i);
+    }
+  }
+  for (int i = 0; i < 6; i++) {
+    block[2 + i] = uint8_t(indices >> (8 * i));
+  }
+}
+
+/**
+ * @brief Encode `channel` of an interleaved plane into BC4 blocks,
+ * `blockStride` bytes apart. Partial blocks repeat the last row and column.
+ */
+void EncodePlane(const uint8_t* plane, int width, int height, int channels, int channel,
+  uint8_t* blocks, size_t blockStride) {
+  uint8_t texels[16];
+  for (int by = 0; by < height; by += 4) {
+    for (int bx = 0; bx < width; bx += 4) {
+      for (int y = 0; y < 4; y++) {
+        const uint8_t* row = plane + size_t(std::min(by + y, height - 1)) * width * channels;
+        for (int x = 0; x < 4; x++) {
+          texels[y * 4 + x] = row[std::min(bx + x, width - 1) * channels + channel];
+        }
+      }
+      EncodeBlock(texels, blocks);
+      blocks += blockStride;
+    }
+  }
+}
+
+/**
+ * @brief Split an RGBA frame into full resolution Y and half resolution,
+ * interleaved Co/Cg, both offset to unsigned around 128.
+ */
+void ToYCoCg(const VideoFrame* frame, uint8_t* luma, uint8_t* chroma) {
+  const int width = frame->width;
+  const int height = frame->height;
+  for (int y = 0; y < height; y++) {
+    const uint8_t* row = frame->data[0] + size_t(y) * frame->linesize[0];
+    for (int x = 0; x < width; x++) {
+      const uint8_t* pixel = row + x * 4;
+      luma[size_t(y) * width + x] = uint8_t((pixel[0] + 2 * pixel[1] + pixel[2] + 2) >> 2);
+    }
+  }
+
+  const int chromaWidth = (width + 1) / 2;
+  const int chromaHeight = (height + 1) / 2;
+  for (int y = 0; y < chromaHeight; y++) {
+    for (int x = 0; x < chromaWidth; x++) {
+      // Sum of the 2x2 pixels, odd sizes repeat the last row and column
+      int r = 0, g = 0, b = 0;
+      for (int dy = 0; dy < 2; dy++) {
+        const uint8_t* row = frame->data[0] + size_t(std::min(2 * y + dy, height - 1)) * frame->linesize[0];
+        for (int dx = 0; dx < 2; dx++) {
+          const uint8_t* pixel = row + std::min(2 * x + dx, width - 1) * 4;
+          r += pixel[0];
+          g += pixel[1];
+          b += pixel[2];
+        }
+      }
+      uint8_t* cocg = chroma + (size_t(y) * chromaWidth + x) * 2;
+      // Co = (R - B) / 2 and Cg = (2G - R - B) / 4, of the average
+      cocg[0] = uint8_t(std::clamp(((r - b) >> 3) + 128, 0, 255));
+      cocg[1] = uint8_t(std::clamp(((2 * g - r - b) >> 4) + 128, 0, 255));
+    }
+  }
+}
+
+/**
+ * @brief Deletes a file when it goes out of scope, unless it was kept.
+ */
+class TemporaryFile
+{
+private:
+  std::string path;
+  bool keep = false;
+
+public:
+  explicit TemporaryFile(const std::string& path) : path(path) {}
+  ~TemporaryFile() {
+    if (!keep) {
+      std::error_code error;
+      fs::remove(path, error);
+    }
+  }
+
+  TemporaryFile(const TemporaryFile&) = delete;
+  TemporaryFile& operator=(const TemporaryFile&) = delete;
+
+  void Keep() { keep = true; }
+};
+
+} // anonymous namespace
+
+CompressedVideo::CompressedVideo(const std::string& filename)
+  : input(filename, true, 0) {
+  if (!input.IsMapped()) {
+    std::cerr << "Unable to map prepared video '" << filename << "'" << std::endl;
+    return;
+  }
+
+  Header header;
+  if (input.Size() < int64_t(sizeof(header))) {
+    std::cerr << "Prepared video '" << filename << "' is truncated" << std::endl;
+    return;
+  }
+  std::memcpy(&header, input.Data(), sizeof(header));
+  if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION) {
+    std::cerr << "'" << filename << "' is not a prepared video of this version, prepare it again" << std::endl;
+    return;
+  }
+
+  width = int(header.width);
+  height = int(header.height);
+  dataOffset = header.dataOffset;
+  frameBytes = header.frameBytes;
+  uint64_t tableOffset = dataOffset + uint64_t(header.frameCount) * frameBytes;
+  if (width <= 0 || height <= 0 || header.frameCount == 0 || frameBytes < LumaBytes() + ChromaBytes() ||
+      tableOffset + uint64_t(header.frameCount) * sizeof(int64_t) > uint64_t(input.Size())) {
+    std::cerr << "Prepared video '" << filename << "' is truncated" << std::endl;
+    width = 0;
+    height = 0;
+    return;
+  }
+
+  framePts.resize(header.frameCount);
+  std::memcpy(framePts.data(), input.Data() + tableOffset, framePts.size() * sizeof(int64_t));
+  // A loop lasts at least until its last frame was shown
+  loopMicroseconds = std::max(header.loopMicroseconds, framePts.back() + 1);
+}
+
+int CompressedVideo::FrameAt(std::chrono::nanoseconds displayTime) {
+  if (framePts.empty()) {
+    return 0;
+  }
+  int64_t time = std::chrono::duration_cast<std::chrono::microseconds>(displayTime).count() % loopMicroseconds;
+  auto next = std::upper_bound(framePts.begin(), framePts.end(), time);
+  int frame = next == framePts.begin() ? 0 : int(next - framePts.begin()) - 1;
+
+  if (frame != lastFrame) {
+    lastFrame = frame;
+    // The frames about to be shown, wrapping at the loop point
+    int first = (frame + 1) % FrameCount();
+    int count = std::min(PREFETCH_FRAMES, FrameCount() - first);
+    input.Prefetch(int64_t(dataOffset + uint64_t(first) * frameBytes), int64_t(uint64_t(count) * frameBytes));
+  }
+  return frame;
+}
+
+const uint8_t* CompressedVideo::LumaBlocks(int frame) const {
+  return input.Data() + dataOffset + uint64_t(frame) * frameBytes;
+}
+
+const uint8_t* CompressedVideo::ChromaBlocks(int frame) const {
+  return LumaBlocks(frame) + LumaBytes();
+}
+
+size_t CompressedVideo::LumaBytes() const {
+  return BlockBytes(width, height, 8);
+}
+
+size_t CompressedVideo::ChromaBytes() const {
+  return BlockBytes(ChromaWidth(), ChromaHeight(), 16);
+}
+
+bool CompressedVideo::IsCompressedVideo(const std::string& filename) {
+  size_t length = sizeof(EXTENSION) - 1;
+  return filename.size() > length && filename.compare(filename.size() - length, length, EXTENSION) == 0;
+}
+
+bool PrepareCompressedVideo(const std::string& source, const std::string& destination, const DecoderOptions& options) {
+  // Every frame of exactly one forward loop, in the decoder's own memory
+  DecoderOptions prepareOptions = options;
+  prepareOptions.output = VideoOutput::RGBA;
+  prepareOptions.lentBuffers = false;
+  prepareOptions.catchUp = false;
+  prepareOptions.skipUnchangedFrames = false;
+  prepareOptions.direction = PlaybackDirection::Forward;
+  prepareOptions.startSeconds = 0.0;
+  prepareOptions.syncTimeOfDay = false;
+  prepareOptions.loopPrewarmFrames = 0;
+  prepareOptions.frameCacheBytes = 0;
+
+  Decoder decoder(source, prepareOptions);
+  if (!decoder.IsRunning()) {
+    std::cerr << "Failed to open video '" << source << "' for preparing" << std::endl;
+    return false;
+  }
+
+  Header header = {};
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.width = uint32_t(decoder.output_width);
+  header.height = uint32_t(decoder.output_height);
+  header.dataOffset = AlignUp(sizeof(header), FRAME_ALIGNMENT);
+
+  const int width = decoder.output_width;
+  const int height = decoder.output_height;
+  const int chromaWidth = (width + 1) / 2;
+  const int chromaHeight = (height + 1) / 2;
+  const size_t lumaBytes = BlockBytes(width, height, 8);
+  const size_t chromaBytes = BlockBytes(chromaWidth, chromaHeight, 16);
+  header.frameBytes = AlignUp(lumaBytes + chromaBytes, FRAME_ALIGNMENT);
+
+  // Written aside and renamed, so a failed run never leaves a file that
+  // looks complete
+  std::string temporary = destination + ".tmp";
+  // Declared before the stream, so the stream is closed before it's removed
+  TemporaryFile temporaryFile(temporary);
+  std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+  if (!file) {
+    std::cerr << "Unable to write '" << temporary << "'" << std::endl;
+    return false;
+  }
+  file.seekp(std::streamoff(header.dataOffset));
+
+  std::vector<uint8_t> luma(size_t(width) * height);
+  std::vector<uint8_t> chroma(size_t(chromaWidth) * chromaHeight * 2);
+  // Zero padding up to the next frame stays as is
+  std::vector<uint8_t> blocks(header.frameBytes, 0);
+  std::vector<int64_t> framePts;
+
+  Clock::time_point start = Clock::now();
+  Clock::time_point lastFrameTime = start;
+  int64_t loop = 0;
+  while (true) {
+    const VideoFrame* frame = decoder.NextFrame();
+    if (!frame) {
+      if (Clock::now() - lastFrameTime > PREPARE_TIMEOUT) {
+        std::cerr << "Decoding '" << source << "' stalled after " << framePts.size() << " frames" << std::endl;
+        return false;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      continue;
+    }
+    lastFrameTime = Clock::now();
+
+    // Frames of the second loop come after the first one was measured
+    loop = decoder.LoopDuration();
+    if (loop > 0 && frame->pts >= loop) {
+      break;
+    }
+    if (frame->width != width || frame->height != height) {
+      std::cerr << "Frame size of '" << source << "' changed, can't prepare it" << std::endl;
+      return false;
+    }
+
+    ToYCoCg(frame, luma.data(), chroma.data());
+    EncodePlane(luma.data(), width, height, 1, 0, blocks.data(), 8);
+    EncodePlane(chroma.data(), chromaWidth, chromaHeight, 2, 0, blocks.data() + lumaBytes, 16);
+    EncodePlane(chroma.data(), chromaWidth, chromaHeight, 2, 1, blocks.data() + lumaBytes + 8, 16);
+    file.write(reinterpret_cast<const char*>(blocks.data()), std::streamsize(blocks.size()));
+    framePts.push_back(av_rescale_q(frame->pts, decoder.time_base, AVRational{ 1, AV_TIME_BASE }));
+
+    if (framePts.size() % 100 == 0) {
+      std::cout << "[prepare] " << framePts.size() << " frames" << std::endl;
+    }
+  }
+
+  header.frameCount = uint32_t(framePts.size());
+  header.loopMicroseconds = av_rescale_q(loop, decoder.time_base, AVRational{ 1, AV_TIME_BASE });
+  file.write(reinterpret_cast<const char*>(framePts.data()), std::streamsize(framePts.size() * sizeof(int64_t)));
+  file.seekp(0);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.close();
+  if (!file) {
+    std::cerr << "Failed to write '" << temporary << "'" << std::endl;
+    return false;
+  }
+
+  std::error_code error;
+  fs::rename(temporary, destination, error);
+  if (error) {
+    std::cerr << "Unable to rename '" << temporary << "' to '" << destination << "': " << error.message() << std::endl;
+    return false;
+  }
+  temporaryFile.Keep();
+
+  std::chrono::duration<double> elapsed = Clock::now() - start;
+  std::cout << "[prepare] " << destination << ": " << framePts.size() << " frames of "
+            << width << "x" << height << ", " << double(header.frameBytes) / double(1 << 20) << " MiB/frame"
+            << ", " << double(framePts.size()) / elapsed.count() << " fps" << std::endl;
+  return true;
+}
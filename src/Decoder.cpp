@@ -1,22 +1,351 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <ctime>
 #include <string>
 #include <iostream>
+#include <thread>
+
+#if defined(_WIN32) || defined(_WIN64)
+    #define NOMINMAX
+    #include <windows.h>
+#elif defined(__linux__)
+    #include <pthread.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
 // Must put in extern "C" block, otherwise can't found symbol at linking stage
 #include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
 #include <libswscale/swscale.h>
 #include <libavutil/avassert.h>
 }
 #endif // __cplusplus
 
 #include "Decoder.h"
+#include "ProbeCache.h"
+
+namespace {
+
+// Lag, in frames, from which the codec discards non-reference frames.
+const int64_t CATCH_UP_FRAMES = 2;
+// Lag that triggers a seek before the GOP length has been observed.
+const int64_t CATCH_UP_DEFAULT_GOP_SECONDS = 2;
+
+// Source of VideoFrame ids, shared by all decoders so a renderer can't
+// mistake a frame of one video for a frame of another.
+std::atomic<uint64_t> nextFrameId{ 1 };
+
+/**
+ * @brief Map a decoder pixel format to a layout the renderer can upload as
+ * planes, or AV_PIX_FMT_NONE if it has to be converted on the CPU.
+ */
+AVPixelFormat GetPlanarLayout(int format, AVColorRange* range) {
+  switch (format) {
+  case AV_PIX_FMT_YUVJ420P:
+    *range = AVCOL_RANGE_JPEG;
+    return AV_PIX_FMT_YUV420P;
+  case AV_PIX_FMT_YUVJ444P:
+    *range = AVCOL_RANGE_JPEG;
+    return AV_PIX_FMT_YUV444P;
+  case AV_PIX_FMT_YUV420P:
+  case AV_PIX_FMT_NV12:
+  case AV_PIX_FMT_P010:
+  case AV_PIX_FMT_YUV444P:
+    return (AVPixelFormat)format;
+  default:
+    return AV_PIX_FMT_NONE;
+  }
+}
+
+using Clock = std::chrono::steady_clock;
+
+/**
+ * @brief Pin the calling thread to `cpus`.
+ *
+ * @return bool false if the platform has no thread affinity (macOS) or the
+ * CPUs were rejected
+ */
+bool SetCurrentThreadAffinity(const std::vector<int>& cpus) {
+#if defined(_WIN32) || defined(_WIN64)
+  DWORD_PTR mask = 0;
+  for (int cpu : cpus) {
+    if (cpu >= 0 && cpu < int(sizeof(DWORD_PTR) * 8)) {
+      mask |= DWORD_PTR(1) << cpu;
+    }
+  }
+  return mask != 0 && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#elif defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    if (cpu >= 0 && cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  return CPU_COUNT(&set) > 0 && pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  (void)cpus;
+  return false;
+#endif
+}
+
+/**
+ * @brief 64-bit hash of the visible pixels of `frame` and its size and
+ * format, to tell a repeated picture from a new one. 0 for frames it can't
+ * read (hardware or palette frames).
+ */
+uint64_t HashPicture(const AVFrame* frame) {
+  const AVPixFmtDescriptor* descriptor = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+  if (!descriptor || (descriptor->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL))) {
+    return 0;
+  }
+  int rowBytes[4] = {};
+  if (av_image_fill_linesizes(rowBytes, (AVPixelFormat)frame->format, frame->width) < 0) {
+    return 0;
+  }
+
+  // Rounds of xxHash64, four independent lanes keep the multipliers busy
+  const uint64_t PRIME1 = 0x9E3779B185EBCA87ull;
+  const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4Full;
+  auto round = [&](uint64_t lane, uint64_t input) {
+    lane += input * PRIME2;
+    lane = (lane << 31) | (lane >> 33);
+    return lane * PRIME1;
+  };
+  uint64_t lanes[4] = { PRIME1 + PRIME2, PRIME2, 0, 0 - PRIME1 };
+  lanes[2] = round(lanes[2], (uint64_t(frame->width) << 32) | uint64_t(frame->height));
+  lanes[3] = round(lanes[3], uint64_t(frame->format));
+
+  for (int plane = 0; plane < 4 && frame->data[plane]; plane++) {
+    int rows = plane == 1 || plane == 2 ? AV_CEIL_RSHIFT(frame->height, descriptor->log2_chroma_h) : frame->height;
+    for (int y = 0; y < rows; y++) {
+      const uint8_t* row = frame->data[plane] + ptrdiff_t(y) * frame->linesize[plane];
+      int x = 0;
+      for (; x + 32 <= rowBytes[plane]; x += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+          uint64_t word;
+          std::memcpy(&word, row + x + lane * 8, sizeof(word));
+          lanes[lane] = round(lanes[lane], word);
+        }
+      }
+      uint64_t tail = 0;
+      for (; x < rowBytes[plane]; x++) {
+        tail = (tail << 8) | row[x];
+        if ((x & 7) == 7) {
+          lanes[0] = round(lanes[0], tail);
+          tail = 0;
+        }
+      }
+      lanes[1] = round(lanes[1], tail);
+    }
+  }
+
+  uint64_t hash = round(lanes[0], lanes[1]) ^ round(lanes[2], lanes[3]);
+  hash ^= hash >> 33;
+  hash *= PRIME2;
+  hash ^= hash >> 29;
+  return hash == 0 ? 1 : hash;
+}
+
+/**
+ * @brief Frames alive at once in a playing pipeline: the decoded queue, one
+ * held by the decode and one by the convert stage, the kept loop start, and
+ * a chunk of frames kept when playing backwards.
+ */
+size_t WorkingSetFrames(const DecoderOptions& options) {
+  size_t frames = options.decodedQueueSize + 2 + options.loopPrewarmFrames;
+  if (options.direction != PlaybackDirection::Forward) {
+    frames += options.reverseChunkFrames + 1;
+  }
+  return frames;
+}
+
+/**
+ * @brief Back off while a neighbouring stage catches up. Frames are tens of
+ * milliseconds apart, so a short sleep costs nothing and keeps idle stages
+ * off the CPU.
+ */
+void Backoff(int& attempts) {
+  if (attempts < 16) {
+    std::this_thread::yield();
+  } else {
+    std::this_thread::sleep_for(std::chrono::microseconds(attempts < 64 ? 500 : 2000));
+  }
+  ++attempts;
+}
+
+/**
+ * @brief Push into a full queue, waiting until the consumer makes room.
+ *
+ * @return bool false if the decoder is shutting down
+ */
+template <typename T>
+bool WaitPush(SPSCQueue<T>& queue, const T& value, const std::atomic<bool>& running) {
+  int attempts = 0;
+  while (!queue.Push(value)) {
+    if (!running) {
+      return false;
+    }
+    Backoff(attempts);
+  }
+  return true;
+}
+
+/**
+ * @brief Pop from an empty queue, waiting until the producer delivers.
+ *
+ * @return bool false if the decoder is shutting down
+ */
+template <typename T>
+bool WaitPop(SPSCQueue<T>& queue, T& value, const std::atomic<bool>& running) {
+  int attempts = 0;
+  while (!queue.Pop(value)) {
+    if (!running) {
+      return false;
+    }
+    Backoff(attempts);
+  }
+  return true;
+}
+
+} // anonymous namespace
 
-Decoder::Decoder(const std::string &filename) {
+void Decoder::StageCounter::Add(Clock::duration elapsed, uint64_t items) {
+  count.fetch_add(items, std::memory_order_relaxed);
+  totalNanoseconds.fetch_add(
+    std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+    std::memory_order_relaxed);
+}
+
+StageStats Decoder::StageCounter::Load() const {
+  StageStats stats;
+  stats.count = count.load(std::memory_order_relaxed);
+  stats.totalNanoseconds = totalNanoseconds.load(std::memory_order_relaxed);
+  return stats;
+}
+
+DecoderStats DecoderStats::Since(const DecoderStats& previous) const {
+  auto diff = [](const StageStats& a, const StageStats& b) {
+    StageStats stats;
+    stats.count = a.count - b.count;
+    stats.totalNanoseconds = a.totalNanoseconds - b.totalNanoseconds;
+    return stats;
+  };
+
+  DecoderStats stats = *this;
+  stats.demux = diff(demux, previous.demux);
+  stats.decode = diff(decode, previous.decode);
+  stats.convert = diff(convert, previous.convert);
+  stats.framesPresented = framesPresented - previous.framesPresented;
+  stats.framesDropped = framesDropped - previous.framesDropped;
+  stats.framesSkipped = framesSkipped - previous.framesSkipped;
+  stats.framesUnchanged = framesUnchanged - previous.framesUnchanged;
+  stats.framesDiscarded = framesDiscarded - previous.framesDiscarded;
+  stats.catchUpSeeks = catchUpSeeks - previous.catchUpSeeks;
+  stats.seek = diff(seek, previous.seek);
+  stats.seekFrames = seekFrames - previous.seekFrames;
+  stats.loopsPrewarmed = loopsPrewarmed - previous.loopsPrewarmed;
+  stats.packetsFromCache = packetsFromCache - previous.packetsFromCache;
+  stats.packetsFromDemuxer = packetsFromDemuxer - previous.packetsFromDemuxer;
+  stats.framesFromCache = framesFromCache - previous.framesFromCache;
+  stats.bytesRead = bytesRead - previous.bytesRead;
+  stats.foreignPackets = foreignPackets - previous.foreignPackets;
+  stats.pageFaults = pageFaults - previous.pageFaults;
+  stats.qualityChanges = qualityChanges - previous.qualityChanges;
+  stats.poolMisses = poolMisses - previous.poolMisses;
+  return stats;
+}
+
+void MatchColorspace(SwsContext* context, const AVFrame* frame) {
+  // SWS_CS_* share the AVColorSpace values
+  int colorspace = frame->colorspace;
+  switch (frame->colorspace) {
+  case AVCOL_SPC_BT709:
+  case AVCOL_SPC_FCC:
+  case AVCOL_SPC_BT470BG:
+  case AVCOL_SPC_SMPTE170M:
+  case AVCOL_SPC_SMPTE240M:
+  case AVCOL_SPC_BT2020_NCL:
+  case AVCOL_SPC_BT2020_CL:
+    break;
+  default:
+    colorspace = frame->height >= 720 ? SWS_CS_ITU709 : SWS_CS_ITU601;
+    break;
+  }
+  bool full = frame->color_range == AVCOL_RANGE_JPEG
+    || frame->format == AV_PIX_FMT_YUVJ420P || frame->format == AV_PIX_FMT_YUVJ444P;
+  sws_setColorspaceDetails(context,
+    sws_getCoefficients(colorspace), full ? 1 : 0,
+    sws_getCoefficients(SWS_CS_DEFAULT), 1,
+    0, 1 << 16, 1 << 16);
+}
+
+std::ostream& operator<<(std::ostream& os, const DecoderStats& stats) {
+  os << "queues packet/decoded/ready: "
+     << stats.packetQueueDepth << "/" << stats.decodedQueueDepth << "/" << stats.readyQueueDepth
+     << " (frame cap " << stats.maxBufferedFrames << ")"
+     << ", opened in " << stats.openMilliseconds << " ms" << (stats.probeCached ? " (probe cached)" : "")
+     << ", output " << stats.outputWidth << "x" << stats.outputHeight << " (lowres " << stats.lowres << ")"
+     << ", quality " << ToString(stats.quality) << " (load " << 100.0 * stats.decodeLoad << "%, changes " << stats.qualityChanges << ")"
+     << ", demux " << stats.demux.AverageMilliseconds() << " ms x" << stats.demux.count
+     << ", decode " << stats.decode.AverageMilliseconds() << " ms x" << stats.decode.count
+     << ", convert " << stats.convert.AverageMilliseconds() << " ms x" << stats.convert.count
+     << ", presented " << stats.framesPresented
+     << ", dropped " << stats.framesDropped
+     << ", skipped " << stats.framesSkipped
+     << ", unchanged " << stats.framesUnchanged
+     << ", discarded " << stats.framesDiscarded
+     << ", catch-up seeks " << stats.catchUpSeeks
+     << ", seek " << stats.seek.AverageMilliseconds() << " ms x" << stats.seek.count
+     << " (" << (stats.seek.count == 0 ? 0.0 : double(stats.seekFrames) / double(stats.seek.count)) << " frames)"
+     << ", prewarmed loops " << stats.loopsPrewarmed;
+
+  uint64_t packets = stats.packetsFromCache + stats.packetsFromDemuxer;
+  os << ", packet cache hits " << (packets == 0 ? 0.0 : 100.0 * double(stats.packetsFromCache) / double(packets))
+     << "% (" << double(stats.packetCacheBytes) / (1024.0 * 1024.0) << " MiB)"
+     << ", frames from cache " << stats.framesFromCache
+     << " (" << double(stats.frameCacheBytes) / (1024.0 * 1024.0) << " MiB)"
+     << ", read " << double(stats.bytesRead) / 1024.0 / (stats.framesPresented == 0 ? 1.0 : double(stats.framesPresented)) << " KiB/frame"
+     << ", foreign packets " << stats.foreignPackets
+     << ", page faults " << double(stats.pageFaults) / (stats.framesPresented == 0 ? 1.0 : double(stats.framesPresented)) << "/frame"
+     << ", pool misses " << stats.poolMisses;
+  return os;
+}
+
+Decoder::Decoder(const std::string &filename, const DecoderOptions& options)
+  : options(options),
+    input(filename, options.mapInput, options.readAheadBytes),
+    mediaPool(WorkingSetFrames(options), options.packetQueueSize + 2),
+    colorConverter(options.output == VideoOutput::RGBA && !options.swscaleConvert ? options.convertThreads : 1),
+    packetQueue(options.packetQueueSize),
+    decodedQueue(options.decodedQueueSize),
+    readyQueue(options.maxBufferedFrames),
+    freeQueue(options.maxBufferedFrames),
+    lentQueue(options.maxBufferedFrames),
+    packetCache(options.packetCacheBytes),
+    frameCache(options.frameCacheBytes) {
+  Clock::time_point openStart = Clock::now();
   pFormatContext = avformat_alloc_context();
 
+  pFormatContext->probesize = options.probeSize;
+  pFormatContext->max_analyze_duration = options.analyzeDuration;
+  if (input.Context()) {
+    pFormatContext->pb = input.Context();
+    pFormatContext->flags |= AVFMT_FLAG_CUSTOM_IO;
+  }
   avformat_open_input( &pFormatContext, filename.c_str(), nullptr, nullptr );
 
+  // Streams known from the header are dropped before probing even starts.
+  // Containers with an index (MP4) then skip their samples without reading
+  // them, others at least never hand them out as packets.
+  for (unsigned int i = 0; i < pFormatContext->nb_streams; i++) {
+    if (pFormatContext->streams[i]->codecpar->codec_type != AVMEDIA_TYPE_VIDEO) {
+      pFormatContext->streams[i]->discard = AVDISCARD_ALL;
+    }
+  }
+
   // printf("Format: %s, duration: %lld μs, #streams: %d\n",
   //   pFormatContext->iformat->long_name,
   //   pFormatContext->duration,
@@ -24,10 +353,16 @@ Decoder::Decoder(const std::string &filename) {
 
   duration = pFormatContext->duration;
 
-  const AVCodec *pCodec;
-  AVCodecParameters *pCodecParameters;
-  // Get all streams
-  avformat_find_stream_info( pFormatContext, nullptr );
+  const AVCodec *pCodec = nullptr;
+  AVCodecParameters *pCodecParameters = nullptr;
+  // Get all streams, from the probe cache if the file didn't change since
+  // it was probed
+  ProbeCache probeCache(options.probeCacheDirectory);
+  ProbeInfo probeInfo;
+  probe_cached = probeCache.Load(filename, &probeInfo) && probeInfo.Apply(pFormatContext);
+  if (!probe_cached) {
+    avformat_find_stream_info( pFormatContext, nullptr );
+  }
 
   // Iterate streams
   for (unsigned int i = 0; i < pFormatContext->nb_streams; i++)
@@ -47,14 +382,20 @@ Decoder::Decoder(const std::string &filename) {
       //   stream->avg_frame_rate.den,
       //   stream->time_base.den);
 
-      if (video_stream_index == -1) {
+      // Cover art is a video stream with a single picture
+      if (video_stream_index == -1 && !(stream->disposition & AV_DISPOSITION_ATTACHED_PIC)) {
         video_stream_index = i;
         pCodec = pLocalCodec;
         pCodecParameters = pLocalCodecParameters;
 
-        avg_frame_rate = stream->avg_frame_rate.num / stream->avg_frame_rate.den;
+        avg_frame_rate = stream->avg_frame_rate;
+        time_base = stream->time_base;
         duration = stream->duration;
         nb_frames = stream->nb_frames;
+        startPts = stream->start_time;
+        if (stream->duration > 0) {
+          clipDuration = stream->duration;
+        }
       }
     } else if (pLocalCodecParameters->codec_type == AVMEDIA_TYPE_AUDIO) {
       // If you interest audio stream
@@ -74,145 +415,1343 @@ Decoder::Decoder(const std::string &filename) {
     std::cerr << "File '" << filename << "' does not contain a video stream" << std::endl;
     return;
   }
-
-  // Allocate memory for AVCodedContext
-  pCodecContext = avcodec_alloc_context3(pCodec);
-  if (!pCodecContext) {
-    std::cerr << "Failed to allocated memory for AVCodecContext" << std::endl;
+  if (!pCodec) {
+    std::cerr << "No decoder for the video codec of file '" << filename << "'" << std::endl;
     return;
   }
+  // Lowest resolution the codec decodes at, for the load governor as well
+  maxLowres = pCodec->max_lowres;
+  for (unsigned int i = 0; i < pFormatContext->nb_streams; i++) {
+    if (int(i) != video_stream_index) {
+      pFormatContext->streams[i]->discard = AVDISCARD_ALL;
+    }
+  }
+
+  codec = pCodec;
 
   width = pCodecParameters->width;
   height = pCodecParameters->height;
 
+  cropWidth = width;
+  cropHeight = height;
+  output_width = width;
+  output_height = height;
+  if (options.targetWidth > 0 && options.targetHeight > 0 && width > 0 && height > 0) {
+    double targetAspect = double(options.targetWidth) / options.targetHeight;
+    if (options.scaleMode == ScaleMode::Fill) {
+      // Centered rectangle with the target's aspect ratio, on even
+      // coordinates so chroma planes crop along with luma
+      if (double(width) / height > targetAspect) {
+        cropWidth = std::min(width, (int(std::ceil(height * targetAspect)) + 1) & ~1);
+      } else {
+        cropHeight = std::min(height, (int(std::ceil(width / targetAspect)) + 1) & ~1);
+      }
+      cropX = ((width - cropWidth) / 2) & ~1;
+      cropY = ((height - cropHeight) / 2) & ~1;
+    }
+
+    // Smallest size covering the target, or fitting into it when
+    // letterboxed, even for 4:2:0 chroma
+    double scaleX = double(options.targetWidth) / cropWidth;
+    double scaleY = double(options.targetHeight) / cropHeight;
+    double scale = options.scaleMode == ScaleMode::Fit ? std::min(scaleX, scaleY) : std::max(scaleX, scaleY);
+    output_width = cropWidth;
+    output_height = cropHeight;
+    if (options.downscale && scale < 1.0) {
+      output_width = std::min(cropWidth, (int(std::ceil(cropWidth * scale)) + 1) & ~1);
+      output_height = std::min(cropHeight, (int(std::ceil(cropHeight * scale)) + 1) & ~1);
+    }
+  }
+  // Let the codec skip the detail nobody sees, as far as it can and without
+  // going below the output size
+  while (lowres < maxLowres &&
+         (cropWidth >> (lowres + 1)) >= output_width && (cropHeight >> (lowres + 1)) >= output_height) {
+    lowres++;
+  }
+
+  pCodecContext = OpenCodec(lowres);
+  if (!pCodecContext) {
+    return;
+  }
+  active_thread_type = pCodecContext->active_thread_type;
+  thread_count = pCodecContext->thread_count;
+  activeLowres = lowres;
+
+  if (avg_frame_rate.num > 0 && avg_frame_rate.den > 0) {
+    frameDuration = std::max<int64_t>(1, av_rescale_q(1, av_inv_q(avg_frame_rate), time_base));
+  } else {
+    // Unknown rate, assume 30 fps for the last frame of each loop
+    frameDuration = std::max<int64_t>(1, av_rescale_q(1, AVRational{ 1, 30 }, time_base));
+  }
+  frameBudget = std::chrono::nanoseconds(av_rescale_q(frameDuration, time_base, AVRational{ 1, 1000000000 }));
+  governor = LoadGovernor(lowres < maxLowres);
+
+  // Where to start, and whether keyframes have to be looked up for it
+  double clipSeconds = clipDuration > 0 ? double(clipDuration) * av_q2d(time_base)
+    : (pFormatContext->duration > 0 ? double(pFormatContext->duration) / AV_TIME_BASE : 0.0);
+  double startSeconds = options.startSeconds;
+  if (options.syncTimeOfDay) {
+    if (clipSeconds > 0.0) {
+      std::chrono::system_clock::time_point now = std::chrono::system_clock::now();
+      std::time_t seconds = std::chrono::system_clock::to_time_t(now);
+      std::tm local = *std::localtime(&seconds);
+      double sinceMidnight = local.tm_hour * 3600.0 + local.tm_min * 60.0 + local.tm_sec +
+        std::chrono::duration<double>(now - std::chrono::system_clock::from_time_t(seconds)).count();
+      startSeconds = std::fmod(sinceMidnight, clipSeconds);
+    } else {
+      std::cerr << "Unknown video duration, can't sync it to the time of day" << std::endl;
+    }
+  } else if (clipSeconds > 0.0) {
+    // Past the end wraps around like the loop does
+    startSeconds = std::fmod(startSeconds, clipSeconds);
+  }
+  if (this->options.direction != PlaybackDirection::Forward && clipDuration <= 0) {
+    std::cerr << "Unknown video duration, can't play it backwards" << std::endl;
+    this->options.direction = PlaybackDirection::Forward;
+  }
+  bool indexBuilt = false;
+  if (this->options.direction != PlaybackDirection::Forward || startSeconds > 0.0) {
+    if (probe_cached && !probeInfo.keyframes.empty()) {
+      keyframeIndex.Assign(probeInfo.keyframes);
+    } else {
+      indexBuilt = keyframeIndex.Build(pFormatContext, video_stream_index);
+    }
+    if (keyframeIndex.Empty()) {
+      std::cerr << "No keyframes found, playing forward from the start" << std::endl;
+      this->options.direction = PlaybackDirection::Forward;
+      startSeconds = 0.0;
+    }
+  }
+  reverseDemuxPass = reverseDecodePass = this->options.direction == PlaybackDirection::Reverse;
+  if (startSeconds > 0.0 && !reverseDemuxPass) {
+    // The frame at the start offset lands on timeline pts 0
+    int64_t offset = av_rescale_q(std::llround(startSeconds * 1e6), AVRational{ 1, 1000000 }, time_base);
+    startTarget = (startPts == AV_NOPTS_VALUE ? 0 : startPts) + offset;
+    loopOffset = -offset;
+    passEnd = loopOffset;
+    passStart = loopOffset;
+  }
+  passFromStart = startTarget == AV_NOPTS_VALUE && !reverseDecodePass;
+
+  if (!probe_cached || indexBuilt) {
+    // Keep a cached index unless a new one was built
+    std::vector<KeyframeIndex::Entry> keyframes = indexBuilt ? keyframeIndex.Entries() : std::move(probeInfo.keyframes);
+    probeInfo.Capture(pFormatContext, video_stream_index);
+    probeInfo.keyframes = std::move(keyframes);
+    probeCache.Store(filename, probeInfo);
+  }
+  open_milliseconds = std::chrono::duration<double, std::milli>(Clock::now() - openStart).count();
+
+  lastQueuedPicture = mediaPool.GetFrame();
+  framePool.resize(options.maxBufferedFrames);
+  for (VideoFrame& frame : framePool) {
+    frame.source = av_frame_alloc();
+    if (!frame.source) {
+      std::cerr << "Failed to allocated memory for AVFrame" << std::endl;
+      return;
+    }
+    freeQueue.Push(&frame);
+  }
+
+  running = true;
+  auto pinned = [this](void (Decoder::*loop)()) {
+    return std::thread([this, loop]() {
+      if (!this->options.cpus.empty() && !SetCurrentThreadAffinity(this->options.cpus)) {
+        std::cerr << "Failed to set decoder thread affinity" << std::endl;
+      }
+      (this->*loop)();
+    });
+  };
+  demuxThread = pinned(&Decoder::DemuxLoop);
+  decodeThread = pinned(&Decoder::DecodeLoop);
+  convertThread = pinned(&Decoder::ConvertLoop);
+}
+
+bool Decoder::CatchUp(const AVPacket* packet, int64_t gopDuration) {
+  // Only act on a stable mapping: the decode stage saw a frame of this pass
+  // and no earlier jump is still travelling down the pipeline.
+  int64_t toTimeline = streamToTimeline.load(std::memory_order_relaxed);
+  if (!options.catchUp || packet->pts == AV_NOPTS_VALUE || toTimeline == AV_NOPTS_VALUE ||
+      seekPending.load() || demuxPass != decodePass.load(std::memory_order_acquire)) {
+    return false;
+  }
+
+  int64_t display = displayPts.load(std::memory_order_relaxed);
+  int64_t lag = display - (packet->pts + toTimeline);
+  if (lag <= (gopDuration > 0 ? gopDuration : av_rescale_q(CATCH_UP_DEFAULT_GOP_SECONDS, AVRational{ 1, 1 }, time_base))) {
+    return false;
+  }
+
+  int64_t clip = clipDuration.load(std::memory_order_relaxed);
+  int64_t start = passStart.load(std::memory_order_relaxed);
+  if (clip > 0 && display >= start + clip) {
+    // The display time is in a later loop, skip whole passes at once
+    DemuxedPacket skip;
+    skip.kind = PacketKind::SkipPasses;
+    skip.passes = (display - start) / clip;
+    skip.cachedPass = cachedDemuxPass = frameCache.Ready();
+    seekPending = true;
+    if (!WaitPush(packetQueue, skip, running)) {
+      return true;
+    }
+    demuxPass++;
+    RewindPass();
+  } else {
+    // Land on the keyframe before the display time, the frames between it
+    // and the display time are decoded but never converted
+    if (packetCache.IsComplete()) {
+      if (!packetCache.Seek(display - toTimeline)) {
+        return false;
+      }
+    } else {
+      if (av_seek_frame(pFormatContext, video_stream_index, display - toTimeline, AVSEEK_FLAG_BACKWARD) < 0) {
+        return false;
+      }
+      // This pass no longer covers the whole stream
+      packetCache.AbortRecording();
+    }
+    DemuxedPacket seek;
+    seek.kind = PacketKind::Seek;
+    seek.target = display;
+    seekPending = true;
+    if (!WaitPush(packetQueue, seek, running)) {
+      return true;
+    }
+  }
+  catchUpSeeks.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+/**
+ * @brief Read the next packet, from the packet cache once it holds a whole
+ * pass.
+ */
+int Decoder::ReadPacket(AVPacket* packet) {
+  if (packetCache.IsComplete()) {
+    if (!packetCache.Read(packet, video_stream_index)) {
+      return AVERROR_EOF;
+    }
+    packetsFromCache.fetch_add(1, std::memory_order_relaxed);
+    return 0;
+  }
+
+  int ret = 0;
+  while ((ret = av_read_frame(pFormatContext, packet)) >= 0 && packet->stream_index != video_stream_index) {
+    foreignPackets.fetch_add(1, std::memory_order_relaxed);
+    av_packet_unref(packet);
+  }
+  if (pFormatContext->pb) {
+    bytesRead.store(pFormatContext->pb->bytes_read, std::memory_order_relaxed);
+  }
+  if (ret >= 0) {
+    packetCache.Record(packet);
+    packetsFromDemuxer.fetch_add(1, std::memory_order_relaxed);
+  } else if (ret == AVERROR_EOF) {
+    packetCache.FinishRecording();
+  } else {
+    packetCache.AbortRecording();
+  }
+  packetCacheBytes.store(packetCache.ResidentBytes(), std::memory_order_relaxed);
+  return ret;
+}
+
+/**
+ * @brief Go back to the start of the stream for the next pass.
+ */
+void Decoder::RewindPass() {
+  if (packetCache.IsComplete()) {
+    packetCache.Rewind();
+    return;
+  }
+  av_seek_frame(pFormatContext, video_stream_index, 0, AVSEEK_FLAG_FRAME);
+  packetCache.BeginRecording(pFormatContext->pb ? avio_size(pFormatContext->pb) : 0);
+}
+
+/**
+ * @brief Have the bytes of a GOP paged in before the demuxer reads them.
+ */
+void Decoder::PrefetchGop(int keyframe) {
+  if (keyframe < 0 || size_t(keyframe) + 1 >= keyframeIndex.Size()) {
+    return;
+  }
+  int64_t begin = keyframeIndex[keyframe].pos;
+  int64_t end = keyframeIndex[keyframe + 1].pos;
+  if (begin >= 0 && end > begin) {
+    input.Prefetch(begin, end - begin);
+  }
+}
+
+/**
+ * @brief Continue reading at a keyframe of the index.
+ */
+bool Decoder::SeekToKeyframe(int keyframe) {
+  if (packetCache.IsComplete()) {
+    return packetCache.SeekKeyframe(keyframeIndex[keyframe].timestamp);
+  }
+  PrefetchGop(keyframe);
+  // A pass that jumps can't be cached
+  packetCache.AbortRecording();
+  return av_seek_frame(pFormatContext, video_stream_index, keyframeIndex[keyframe].timestamp, AVSEEK_FLAG_BACKWARD) >= 0;
+}
+
+/**
+ * @brief Read the GOPs from the last to the first, each followed by a
+ * marker for the decode stage to play it backwards.
+ *
+ * @return bool false if the decoder is shutting down or failed
+ */
+bool Decoder::DemuxReversePass() {
+  // First keyframe of the GOP played last, where the next one ends. The
+  // index only says where to seek: GOPs are cut at the keyframes actually
+  // read, so one the index misses or has in excess can't skip or repeat
+  // frames.
+  int64_t gopEnd = AV_NOPTS_VALUE;
+  for (int keyframe = int(keyframeIndex.Size()) - 1; keyframe >= 0; keyframe--) {
+    if (!SeekToKeyframe(keyframe)) {
+      continue;
+    }
+    // The GOP read next, while this one is decoded
+    if (!packetCache.IsComplete()) {
+      PrefetchGop(keyframe - 1);
+    }
+
+    bool started = false;
+    int64_t gopStart = gopEnd;
+    while (running) {
+      AVPacket* packet = mediaPool.GetPacket();
+      if (!packet) {
+        std::cerr << "Failed to allocated memory for AVPacket" << std::endl;
+        return false;
+      }
+      Clock::time_point start = Clock::now();
+      if (ReadPacket(packet) < 0) {
+        mediaPool.Release(packet);
+        break;
+      }
+      demuxCounter.Add(Clock::now() - start);
+
+      if (packet->flags & AV_PKT_FLAG_KEY) {
+        int64_t timestamp = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+        bool played = timestamp == AV_NOPTS_VALUE ? started
+          : gopEnd != AV_NOPTS_VALUE && timestamp >= gopEnd;
+        if (played) {
+          // The GOP already played, or the seek landed on it again; without
+          // timestamps any next keyframe has to end the GOP
+          mediaPool.Release(packet);
+          break;
+        }
+        if (!started) {
+          started = true;
+          if (timestamp != AV_NOPTS_VALUE) {
+            gopStart = timestamp;
+          }
+        }
+      } else if (!started) {
+        mediaPool.Release(packet);
+        continue;
+      }
+
+      DemuxedPacket data;
+      data.packet = packet;
+      if (!WaitPush(packetQueue, data, running)) {
+        mediaPool.Release(packet);
+        return false;
+      }
+    }
+
+    if (!started) {
+      continue;
+    }
+    gopEnd = gopStart;
+    DemuxedPacket end;
+    end.kind = PacketKind::EndOfReverseGop;
+    if (!WaitPush(packetQueue, end, running)) {
+      return false;
+    }
+  }
+
+  bool nextReverse = options.direction == PlaybackDirection::Reverse;
+  cachedDemuxPass = !nextReverse && frameCache.Ready();
+  DemuxedPacket end;
+  end.kind = PacketKind::EndOfPass;
+  end.cachedPass = cachedDemuxPass;
+  end.reversePass = nextReverse;
+  if (!WaitPush(packetQueue, end, running)) {
+    return false;
+  }
+  demuxPass++;
+  reverseDemuxPass = nextReverse;
+  if (!reverseDemuxPass) {
+    RewindPass();
+  }
+  return true;
+}
+
+void Decoder::DemuxLoop() {
+  int64_t lastKeyframePts = AV_NOPTS_VALUE;
+  int64_t gopDuration = 0;
+
+  // GOPs with cached decoded frames are not sent to the codec, only a marker
+  // where their frames go
+  int gop = 0;
+  int markedGop = -1;
+
+  if (startTarget != AV_NOPTS_VALUE) {
+    // Fast start: only the GOP before the start offset is decoded
+    SeekToKeyframe(std::max(0, keyframeIndex.Find(startTarget)));
+    DemuxedPacket seek;
+    seek.kind = PacketKind::Seek;
+    seek.target = 0;
+    seekPending = true;
+    if (!WaitPush(packetQueue, seek, running)) {
+      return;
+    }
+  } else if (!reverseDemuxPass) {
+    packetCache.BeginRecording(pFormatContext->pb ? avio_size(pFormatContext->pb) : 0);
+  }
+
+  while (running) {
+    if (reverseDemuxPass) {
+      if (!DemuxReversePass()) {
+        return;
+      }
+      gop = 0;
+      markedGop = -1;
+      continue;
+    }
+
+    AVPacket* packet = mediaPool.GetPacket();
+    if (!packet) {
+      std::cerr << "Failed to allocated memory for AVPacket" << std::endl;
+      return;
+    }
+
+    Clock::time_point start = Clock::now();
+    int ret = ReadPacket(packet);
+
+    if (ret == AVERROR_EOF) { // End of file, drain the codec and seek to video beginning
+      mediaPool.Release(packet);
+      bool nextReverse = options.direction != PlaybackDirection::Forward;
+      cachedDemuxPass = !nextReverse && frameCache.Ready();
+      DemuxedPacket end;
+      end.kind = PacketKind::EndOfPass;
+      end.cachedPass = cachedDemuxPass;
+      end.reversePass = nextReverse;
+      if (!WaitPush(packetQueue, end, running)) {
+        return;
+      }
+      demuxPass++;
+      lastKeyframePts = AV_NOPTS_VALUE;
+      gop = 0;
+      markedGop = -1;
+      reverseDemuxPass = nextReverse;
+      if (!reverseDemuxPass) {
+        RewindPass();
+      }
+      continue;
+    } else if (ret < 0) {
+      // printf("call av_read_frame() failed: %s\n", av_err2str(ret));
+      printf("call av_read_frame() failed: %d\n", ret);
+      mediaPool.Release(packet);
+      return;
+    }
+    demuxCounter.Add(Clock::now() - start);
+
+    if ((packet->flags & AV_PKT_FLAG_KEY) && packet->pts != AV_NOPTS_VALUE) {
+      if (lastKeyframePts != AV_NOPTS_VALUE && packet->pts > lastKeyframePts) {
+        gopDuration = packet->pts - lastKeyframePts;
+      }
+      lastKeyframePts = packet->pts;
+    }
+
+    if (CatchUp(packet, gopDuration)) {
+      // Jumped away, this packet is stale
+      mediaPool.Release(packet);
+      lastKeyframePts = AV_NOPTS_VALUE;
+      gop = -1;
+      markedGop = -1;
+      continue;
+    }
+
+    if (cachedDemuxPass) {
+      if (packet->flags & AV_PKT_FLAG_KEY) {
+        int keyGop = frameCache.FindGop(packet->pts);
+        if (keyGop >= 0) {
+          gop = keyGop;
+        }
+      }
+      if (frameCache.IsCached(gop)) {
+        mediaPool.Release(packet);
+        if (gop != markedGop) {
+          DemuxedPacket marker;
+          marker.kind = PacketKind::CachedGop;
+          marker.gop = gop;
+          if (!WaitPush(packetQueue, marker, running)) {
+            return;
+          }
+          markedGop = gop;
+        }
+        continue;
+      }
+    }
+
+    DemuxedPacket data;
+    data.packet = packet;
+    if (!WaitPush(packetQueue, data, running)) {
+      mediaPool.Release(packet);
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Keep the first frames of the clip, and drop frames of a re-primed
+ * pass that were already played from them.
+ *
+ * @return bool false if `frame` was consumed and must not be passed on
+ */
+bool Decoder::PrewarmLoopStart(AVFrame* frame) {
+  int64_t relativePts = frame->pts - loopOffset;
+
+  if (replayedUntil != AV_NOPTS_VALUE) {
+    if (relativePts <= replayedUntil) {
+      mediaPool.Release(frame);
+      return false;
+    }
+    replayedUntil = AV_NOPTS_VALUE;
+  }
+
+  if (passFromStart && !loopStartComplete && options.loopPrewarmFrames > 0) {
+    AVFrame* copy = mediaPool.CloneFrame(frame);
+    if (copy) {
+      copy->pts = relativePts;
+      loopStartFrames.push_back(copy);
+      loopStartComplete = loopStartFrames.size() >= options.loopPrewarmFrames;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Start a new pass with the kept frames, while the codec decodes
+ * the start of the clip again behind them.
+ *
+ * @return bool false if the decoder is shutting down
+ */
+bool Decoder::ReplayLoopStart() {
+  if (!loopStartComplete) {
+    // Not enough frames were seen from the start yet, try on the next pass
+    ReleaseLoopStart();
+    return true;
+  }
+
+  for (AVFrame* cached : loopStartFrames) {
+    AVFrame* frame = mediaPool.CloneFrame(cached);
+    if (!frame) {
+      break;
+    }
+    frame->pts = cached->pts + loopOffset;
+    replayedUntil = cached->pts;
+    lastDecodedPts = frame->pts;
+    if (!WaitPush(decodedQueue, frame, running)) {
+      mediaPool.Release(frame);
+      return false;
+    }
+  }
+  loopsPrewarmed.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+void Decoder::ReleaseLoopStart() {
+  for (AVFrame* frame : loopStartFrames) {
+    mediaPool.Release(frame);
+  }
+  loopStartFrames.clear();
+  loopStartComplete = false;
+}
+
+/**
+ * @brief Queue the cached frames of a GOP in place of decoding it.
+ *
+ * @return bool false if the decoder is shutting down
+ */
+bool Decoder::ReplayGop(int gop) {
+  if (!frameCache.IsCached(gop)) {
+    return true;
+  }
+  for (AVFrame* cached : frameCache.Frames(gop)) {
+    AVFrame* frame = mediaPool.CloneFrame(cached);
+    if (!frame) {
+      return true;
+    }
+    frame->pts = cached->pts - startPts + loopOffset;
+    streamToTimeline.store(loopOffset - startPts, std::memory_order_relaxed);
+    passEnd = std::max(passEnd, frame->pts + frameDuration);
+    lastDecodedPts = frame->pts;
+    if (!WaitPush(decodedQueue, frame, running)) {
+      mediaPool.Release(frame);
+      return false;
+    }
+    framesFromCache.fetch_add(1, std::memory_order_relaxed);
+  }
+  return true;
+}
+
+/**
+ * @brief Play the collected GOP backwards. Only the last frames of a chunk
+ * are kept, each chunk decodes the GOP again up to where the chunk after it
+ * started, so memory stays bounded for long GOPs.
+ *
+ * @return bool false if the decoder is shutting down or failed
+ */
+bool Decoder::DecodeReverseGop() {
+  int64_t chunk = std::max<int64_t>(1, int64_t(options.reverseChunkFrames));
+  // Number of frames in the GOP, known after the first chunk
+  int64_t total = -1;
+  int64_t end = 0;
+  std::vector<AVFrame*> kept;
+  bool ok = true;
+
+  pCodecContext->skip_frame = AVDISCARD_DEFAULT;
+  do {
+    Clock::time_point start = Clock::now();
+    int64_t begin = std::max<int64_t>(0, end - chunk);
+    int64_t index = 0;
+    bool done = false;
+    avcodec_flush_buffers(pCodecContext);
+
+    // One more round with a null packet drains the codec
+    for (size_t i = 0; i <= reverseGop.size() && !done; i++) {
+      if (avcodec_send_packet(pCodecContext, i < reverseGop.size() ? reverseGop[i] : nullptr) < 0) {
+        continue;
+      }
+      while (!done) {
+        AVFrame* frame = mediaPool.GetFrame();
+        if (!frame) {
+          std::cerr << "Failed to allocated memory for AVFrame" << std::endl;
+          ok = false;
+          done = true;
+          break;
+        }
+        if (avcodec_receive_frame(pCodecContext, frame) < 0) {
+          mediaPool.Release(frame);
+          break;
+        }
+
+        if (total < 0) {
+          kept.push_back(frame);
+          if (int64_t(kept.size()) > chunk) {
+            mediaPool.Release(kept.front());
+            kept.erase(kept.begin());
+          }
+        } else if (index >= begin) {
+          kept.push_back(frame);
+        } else {
+          mediaPool.Release(frame);
+        }
+        index++;
+        done = total >= 0 && index >= end;
+      }
+    }
+
+    if (total < 0) {
+      total = index;
+      begin = std::max<int64_t>(0, total - chunk);
+    }
+    end = begin;
+    decodeCounter.Add(Clock::now() - start, kept.size());
+    if (ok && !QueueReversed(kept)) {
+      ok = false;
+    }
+    for (AVFrame* frame : kept) {
+      mediaPool.Release(frame);
+    }
+    kept.clear();
+  } while (ok && end > 0 && running);
+
+  avcodec_flush_buffers(pCodecContext);
+  for (AVPacket* packet : reverseGop) {
+    mediaPool.Release(packet);
+  }
+  reverseGop.clear();
+  return ok && running;
+}
+
+/**
+ * @brief Queue decoded frames last to first, mirrored onto the timeline of
+ * the reverse pass.
+ *
+ * @return bool false if the decoder is shutting down
+ */
+bool Decoder::QueueReversed(std::vector<AVFrame*>& frames) {
+  int64_t clip = clipDuration;
+  while (!frames.empty()) {
+    AVFrame* frame = frames.back();
+    frames.pop_back();
+
+    int64_t pts = frame->best_effort_timestamp;
+    if (pts != AV_NOPTS_VALUE && startPts == AV_NOPTS_VALUE) {
+      startPts = pts;
+    }
+    int64_t relativePts = pts == AV_NOPTS_VALUE || startPts == AV_NOPTS_VALUE ? 0 : pts - startPts;
+    frame->pts = loopOffset + std::max<int64_t>(0, clip - relativePts - frameDuration);
+    passEnd = std::max(passEnd, frame->pts + frameDuration);
+    lastDecodedPts = frame->pts;
+
+    if (!WaitPush(decodedQueue, frame, running)) {
+      mediaPool.Release(frame);
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Count the frames a seek decodes until it reaches its target.
+ *
+ * @return bool true if `frame` precedes the target and is not shown
+ */
+bool Decoder::BeforeSeekTarget(const AVFrame* frame) {
+  if (seekTarget == AV_NOPTS_VALUE) {
+    return false;
+  }
+  seekDecoded++;
+  if (frame->pts + frameDuration <= seekTarget) {
+    return true;
+  }
+  seekCounter.Add(Clock::now() - seekStart, 1);
+  seekFrames.fetch_add(seekDecoded, std::memory_order_relaxed);
+  seekTarget = AV_NOPTS_VALUE;
+  return false;
+}
+
+void Decoder::DecodeLoop() {
+  if (passFromStart) {
+    frameCache.BeginRecording();
+  }
+
+  DemuxedPacket item;
+  while (WaitPop(packetQueue, item, running)) {
+    if (reverseDecodePass && item.kind == PacketKind::Data) {
+      // Played once the whole GOP arrived
+      reverseGop.push_back(item.packet);
+      continue;
+    }
+    if (item.kind == PacketKind::EndOfReverseGop) {
+      if (!DecodeReverseGop()) {
+        return;
+      }
+      continue;
+    }
+
+    if (item.kind == PacketKind::Seek || item.kind == PacketKind::SkipPasses) {
+      avcodec_flush_buffers(pCodecContext);
+      ApplyLowres();
+      replayedUntil = AV_NOPTS_VALUE;
+      if (item.kind == PacketKind::SkipPasses) {
+        loopOffset = passStart + item.passes * clipDuration;
+        passEnd = loopOffset;
+        streamToTimeline = loopOffset - startPts;
+        passStart = loopOffset;
+        decodePass.fetch_add(1, std::memory_order_release);
+        passFromStart = true;
+        cachedDecodePass = item.cachedPass;
+        frameCache.BeginRecording();
+        if (!cachedDecodePass && !ReplayLoopStart()) {
+          return;
+        }
+      } else {
+        passFromStart = false;
+        if (!loopStartComplete) {
+          ReleaseLoopStart();
+        }
+        frameCache.AbortRecording();
+        seekTarget = item.target;
+        seekStart = Clock::now();
+        seekDecoded = 0;
+      }
+      seekPending = false;
+      continue;
+    }
+
+    Clock::time_point start = Clock::now();
+    Clock::duration elapsed = Clock::duration::zero();
+    uint64_t frames = 0;
+
+    // Discard non-reference frames while more than a few frames behind
+    bool discarding = options.catchUp && displayPts.load(std::memory_order_relaxed) - lastDecodedPts > CATCH_UP_FRAMES * frameDuration;
+    bool decimating = governor.Quality() >= DecodeQuality::Decimate;
+    pCodecContext->skip_frame = discarding || decimating ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+    if (discarding || governor.Quality() != DecodeQuality::Full) {
+      // The recorded pass would miss frames, or keep degraded ones forever
+      frameCache.AbortRecording();
+    }
+    if (item.packet && (item.packet->flags & AV_PKT_FLAG_KEY)) {
+      frameCache.AddKeyframe(item.packet->pts);
+    }
+
+    // A null packet enters draining mode, the remaining delayed frames are
+    // returned and then avcodec_receive_frame reports AVERROR_EOF.
+    int ret = avcodec_send_packet(pCodecContext, item.packet);
+    mediaPool.Release(item.packet);
+    if (ret < 0 && ret != AVERROR_EOF) {
+      continue;
+    }
+
+    while (true) {
+      AVFrame* frame = mediaPool.GetFrame();
+      if (!frame) {
+        std::cerr << "Failed to allocated memory for AVFrame" << std::endl;
+        return;
+      }
+
+      ret = avcodec_receive_frame(pCodecContext, frame);
+      if (ret < 0) {
+        mediaPool.Release(frame);
+        break;
+      }
+
+      // Map the stream timestamp onto the looping timeline. Frames without
+      // any timestamp follow right after the previous one.
+      int64_t pts = frame->best_effort_timestamp;
+      if (pts != AV_NOPTS_VALUE && startPts == AV_NOPTS_VALUE) {
+        startPts = pts;
+      }
+      if (startPts != AV_NOPTS_VALUE) {
+        streamToTimeline.store(loopOffset - startPts, std::memory_order_relaxed);
+      }
+      if (pts == AV_NOPTS_VALUE) {
+        frameCache.AbortRecording();
+      } else if (cachedDecodePass && frameCache.IsCached(frameCache.GopOf(pts))) {
+        // Leading frame of an open GOP, already replayed with the GOP before
+        mediaPool.Release(frame);
+        continue;
+      } else {
+        frameCache.Record(frame, pts);
+      }
+      frame->pts = pts == AV_NOPTS_VALUE ? passEnd : pts - startPts + loopOffset;
+      passEnd = std::max(passEnd, frame->pts + frameDuration);
+      lastDecodedPts = frame->pts;
+
+      if (BeforeSeekTarget(frame)) {
+        mediaPool.Release(frame);
+        continue;
+      }
+
+      if (!PrewarmLoopStart(frame)) {
+        continue;
+      }
+
+      elapsed += Clock::now() - start;
+      ++frames;
+      if (!WaitPush(decodedQueue, frame, running)) {
+        mediaPool.Release(frame);
+        return;
+      }
+      start = Clock::now();
+    }
+
+    if (discarding && frames == 0 && item.kind == PacketKind::Data) {
+      framesDiscarded.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (ret == AVERROR_EOF && item.kind == PacketKind::CachedGop) {
+      // Drained the GOPs before, the cached one follows them
+      avcodec_flush_buffers(pCodecContext);
+      elapsed += Clock::now() - start;
+      decodeCounter.Add(elapsed, frames);
+      if (!ReplayGop(item.gop)) {
+        return;
+      }
+      continue;
+    }
+
+    if (ret == AVERROR_EOF) {
+      // Fully drained, make the codec accept packets again after the rewind.
+      // The next pass starts where the last frame of this one ends.
+      avcodec_flush_buffers(pCodecContext);
+      ApplyLowres();
+      frameCache.FinishRecording();
+      clipDuration = passEnd - loopOffset;
+      loopOffset = passEnd;
+      passStart = loopOffset;
+      if (startPts != AV_NOPTS_VALUE) {
+        streamToTimeline = loopOffset - startPts;
+      }
+      decodePass.fetch_add(1, std::memory_order_release);
+
+      replayedUntil = AV_NOPTS_VALUE;
+      cachedDecodePass = item.cachedPass;
+      reverseDecodePass = item.reversePass;
+      passFromStart = !reverseDecodePass;
+      if (passFromStart) {
+        frameCache.BeginRecording();
+        if (!cachedDecodePass && !ReplayLoopStart()) {
+          return;
+        }
+      }
+    }
+    elapsed += Clock::now() - start;
+    decodeCounter.Add(elapsed, frames);
+
+    // Catching up makes frames look cheaper than they are
+    if (options.adaptiveQuality && !discarding) {
+      if (governor.Update(elapsed, frames, frameBudget)) {
+        ApplyQuality();
+      }
+      decodeLoad.store(governor.Load(), std::memory_order_relaxed);
+    }
+  }
+}
+
+void Decoder::ApplyQuality() {
+  DecodeQuality quality = governor.Quality();
+  pCodecContext->skip_loop_filter = quality >= DecodeQuality::SkipLoopFilter ? AVDISCARD_ALL
+    : quality >= DecodeQuality::SkipLoopFilterNonRef ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+  pCodecContext->skip_idct = quality >= DecodeQuality::SkipIdct ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+  // Decimation is applied per packet with skip_frame, lowres at the next
+  // flush of the codec
+  decodeQuality.store(int(quality), std::memory_order_relaxed);
+  qualityChanges.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Allocate a codec context for the video stream and open it.
+ *
+ * @param codecLowres lowres factor to decode at, fixed once it is open
+ * @return AVCodecContext* null if it failed
+ */
+AVCodecContext* Decoder::OpenCodec(int codecLowres) {
+  AVCodecContext* context = avcodec_alloc_context3(codec);
+  if (!context) {
+    std::cerr << "Failed to allocated memory for AVCodecContext" << std::endl;
+    return nullptr;
+  }
+
   // Fill AVCodecContext structure
-  if (avcodec_parameters_to_context(pCodecContext, pCodecParameters) < 0) {
+  if (avcodec_parameters_to_context(context, pFormatContext->streams[video_stream_index]->codecpar) < 0) {
     std::cerr << "Failed to copy codec params to codec context" << std::endl;
-    return;
+    avcodec_free_context(&context);
+    return nullptr;
+  }
+
+  context->lowres = codecLowres;
+
+  // Threading can only be configured before the codec is opened
+  switch (options.threading) {
+  case DecoderThreading::Auto:
+    context->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    context->thread_count = options.decodeThreads;
+    break;
+  case DecoderThreading::Frame:
+    context->thread_type = FF_THREAD_FRAME;
+    context->thread_count = options.decodeThreads;
+    break;
+  case DecoderThreading::Slice:
+    context->thread_type = FF_THREAD_SLICE;
+    context->thread_count = options.decodeThreads;
+    break;
+  case DecoderThreading::None:
+    context->thread_count = 1;
+    break;
   }
 
   // Open decoder
-  if (avcodec_open2(pCodecContext, pCodec, nullptr) < 0) {
+  if (avcodec_open2(context, codec, nullptr) < 0) {
     std::cerr << "Failed to open codec through 'avcodec_open2'" << std::endl;
+    avcodec_free_context(&context);
+    return nullptr;
+  }
+  return context;
+}
+
+void Decoder::ApplyLowres() {
+  // Changing the size between two frames of a GOP would corrupt the
+  // references, so this only runs right after the codec was flushed.
+  // Codecs read lowres when they are opened, so the context is replaced by
+  // one opened with the new factor.
+  int target = lowres;
+  if (governor.Quality() >= DecodeQuality::Lowres && lowres < maxLowres) {
+    target++;
+  }
+  if (pCodecContext->lowres == target) {
     return;
   }
+  AVCodecContext* context = OpenCodec(target);
+  if (!context) {
+    // Keep decoding at the current size
+    return;
+  }
+  context->skip_frame = pCodecContext->skip_frame;
+  context->skip_loop_filter = pCodecContext->skip_loop_filter;
+  context->skip_idct = pCodecContext->skip_idct;
+  avcodec_free_context(&pCodecContext);
+  pCodecContext = context;
+}
 
-  pPacket = av_packet_alloc();
-  if (!pPacket) {
-    std::cerr << "Failed to allocated memory for AVPacket" << std::endl;
+/**
+ * @brief Convert `frame` into `destination` at the output size.
+ *
+ * @return bool true if swscale converted it, whose filters blend pixels
+ * across tile edges; false for ColorConverter, where every output pixel
+ * only depends on the source pixel at the same place
+ */
+bool Decoder::ConvertToRGBA(AVFrame* frame, VideoFrame* target, uint8_t* destination) {
+  bool converted = !options.swscaleConvert
+    && frame->width == output_width && frame->height == output_height
+    && colorConverter.Convert(frame, destination, output_width * 4);
+
+  if (!converted) {
+    pSwsContext = sws_getCachedContext( pSwsContext,
+      frame->width, frame->height, (AVPixelFormat)frame->format,
+      output_width, output_height, AV_PIX_FMT_RGBA,
+      SWS_BILINEAR, nullptr, nullptr, nullptr );
+    // The cached context may be new, and frames may change their matrix;
+    // rebuilding swscale's small tables is cheap next to the scaling
+    MatchColorspace(pSwsContext, frame);
+
+    uint8_t* dst[4] = { destination, nullptr, nullptr, nullptr };
+    int dstStride[4] = { output_width * 4, 0, 0, 0 };
+    /* int height = */ sws_scale( pSwsContext,
+      (const uint8_t* const*)(frame->data), frame->linesize,
+      0, frame->height,
+      dst, dstStride );
+  }
+
+  target->format = AV_PIX_FMT_RGBA;
+  target->width = output_width;
+  target->height = output_height;
+  target->data[0] = destination;
+  target->linesize[0] = output_width * 4;
+  target->data[1] = target->data[2] = nullptr;
+  target->linesize[1] = target->linesize[2] = 0;
+  return !converted;
+}
+
+/**
+ * @brief Downscale a planar frame to the output size into `destination`,
+ * in the same pixel format.
+ */
+bool Decoder::ScalePlanes(AVFrame* frame, AVFrame* destination) {
+  pPlanarSwsContext = sws_getCachedContext( pPlanarSwsContext,
+    frame->width, frame->height, (AVPixelFormat)frame->format,
+    output_width, output_height, (AVPixelFormat)frame->format,
+    SWS_BILINEAR, nullptr, nullptr, nullptr );
+  if (!pPlanarSwsContext) {
+    return false;
+  }
+
+  // One set of planes per buffered frame, and one being scaled
+  if (!mediaPool.GetPlanes(destination, frame->format, output_width, output_height, options.maxBufferedFrames + 1)) {
+    return false;
+  }
+  sws_scale( pPlanarSwsContext,
+    (const uint8_t* const*)(frame->data), frame->linesize,
+    0, frame->height,
+    destination->data, destination->linesize );
+  av_frame_copy_props(destination, frame);
+  return true;
+}
+
+/**
+ * @brief Give `target` a new id and the tiles of `picture`, at the size of
+ * `target`, that differ from the frame queued before.
+ *
+ * @param tiled false if the tiles of `picture` don't map to the same tiles
+ * of `target`, which is then uploaded whole
+ */
+void Decoder::DiffTiles(const AVFrame* picture, VideoFrame* target, bool tiled) {
+  target->id = nextFrameId.fetch_add(1, std::memory_order_relaxed);
+  target->dirtyBase = 0;
+  if (!options.diffTiles || !tiled || !lastQueuedPicture
+      || picture->width != target->width || picture->height != target->height) {
+    av_frame_unref(lastQueuedPicture);
+    lastQueuedId = 0;
     return;
   }
 
-  pFrame = av_frame_alloc();
-  pFrameRGBA32 = av_frame_alloc();
-  if (!pFrame || !pFrameRGBA32) {
-    std::cerr << "Failed to allocated memory for AVFrame" << std::endl;
+  if (lastQueuedId != 0 && target->dirtyTiles.Compare(lastQueuedPicture, picture)) {
+    target->dirtyBase = lastQueuedId;
+  }
+  // A reference to the planes, they aren't written again while it's held
+  av_frame_unref(lastQueuedPicture);
+  lastQueuedId = av_frame_ref(lastQueuedPicture, picture) >= 0 ? target->id : 0;
+}
+
+/**
+ * @brief Narrow `frame` down to the visible rectangle. Only moves the plane
+ * pointers, conversion and upload then skip the cropped pixels.
+ */
+void Decoder::CropFrame(AVFrame* frame) {
+  if (cropWidth == width && cropHeight == height) {
     return;
   }
-  pFrameRGBA32->format = AV_PIX_FMT_RGBA;
-  pFrameRGBA32->width = pCodecContext->width;
-  pFrameRGBA32->height = pCodecContext->height;
-
-  int numBytes = av_image_get_buffer_size(AV_PIX_FMT_RGBA, pCodecContext->width, pCodecContext->height, 32);
-  rgbaBuffer = (uint8_t*)av_malloc(numBytes);
-  av_image_fill_arrays(pFrameRGBA32->data, pFrameRGBA32->linesize, rgbaBuffer,
-    AV_PIX_FMT_RGBA, pCodecContext->width, pCodecContext->height, 32);
-}
-
-/**
- * @brief 
- * 
- * @param pCodecContext 
- * @param pInPacket 
- * @param pOutFrame 
- * @return int If  0, got a frame, 
- */
-int DecodePacketToFrame(
-  AVCodecContext* pCodecContext,
-  AVPacket*       pInPacket,
-  AVFrame*        pOutFrame) {
-  // 0 on success, otherwise negative error code:
-  // AVERROR(EAGAIN): input is not accepted in the current state - user must read output with avcodec_receive_frame()
-  // (once all output is read, the packet should be resent, and the call will not fail with EAGAIN).
-  // AVERROR_EOF: the decoder has been flushed, and no new packets can be sent to it (also returned if more than 1 flush packet is sent)
-  // AVERROR(EINVAL): codec not opened, it is an encoder, or requires flush
-  // AVERROR(ENOMEM): failed to add packet to internal queue, or similar other errors: legitimate decoding errors
-  int res = avcodec_send_packet(pCodecContext, pInPacket);
-  if ( res == AVERROR(EAGAIN) ) {
-    // std::cout << "Input packet is not acceptable, need to read output frame firstly" << std::endl;
-    return res;
-  } else if (res < 0) {
-    // printf("<DecodePacketToFrame> [ERROR] fail to avcodec_send_frame(), res=%d\n", res);
-    return res;
-  }
-
-  // 0: success, a frame was returned
-  // AVERROR(EAGAIN): output is not available in this state - user must try to send new input
-  // AVERROR_EOF: the decoder has been fully flushed, and there will be no more output frames
-  // AVERROR(EINVAL): codec not opened, or it is an encoder
-  // AVERROR_INPUT_CHANGED: current decoded frame has changed parameters with respect to first decoded frame.
-  // Applicable when flag AV_CODEC_FLAG_DROPCHANGED is set. other negative values: legitimate decoding errors
-  res = avcodec_receive_frame(pCodecContext, pOutFrame);
-  if ( res == AVERROR(EAGAIN) ) {
-    // std::cout << "Output is not available, need send more packet" << std::endl;
-    return res;
-  } else if (res < 0) {
-    return res;
-  }
-
-  return 0;
-}
-
-void* Decoder::GetFrame(float seconds)
+  // Frames decoded with lowres are smaller than the stream
+  int left = int(int64_t(cropX) * frame->width / width) & ~1;
+  int top = int(int64_t(cropY) * frame->height / height) & ~1;
+  int right = frame->width - left - int(int64_t(cropWidth) * frame->width / width);
+  int bottom = frame->height - top - int(int64_t(cropHeight) * frame->height / height);
+  frame->crop_left = left;
+  frame->crop_top = top;
+  frame->crop_right = std::max(0, right);
+  frame->crop_bottom = std::max(0, bottom);
+  if (av_frame_apply_cropping(frame, AV_FRAME_CROP_UNALIGNED) < 0) {
+    std::cerr << "Failed to crop video frame" << std::endl;
+  }
+}
+
+void Decoder::ConvertLoop() {
+  AVFrame* frame = nullptr;
+  while (WaitPop(decodedQueue, frame, running)) {
+    // Nobody will see this frame if the next one is already due
+    AVFrame** next = decodedQueue.Front();
+    if (options.catchUp && next && (*next)->pts <= displayPts.load(std::memory_order_relaxed)) {
+      mediaPool.Release(frame);
+      framesSkipped.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+
+    VideoFrame* target = nullptr;
+    if (!WaitPop(freeQueue, target, running)) {
+      mediaPool.Release(frame);
+      return;
+    }
+    // Release the planes the renderer was done with
+    av_frame_unref(target->source);
+
+    Clock::time_point start = Clock::now();
+
+    target->colorspace = frame->colorspace;
+    target->pts = frame->pts;
+    // The factor the codec actually decoded this frame at
+    int frameLowres = 0;
+    while (frameLowres < maxLowres && AV_CEIL_RSHIFT(width, frameLowres) > frame->width) {
+      frameLowres++;
+    }
+    activeLowres.store(frameLowres, std::memory_order_relaxed);
+    CropFrame(frame);
+    AVColorRange range = frame->color_range;
+    AVPixelFormat layout = GetPlanarLayout(frame->format, &range);
+    // Whether a tile of the frame only changes the same tile once converted
+    bool tiled = true;
+
+    // A repeated picture leaves the frame before it on screen
+    uint64_t hash = options.skipUnchangedFrames ? HashPicture(frame) : 0;
+    target->unchanged = hash != 0 && hash == lastQueuedHash;
+    if (target->unchanged) {
+      // Not to be mistaken for the frame this slot held before
+      target->id = 0;
+      target->dirtyBase = 0;
+      framesUnchanged.fetch_add(1, std::memory_order_relaxed);
+    } else if (options.output == VideoOutput::Planar && layout != AV_PIX_FMT_NONE) {
+      if (frame->width <= output_width && frame->height <= output_height) {
+        av_frame_move_ref(target->source, frame);
+      } else if (!ScalePlanes(frame, target->source)) {
+        av_frame_unref(target->source);
+        av_frame_move_ref(target->source, frame);
+      }
+      target->format = layout;
+      target->width = target->source->width;
+      target->height = target->source->height;
+      for (int i = 0; i < 3; i++) {
+        target->data[i] = target->source->data[i];
+        target->linesize[i] = target->source->linesize[i];
+      }
+    } else if (options.lentBuffers) {
+      if (!WaitPop(lentQueue, target->buffer, running)) {
+        mediaPool.Release(frame);
+        return;
+      }
+      tiled = !ConvertToRGBA(frame, target, target->buffer.data);
+    } else {
+      if (!target->rgba) {
+        // Tightly packed rows, the renderer uploads with the default unpack alignment
+        target->rgba = (uint8_t*)av_malloc(av_image_get_buffer_size(AV_PIX_FMT_RGBA, output_width, output_height, 1));
+      }
+      tiled = !ConvertToRGBA(frame, target, target->rgba);
+    }
+    target->color_range = range;
+    if (!target->unchanged) {
+      lastQueuedHash = hash;
+      // The RGBA conversion had the decoded frame as it is, the planes are
+      // handed over as they are. swscale's bilinear (chroma) filter reaches
+      // into neighbouring tiles, so its frames are uploaded whole
+      DiffTiles(target->format == AV_PIX_FMT_RGBA ? frame : target->source, target, tiled);
+    }
+
+    mediaPool.Release(frame);
+    convertCounter.Add(Clock::now() - start);
+
+    if (!WaitPush(readyQueue, target, running)) {
+      return;
+    }
+  }
+}
+
+const VideoFrame* Decoder::GetFrame(std::chrono::nanoseconds displayTime)
 {
-  int ret;
-
-  while ((ret = av_read_frame(pFormatContext, pPacket)) >= 0) {
-    if (pPacket->stream_index == video_stream_index) {
-      ret = DecodePacketToFrame(pCodecContext, pPacket, pFrame);
-      av_packet_unref(pPacket);
-      if (ret == 0) {
-        // Get a frame
-        break;
-      } else {
-        av_frame_unref(pFrame);
+  const int64_t displayPts = av_rescale_q(displayTime.count(), AVRational{ 1, 1000000000 }, time_base);
+  this->displayPts.store(displayPts, std::memory_order_relaxed);
+
+  uint64_t popped = 0;
+  uint64_t unchanged = 0;
+  VideoFrame** next = nullptr;
+  // The first frame is shown as soon as it is ready
+  while ((next = readyQueue.Front()) && ((*next)->pts <= displayPts || currentFrame == nullptr)) {
+    VideoFrame* frame = nullptr;
+    readyQueue.Pop(frame);
+    if (frame->unchanged && currentFrame) {
+      // The current frame shows the same picture and stays
+      freeQueue.Push(frame);
+      ++unchanged;
+      continue;
+    }
+    if (currentFrame) {
+      if (popped > 0) {
+        if (currentFrame->buffer.data) {
+          // Dropped before anyone saw it, the buffer can be filled again right
+          // away. Never fails, it was lent before.
+          lentQueue.Push(currentFrame->buffer);
+        }
+        // Its changes were never uploaded either, the next frame takes them
+        if (frame->dirtyBase == currentFrame->id && currentFrame->dirtyBase != 0) {
+          frame->dirtyTiles.Merge(currentFrame->dirtyTiles);
+          frame->dirtyBase = currentFrame->dirtyBase;
+        } else {
+          frame->dirtyBase = 0;
+        }
       }
+      // The displayed frame's buffer went back to the lender with it
+      currentFrame->buffer = FrameBuffer();
+      // Never fails, the free queue has room for the whole pool
+      freeQueue.Push(currentFrame);
     }
-    av_packet_unref(pPacket);
+    currentFrame = frame;
+    ++popped;
+  }
+  if (popped + unchanged > 0) {
+    framesPresented.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (popped > 1) {
+    // Unchanged frames have their own counter
+    framesDropped.fetch_add(popped - 1, std::memory_order_relaxed);
   }
 
-  if (ret == AVERROR_EOF) { // End of file, seek to video beginning
-    av_packet_unref(pPacket);
-    av_frame_unref(pFrame);
-    av_seek_frame(pFormatContext, video_stream_index, 0, AVSEEK_FLAG_FRAME);
+  return currentFrame;
+}
 
-    return GetFrame(seconds);
-  } else if (ret < 0) {
-    // printf("call av_read_frame() failed: %s\n", av_err2str(ret));
-    printf("call av_read_frame() failed: %d\n", ret);
+const VideoFrame* Decoder::NextFrame()
+{
+  VideoFrame* next = nullptr;
+  if (!readyQueue.Pop(next)) {
     return nullptr;
   }
+  if (currentFrame) {
+    currentFrame->buffer = FrameBuffer();
+    freeQueue.Push(currentFrame);
+  }
+  currentFrame = next;
+  framesPresented.fetch_add(1, std::memory_order_relaxed);
+  return currentFrame;
+}
 
-  if ( pSwsContext == nullptr ) {
-    pSwsContext = sws_getContext( pFrame->width, pFrame->height, (AVPixelFormat)pFrame->format,
-      pFrameRGBA32->width, pFrameRGBA32->height, AV_PIX_FMT_RGBA,
-      SWS_BILINEAR, nullptr, nullptr, nullptr );
+int64_t Decoder::LoopDuration() const
+{
+  // The duration is stored before the pass counter is bumped
+  return decodePass.load(std::memory_order_acquire) > 0 ? clipDuration.load(std::memory_order_relaxed) : 0;
+}
+
+bool Decoder::LendBuffer(const FrameBuffer& buffer) {
+  if (!options.lentBuffers || buffer.size < size_t(output_width) * output_height * 4) {
+    return false;
   }
+  return lentQueue.Push(buffer);
+}
 
-  /* int height = */ sws_scale( pSwsContext,
-    (const uint8_t* const*)(pFrame->data), pFrame->linesize,
-    0, pCodecContext->height,
-    pFrameRGBA32->data, pFrameRGBA32->linesize );
+DecoderStats Decoder::GetStats() const {
+  DecoderStats stats;
+  stats.packetQueueDepth = packetQueue.Size();
+  stats.decodedQueueDepth = decodedQueue.Size();
+  stats.readyQueueDepth = readyQueue.Size();
+  stats.maxBufferedFrames = options.maxBufferedFrames;
+  stats.outputWidth = output_width;
+  stats.outputHeight = output_height;
+  stats.lowres = activeLowres.load(std::memory_order_relaxed);
+  stats.quality = DecodeQuality(decodeQuality.load(std::memory_order_relaxed));
+  stats.decodeLoad = decodeLoad.load(std::memory_order_relaxed);
+  stats.qualityChanges = qualityChanges.load(std::memory_order_relaxed);
+  stats.poolMisses = mediaPool.PoolMisses();
+  stats.openMilliseconds = open_milliseconds;
+  stats.probeCached = probe_cached;
+  stats.packetCacheBytes = packetCacheBytes.load(std::memory_order_relaxed);
+  stats.frameCacheBytes = frameCache.ResidentBytes();
+  stats.demux = demuxCounter.Load();
+  stats.decode = decodeCounter.Load();
+  stats.convert = convertCounter.Load();
+  stats.framesPresented = framesPresented.load(std::memory_order_relaxed);
+  stats.framesDropped = framesDropped.load(std::memory_order_relaxed);
+  stats.framesSkipped = framesSkipped.load(std::memory_order_relaxed);
+  stats.framesUnchanged = framesUnchanged.load(std::memory_order_relaxed);
+  stats.framesDiscarded = framesDiscarded.load(std::memory_order_relaxed);
+  stats.catchUpSeeks = catchUpSeeks.load(std::memory_order_relaxed);
+  stats.seek = seekCounter.Load();
+  stats.seekFrames = seekFrames.load(std::memory_order_relaxed);
+  stats.loopsPrewarmed = loopsPrewarmed.load(std::memory_order_relaxed);
+  stats.packetsFromCache = packetsFromCache.load(std::memory_order_relaxed);
+  stats.packetsFromDemuxer = packetsFromDemuxer.load(std::memory_order_relaxed);
+  stats.framesFromCache = framesFromCache.load(std::memory_order_relaxed);
+  stats.bytesRead = bytesRead.load(std::memory_order_relaxed);
+  stats.foreignPackets = foreignPackets.load(std::memory_order_relaxed);
+  stats.pageFaults = input.PageFaults();
+  return stats;
+}
 
-  av_frame_unref( pFrame );
+void Decoder::Stop() {
+  running = false;
+  if (demuxThread.joinable()) demuxThread.join();
+  if (decodeThread.joinable()) decodeThread.join();
+  if (convertThread.joinable()) convertThread.join();
+}
 
-  return (void*)rgbaBuffer;
+void Decoder::ReclaimLentBuffers(std::vector<FrameBuffer>* buffers) {
+  FrameBuffer buffer;
+  while (lentQueue.Pop(buffer)) {
+    buffers->push_back(buffer);
+  }
+  // The current frame's buffer went back when it was uploaded, any other
+  // frame may hold one it was converted into
+  for (VideoFrame& videoFrame : framePool) {
+    if (&videoFrame != currentFrame && videoFrame.buffer.data) {
+      buffers->push_back(videoFrame.buffer);
+      videoFrame.buffer = FrameBuffer();
+    }
+  }
 }
 
 Decoder::~Decoder()
 {
+  Stop();
+
+  DemuxedPacket item;
+  while (packetQueue.Pop(item)) {
+    mediaPool.Release(item.packet);
+  }
+  AVFrame* frame = nullptr;
+  while (decodedQueue.Pop(frame)) {
+    mediaPool.Release(frame);
+  }
+  ReleaseLoopStart();
+  mediaPool.Release(lastQueuedPicture);
+  for (AVPacket* packet : reverseGop) {
+    mediaPool.Release(packet);
+  }
+  for (VideoFrame& videoFrame : framePool) {
+    av_freep( &videoFrame.rgba );
+    av_frame_free( &videoFrame.source );
+  }
+
+  sws_freeContext( pSwsContext );
+  sws_freeContext( pPlanarSwsContext );
   avformat_close_input( &pFormatContext );
-  av_packet_free( &pPacket );
-  av_frame_free( &pFrame );
   avcodec_free_context( &pCodecContext );
 }
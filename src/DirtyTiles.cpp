@@ -0,0 +1,142 @@
+#include <algorithm>
+#include <cstring>
+
+#if defined( __x86_64__ ) || defined( _M_X64 )
+  #define DIRTY_TILES_SSE2 1
+  #include <emmintrin.h>
+#elif defined( __aarch64__ ) || defined( _M_ARM64 )
+  #define DIRTY_TILES_NEON 1
+  #include <arm_neon.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
+#endif // __cplusplus
+
+#include "DirtyTiles.h"
+
+namespace {
+
+/**
+ * @brief Whether `size` bytes at `a` and `b` are equal, 16 at a time.
+ */
+bool SpanEqual(const uint8_t* a, const uint8_t* b, size_t size) {
+  size_t i = 0;
+#if defined( DIRTY_TILES_SSE2 )
+  for (; i + 16 <= size; i += 16) {
+    __m128i equal = _mm_cmpeq_epi8(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)),
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+    if (_mm_movemask_epi8(equal) != 0xFFFF) {
+      return false;
+    }
+  }
+#elif defined( DIRTY_TILES_NEON )
+  for (; i + 16 <= size; i += 16) {
+    if (vminvq_u8(vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i))) != 0xFF) {
+      return false;
+    }
+  }
+#endif
+  return std::memcmp(a + i, b + i, size - i) == 0;
+}
+
+} // anonymous namespace
+
+void DirtyTiles::Reset(int width, int height) {
+  this->width = width;
+  this->height = height;
+  columns = (width + TILE_SIZE - 1) / TILE_SIZE;
+  rows = (height + TILE_SIZE - 1) / TILE_SIZE;
+  tiles.assign(size_t(columns) * size_t(rows), 1);
+}
+
+bool DirtyTiles::Compare(const AVFrame* previous, const AVFrame* current) {
+  Reset(current->width, current->height);
+
+  const AVPixFmtDescriptor* descriptor = av_pix_fmt_desc_get((AVPixelFormat)current->format);
+  int rowBytes[4] = {};
+  if (!descriptor || (descriptor->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL))
+      || previous->format != current->format || previous->width != current->width || previous->height != current->height
+      || av_image_fill_linesizes(rowBytes, (AVPixelFormat)current->format, current->width) < 0) {
+    return false;
+  }
+  std::fill(tiles.begin(), tiles.end(), uint8_t(0));
+
+  for (int plane = 0; plane < 4 && current->data[plane] && previous->data[plane]; plane++) {
+    bool chroma = plane == 1 || plane == 2;
+    int shiftX = chroma ? descriptor->log2_chroma_w : 0;
+    int shiftY = chroma ? descriptor->log2_chroma_h : 0;
+    int planeWidth = (width + (1 << shiftX) - 1) >> shiftX;
+    int planeHeight = (height + (1 << shiftY) - 1) >> shiftY;
+    // Bytes of one pixel of this plane, e.g. 2 for interleaved NV12 chroma
+    int pixelBytes = std::max(1, rowBytes[plane] / std::max(1, planeWidth));
+    int tileBytes = (TILE_SIZE >> shiftX) * pixelBytes;
+    int tileRows = TILE_SIZE >> shiftY;
+
+    for (int y = 0; y < planeHeight; y++) {
+      uint8_t* tileRow = tiles.data() + size_t(y / tileRows) * size_t(columns);
+      const uint8_t* a = previous->data[plane] + ptrdiff_t(y) * previous->linesize[plane];
+      const uint8_t* b = current->data[plane] + ptrdiff_t(y) * current->linesize[plane];
+      for (int column = 0; column < columns; column++) {
+        if (tileRow[column]) {
+          continue;
+        }
+        int offset = column * tileBytes;
+        int size = std::min(tileBytes, rowBytes[plane] - offset);
+        if (size > 0 && !SpanEqual(a + offset, b + offset, size_t(size))) {
+          tileRow[column] = 1;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+void DirtyTiles::Merge(const DirtyTiles& other) {
+  if (other.tiles.size() != tiles.size()) {
+    std::fill(tiles.begin(), tiles.end(), uint8_t(1));
+    return;
+  }
+  for (size_t i = 0; i < tiles.size(); i++) {
+    tiles[i] |= other.tiles[i];
+  }
+}
+
+double DirtyTiles::DirtyFraction() const {
+  if (tiles.empty()) {
+    return 1.0;
+  }
+  size_t dirty = size_t(std::count(tiles.begin(), tiles.end(), uint8_t(1)));
+  return double(dirty) / double(tiles.size());
+}
+
+void DirtyTiles::Rects(int shiftX, int shiftY, std::vector<TileRect>* rects) const {
+  rects->clear();
+  int planeWidth = (width + (1 << shiftX) - 1) >> shiftX;
+  int planeHeight = (height + (1 << shiftY) - 1) >> shiftY;
+  int tileWidth = TILE_SIZE >> shiftX;
+  int tileHeight = TILE_SIZE >> shiftY;
+
+  for (int row = 0; row < rows; row++) {
+    const uint8_t* tileRow = tiles.data() + size_t(row) * size_t(columns);
+    for (int column = 0; column < columns; column++) {
+      if (!tileRow[column]) {
+        continue;
+      }
+      int first = column;
+      while (column + 1 < columns && tileRow[column + 1]) {
+        column++;
+      }
+      TileRect rect;
+      rect.x = first * tileWidth;
+      rect.y = row * tileHeight;
+      rect.width = std::min((column + 1) * tileWidth, planeWidth) - rect.x;
+      rect.height = std::min(rect.y + tileHeight, planeHeight) - rect.y;
+      rects->push_back(rect);
+    }
+  }
+}
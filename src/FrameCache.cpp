@@ -0,0 +1,138 @@
+#include <algorithm>
+#include <iostream>
+
+#include "FrameCache.h"
+
+namespace {
+
+size_t FrameBytes(const AVFrame* frame) {
+  size_t size = 0;
+  for (int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; i++) {
+    size += frame->buf[i]->size;
+  }
+  return size;
+}
+
+} // anonymous namespace
+
+FrameCache::FrameCache(size_t budget) : budget(budget) {
+  disabled = budget == 0;
+}
+
+FrameCache::~FrameCache() {
+  Discard();
+}
+
+void FrameCache::Evict(size_t gop) {
+  for (AVFrame* frame : gops[gop].frames) {
+    av_frame_free(&frame);
+  }
+  gops[gop].frames.clear();
+  bytes -= gops[gop].bytes;
+  gops[gop].bytes = 0;
+}
+
+void FrameCache::Discard() {
+  for (size_t i = 0; i < gops.size(); i++) {
+    Evict(i);
+  }
+  gops.clear();
+  stride = 1;
+  bytes = 0;
+  recording = false;
+  residentBytes.store(0, std::memory_order_relaxed);
+}
+
+void FrameCache::BeginRecording() {
+  if (disabled || Ready()) {
+    return;
+  }
+  Discard();
+  recording = true;
+}
+
+void FrameCache::AddKeyframe(int64_t pts) {
+  if (!recording) {
+    return;
+  }
+  if (pts == AV_NOPTS_VALUE || (!gops.empty() && pts <= gops.back().keyPts)) {
+    // GOPs can't be told apart by timestamp, the demuxer couldn't skip them
+    std::cerr << "Video keyframes are not strictly ordered, not caching decoded frames" << std::endl;
+    Discard();
+    disabled = true;
+    return;
+  }
+  gops.emplace_back();
+  gops.back().keyPts = pts;
+}
+
+void FrameCache::Record(const AVFrame* frame, int64_t pts) {
+  if (!recording || gops.empty()) {
+    return;
+  }
+  size_t gop = size_t(std::max(0, GopOf(pts)));
+  if (gop % stride != 0) {
+    return;
+  }
+
+  AVFrame* copy = av_frame_clone(frame);
+  if (!copy) {
+    return;
+  }
+  copy->pts = pts;
+  size_t size = FrameBytes(copy);
+  gops[gop].frames.push_back(copy);
+  gops[gop].bytes += size;
+  bytes += size;
+
+  // Over budget: keep every other GOP of the current stride
+  while (bytes > budget && stride < gops.size()) {
+    stride *= 2;
+    for (size_t i = 0; i < gops.size(); i++) {
+      if (i % stride != 0) {
+        Evict(i);
+      }
+    }
+  }
+  if (bytes > budget) {
+    std::cerr << "A single GOP exceeds the frame cache budget of " << budget << " bytes, not caching decoded frames" << std::endl;
+    Discard();
+    disabled = true;
+    return;
+  }
+  residentBytes.store(bytes, std::memory_order_relaxed);
+}
+
+void FrameCache::AbortRecording() {
+  if (recording) {
+    Discard();
+  }
+}
+
+void FrameCache::FinishRecording() {
+  if (!recording) {
+    return;
+  }
+  recording = false;
+  if (bytes == 0) {
+    Discard();
+    return;
+  }
+  ready.store(true, std::memory_order_release);
+}
+
+int FrameCache::FindGop(int64_t keyPts) const {
+  auto it = std::lower_bound(gops.begin(), gops.end(), keyPts,
+    [](const Gop& gop, int64_t pts) { return gop.keyPts < pts; });
+  if (it == gops.end() || it->keyPts != keyPts) {
+    return -1;
+  }
+  return int(it - gops.begin());
+}
+
+int FrameCache::GopOf(int64_t pts) const {
+  auto it = std::upper_bound(gops.begin(), gops.end(), pts,
+    [](int64_t pts, const Gop& gop) { return pts < gop.keyPts; });
+  // Frames before the first keyframe belong to the first GOP
+  return std::max(0, int(it - gops.begin()) - 1);
+}
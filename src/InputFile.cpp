@@ -0,0 +1,403 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#if defined( WIN32 ) || defined( _WIN32 )
+  #define NOMINMAX
+  #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+#include "InputFile.h"
+
+extern "C" {
+#include <libavutil/mem.h>
+}
+
+namespace {
+
+// Size of the AVIOContext buffer and of the chunks the read-ahead thread
+// reads at once
+const int IO_BUFFER_SIZE = 64 * 1024;
+const size_t CHUNK_SIZE = 256 * 1024;
+
+bool SeekFile(FILE* file, int64_t offset) {
+#if defined( WIN32 ) || defined( _WIN32 )
+  return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+  return fseeko(file, off_t(offset), SEEK_SET) == 0;
+#endif
+}
+
+int64_t FileSize(FILE* file) {
+#if defined( WIN32 ) || defined( _WIN32 )
+  if (_fseeki64(file, 0, SEEK_END) != 0) return -1;
+  int64_t size = _ftelli64(file);
+#else
+  if (fseeko(file, 0, SEEK_END) != 0) return -1;
+  int64_t size = int64_t(ftello(file));
+#endif
+  SeekFile(file, 0);
+  return size;
+}
+
+#if !defined( WIN32 ) && !defined( _WIN32 )
+size_t PageSize() {
+  static const size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+  return pageSize;
+}
+#endif
+
+} // anonymous namespace
+
+InputFile::InputFile(const std::string& filename, bool map, size_t readAheadBytes)
+  : readAheadBytes(readAheadBytes) {
+  std::string path = filename;
+  if (path.compare(0, 5, "file:") == 0) {
+    path = path.substr(5);
+  } else if (path.find("://") != std::string::npos) {
+    // Network and other protocols stay with FFmpeg
+    return;
+  }
+
+  this->path = path;
+#if !defined( WIN32 ) && !defined( _WIN32 )
+  // Room for the pages of a whole AVIOContext buffer, at any alignment
+  residentPages.resize(size_t(IO_BUFFER_SIZE) / PageSize() + 1);
+#endif
+  if ((!map || !Map(path)) && !StartReadAhead()) {
+    return;
+  }
+
+  uint8_t* buffer = static_cast<uint8_t*>(av_malloc(IO_BUFFER_SIZE));
+  if (buffer) {
+    context = avio_alloc_context(buffer, IO_BUFFER_SIZE, 0, this, &InputFile::ReadCallback, nullptr, &InputFile::SeekCallback);
+  }
+  if (!context) {
+    std::cerr << "Failed to allocate AVIOContext, reading '" << filename << "' through FFmpeg" << std::endl;
+    av_free(buffer);
+  }
+}
+
+InputFile::~InputFile() {
+  if (readThread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    cond.notify_all();
+    readThread.join();
+  }
+  if (context) {
+    av_freep(&context->buffer);
+    avio_context_free(&context);
+  }
+  Unmap();
+  if (file) {
+    fclose(file);
+  }
+}
+
+bool InputFile::StartReadAhead() {
+  file = fopen(path.c_str(), "rb");
+  if (!file) {
+    return false;
+  }
+  size = FileSize(file);
+  readOffset = position;
+  // The thread needs room for at least one chunk
+  readAheadBytes = std::max(readAheadBytes, CHUNK_SIZE);
+  readThread = std::thread(&InputFile::ReadAheadLoop, this);
+  return true;
+}
+
+bool InputFile::KeepMapping() {
+  if (!MappingChanged()) {
+    return true;
+  }
+  std::cerr << "'" << path << "' changed while it was mapped, reading it instead" << std::endl;
+  Unmap();
+  if (!StartReadAhead()) {
+    size = 0;
+  }
+  return false;
+}
+
+#if defined( WIN32 ) || defined( _WIN32 )
+
+bool InputFile::Map(const std::string& filename) {
+  HANDLE handle = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (handle == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(handle, &fileSize) || fileSize.QuadPart == 0) {
+    CloseHandle(handle);
+    return false;
+  }
+  HANDLE mappingObject = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (!mappingObject) {
+    CloseHandle(handle);
+    return false;
+  }
+  void* view = MapViewOfFile(mappingObject, FILE_MAP_READ, 0, 0, 0);
+  if (!view) {
+    CloseHandle(mappingObject);
+    CloseHandle(handle);
+    return false;
+  }
+  fileHandle = handle;
+  mappingHandle = mappingObject;
+  mapping = static_cast<const uint8_t*>(view);
+  size = fileSize.QuadPart;
+  return true;
+}
+
+void InputFile::Unmap() {
+  if (mapping) {
+    UnmapViewOfFile(mapping);
+    CloseHandle(mappingHandle);
+    CloseHandle(fileHandle);
+    mapping = nullptr;
+  }
+}
+
+bool InputFile::MappingChanged() const {
+  // The file is opened without FILE_SHARE_WRITE, nobody can change it
+  return false;
+}
+
+void InputFile::Prefetch(int64_t offset, int64_t length) {
+  if (!mapping || offset < 0 || offset >= size || length <= 0) {
+    return;
+  }
+  // Windows 8 and later, looked up so older systems still start
+  struct MemoryRange {
+    PVOID address;
+    SIZE_T size;
+  };
+  using PrefetchFunction = BOOL(WINAPI*)(HANDLE, ULONG_PTR, MemoryRange*, ULONG);
+  static const PrefetchFunction prefetchVirtualMemory = reinterpret_cast<PrefetchFunction>(
+    reinterpret_cast<void*>(GetProcAddress(GetModuleHandleA("kernel32.dll"), "PrefetchVirtualMemory")));
+  if (!prefetchVirtualMemory) {
+    return;
+  }
+  MemoryRange range = { const_cast<uint8_t*>(mapping) + offset, SIZE_T(std::min(size, offset + length) - offset) };
+  prefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+}
+
+#else
+
+bool InputFile::Map(const std::string& filename) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat info;
+  // Files others may write to could be truncated under the mapping any time
+  if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size == 0 ||
+    (info.st_mode & (S_IWGRP | S_IWOTH))) {
+    close(fd);
+    return false;
+  }
+  void* address = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+  if (address == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+  descriptor = fd;
+  mappedModified = int64_t(info.st_mtime);
+  mapping = static_cast<const uint8_t*>(address);
+  size = int64_t(info.st_size);
+  return true;
+}
+
+void InputFile::Unmap() {
+  if (mapping) {
+    munmap(const_cast<uint8_t*>(mapping), size_t(size));
+    close(descriptor);
+    descriptor = -1;
+    mapping = nullptr;
+  }
+}
+
+bool InputFile::MappingChanged() const {
+  struct stat info;
+  return fstat(descriptor, &info) != 0 || int64_t(info.st_size) != size || int64_t(info.st_mtime) != mappedModified;
+}
+
+void InputFile::Prefetch(int64_t offset, int64_t length) {
+  if (!mapping || offset < 0 || offset >= size || length <= 0) {
+    return;
+  }
+  int64_t begin = offset & ~int64_t(PageSize() - 1);
+  int64_t end = std::min(size, offset + length);
+  madvise(const_cast<uint8_t*>(mapping) + begin, size_t(end - begin), MADV_WILLNEED);
+}
+
+#endif
+
+int InputFile::ReadMapped(uint8_t* buf, int bufSize) {
+  if (position >= size) {
+    return AVERROR_EOF;
+  }
+  int count = int(std::min<int64_t>(bufSize, size - position));
+
+#if !defined( WIN32 ) && !defined( _WIN32 )
+  // Pages that aren't resident fault in the copy below
+  int64_t begin = position & ~int64_t(PageSize() - 1);
+  size_t pages = size_t((position + count - begin + int64_t(PageSize()) - 1) / int64_t(PageSize()));
+  if (residentPages.size() < pages) {
+    // Only grows for reads larger than any before
+    residentPages.resize(pages);
+  }
+  if (mincore(const_cast<uint8_t*>(mapping) + begin, size_t(position + count - begin), residentPages.data()) == 0) {
+    uint64_t missing = uint64_t(std::count_if(residentPages.begin(), residentPages.begin() + pages,
+      [](auto page) { return (page & 1) == 0; }));
+    pageFaults.fetch_add(missing, std::memory_order_relaxed);
+  }
+#endif
+
+  // Keep the window ahead of the read position paged in, topped up once
+  // half of it was consumed
+  if (readAheadBytes > 0 && position + int64_t(readAheadBytes / 2) >= advisedUntil) {
+    if (!KeepMapping()) {
+      return file ? ReadBuffered(buf, bufSize) : AVERROR_EOF;
+    }
+    int64_t from = std::max(position, advisedUntil);
+    int64_t until = std::min(size, position + int64_t(readAheadBytes));
+    Prefetch(from, until - from);
+    advisedUntil = until;
+  }
+
+  std::memcpy(buf, mapping + position, size_t(count));
+  position += count;
+  bytesServed.fetch_add(uint64_t(count), std::memory_order_relaxed);
+  return count;
+}
+
+void InputFile::ReadAheadLoop() {
+  int64_t filePosition = 0;
+
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!stopping) {
+    if (readEnd || bufferedBytes >= readAheadBytes) {
+      cond.wait(lock);
+      continue;
+    }
+    int64_t offset = readOffset;
+    uint64_t readGeneration = generation;
+    lock.unlock();
+
+    Chunk chunk;
+    chunk.offset = offset;
+    chunk.data.resize(CHUNK_SIZE);
+    size_t count = 0;
+    if (filePosition == offset || SeekFile(file, offset)) {
+      count = fread(chunk.data.data(), 1, chunk.data.size(), file);
+      filePosition = offset + int64_t(count);
+    } else {
+      filePosition = -1;
+    }
+
+    lock.lock();
+    if (readGeneration != generation) {
+      // Seeked while reading, the chunk is of no use
+      continue;
+    }
+    if (count == 0) {
+      readEnd = true;
+    } else {
+      chunk.data.resize(count);
+      readOffset += int64_t(count);
+      bufferedBytes += count;
+      chunks.push_back(std::move(chunk));
+    }
+    cond.notify_all();
+  }
+}
+
+int InputFile::ReadBuffered(uint8_t* buf, int bufSize) {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    if (!chunks.empty()) {
+      Chunk& front = chunks.front();
+      size_t skip = size_t(position - front.offset);
+      size_t count = std::min(size_t(bufSize), front.data.size() - skip);
+      std::memcpy(buf, front.data.data() + skip, count);
+      position += int64_t(count);
+      if (skip + count == front.data.size()) {
+        bufferedBytes -= front.data.size();
+        chunks.pop_front();
+        cond.notify_all();
+      }
+      bytesServed.fetch_add(uint64_t(count), std::memory_order_relaxed);
+      return int(count);
+    }
+    if (readEnd) {
+      return AVERROR_EOF;
+    }
+    cond.wait(lock);
+  }
+}
+
+int64_t InputFile::Seek(int64_t offset, int whence) {
+  if (mapping && !KeepMapping() && !file) {
+    return AVERROR(EIO);
+  }
+  if (whence & AVSEEK_SIZE) {
+    return size;
+  }
+  whence &= ~AVSEEK_FORCE;
+
+  int64_t target = -1;
+  switch (whence) {
+  case SEEK_SET: target = offset; break;
+  case SEEK_CUR: target = position + offset; break;
+  case SEEK_END: target = size < 0 ? -1 : size + offset; break;
+  }
+  if (target < 0) {
+    return AVERROR(EINVAL);
+  }
+
+  if (mapping) {
+    position = target;
+    advisedUntil = target;
+    return target;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  // Seeks within what is buffered (short skips over foreign packets) keep
+  // the buffer
+  while (!chunks.empty() && chunks.front().offset + int64_t(chunks.front().data.size()) <= target) {
+    bufferedBytes -= chunks.front().data.size();
+    chunks.pop_front();
+  }
+  if (chunks.empty() || chunks.front().offset > target) {
+    chunks.clear();
+    bufferedBytes = 0;
+    readOffset = target;
+    readEnd = false;
+    generation++;
+  }
+  position = target;
+  cond.notify_all();
+  return target;
+}
+
+int InputFile::ReadCallback(void* opaque, uint8_t* buf, int bufSize) {
+  InputFile* input = static_cast<InputFile*>(opaque);
+  if (input->mapping) {
+    return input->ReadMapped(buf, bufSize);
+  }
+  return input->file ? input->ReadBuffered(buf, bufSize) : AVERROR_EOF;
+}
+
+int64_t InputFile::SeekCallback(void* opaque, int64_t offset, int whence) {
+  return static_cast<InputFile*>(opaque)->Seek(offset, whence);
+}
@@ -0,0 +1,86 @@
+#include <algorithm>
+#include <iostream>
+
+#include "KeyframeIndex.h"
+
+bool KeyframeIndex::Build(AVFormatContext* pFormatContext, int streamIndex) {
+  entries.clear();
+  AVStream* stream = pFormatContext->streams[streamIndex];
+
+  int count = avformat_index_get_entries_count(stream);
+  for (int i = 0; i < count; i++) {
+    const AVIndexEntry* entry = avformat_index_get_entry(stream, i);
+    if (entry && (entry->flags & AVINDEX_KEYFRAME)) {
+      Entry keyframe;
+      keyframe.timestamp = entry->timestamp;
+      keyframe.pos = entry->pos;
+      entries.push_back(keyframe);
+    }
+  }
+
+  if (entries.empty()) {
+    // No index in the container, read the whole stream once
+    AVPacket* packet = av_packet_alloc();
+    if (!packet) {
+      std::cerr << "Failed to allocated memory for AVPacket" << std::endl;
+      return false;
+    }
+    while (av_read_frame(pFormatContext, packet) >= 0) {
+      if (packet->stream_index == streamIndex && (packet->flags & AV_PKT_FLAG_KEY) && packet->pts != AV_NOPTS_VALUE) {
+        Entry keyframe;
+        keyframe.timestamp = packet->pts;
+        keyframe.pos = packet->pos;
+        entries.push_back(keyframe);
+      }
+      av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+    av_seek_frame(pFormatContext, streamIndex, 0, AVSEEK_FLAG_FRAME);
+  }
+
+  std::sort(entries.begin(), entries.end(),
+    [](const Entry& a, const Entry& b) { return a.timestamp < b.timestamp; });
+  BuildBuckets();
+  return !entries.empty();
+}
+
+void KeyframeIndex::Assign(std::vector<Entry> keyframes) {
+  entries = std::move(keyframes);
+  std::sort(entries.begin(), entries.end(),
+    [](const Entry& a, const Entry& b) { return a.timestamp < b.timestamp; });
+  BuildBuckets();
+}
+
+void KeyframeIndex::BuildBuckets() {
+  buckets.clear();
+  if (entries.empty()) {
+    return;
+  }
+
+  // About one keyframe per bucket
+  int64_t span = entries.back().timestamp - entries.front().timestamp;
+  bucketDuration = std::max<int64_t>(1, span / int64_t(entries.size()));
+  size_t count = size_t(span / bucketDuration) + 1;
+  buckets.resize(count);
+
+  size_t keyframe = 0;
+  for (size_t bucket = 0; bucket < count; bucket++) {
+    int64_t start = entries.front().timestamp + int64_t(bucket) * bucketDuration;
+    while (keyframe + 1 < entries.size() && entries[keyframe + 1].timestamp <= start) {
+      keyframe++;
+    }
+    buckets[bucket] = int(keyframe);
+  }
+}
+
+int KeyframeIndex::Find(int64_t timestamp) const {
+  if (entries.empty() || timestamp < entries.front().timestamp) {
+    return -1;
+  }
+  size_t bucket = std::min(buckets.size() - 1, size_t((timestamp - entries.front().timestamp) / bucketDuration));
+  size_t keyframe = size_t(buckets[bucket]);
+  while (keyframe + 1 < entries.size() && entries[keyframe + 1].timestamp <= timestamp) {
+    keyframe++;
+  }
+  return int(keyframe);
+}
@@ -0,0 +1,58 @@
+#include "LoadGovernor.h"
+
+namespace {
+
+// Weight of the latest frame in the running average, about the last ten
+// frames count
+const double AVERAGE_WEIGHT = 0.1;
+
+} // anonymous namespace
+
+const char* ToString(DecodeQuality quality) {
+  switch (quality) {
+  case DecodeQuality::Full: return "full";
+  case DecodeQuality::SkipLoopFilterNonRef: return "skip-loop-filter-nonref";
+  case DecodeQuality::SkipLoopFilter: return "skip-loop-filter";
+  case DecodeQuality::SkipIdct: return "skip-idct";
+  case DecodeQuality::Lowres: return "lowres";
+  case DecodeQuality::Decimate: return "decimate";
+  }
+  return "unknown";
+}
+
+LoadGovernor::LoadGovernor(bool lowresAvailable) {
+  levels = { DecodeQuality::Full, DecodeQuality::SkipLoopFilterNonRef, DecodeQuality::SkipLoopFilter, DecodeQuality::SkipIdct };
+  if (lowresAvailable) {
+    levels.push_back(DecodeQuality::Lowres);
+  }
+  levels.push_back(DecodeQuality::Decimate);
+}
+
+bool LoadGovernor::Update(std::chrono::steady_clock::duration elapsed, uint64_t frames, std::chrono::nanoseconds budget) {
+  pending += elapsed;
+  if (frames == 0 || budget.count() <= 0) {
+    return false;
+  }
+
+  double load = double(std::chrono::duration_cast<std::chrono::nanoseconds>(pending).count()) / double(frames) / double(budget.count());
+  pending = std::chrono::steady_clock::duration::zero();
+  averageLoad += (load - averageLoad) * AVERAGE_WEIGHT;
+
+  framesOver = averageLoad > highLoad ? framesOver + frames : 0;
+  framesUnder = averageLoad < lowLoad ? framesUnder + frames : 0;
+
+  size_t previous = level;
+  if (framesOver >= degradeFrames && level + 1 < levels.size()) {
+    level++;
+  } else if (framesUnder >= recoverFrames && level > 0) {
+    level--;
+  }
+  if (level == previous) {
+    return false;
+  }
+
+  // The new level has to prove itself from scratch
+  framesOver = 0;
+  framesUnder = 0;
+  return true;
+}
@@ -0,0 +1,146 @@
+#include <iostream>
+
+#ifdef __cplusplus
+extern "C" {
+#include <libavutil/imgutils.h>
+}
+#endif // __cplusplus
+
+#include "MediaPool.h"
+
+namespace {
+
+// Row alignment of pooled planes, enough for the widest SIMD loads of
+// swscale and the renderer's uploads.
+const int PLANE_ALIGNMENT = 64;
+
+} // anonymous namespace
+
+MediaPool::MediaPool(size_t frameCount, size_t packetCount) {
+  std::vector<AVFrame*> initialFrames;
+  for (size_t i = 0; i < frameCount; i++) {
+    initialFrames.push_back(GetFrame());
+  }
+  for (AVFrame*& frame : initialFrames) {
+    Release(frame);
+  }
+
+  std::vector<AVPacket*> initialPackets;
+  for (size_t i = 0; i < packetCount; i++) {
+    initialPackets.push_back(GetPacket());
+  }
+  for (AVPacket*& packet : initialPackets) {
+    Release(packet);
+  }
+}
+
+MediaPool::~MediaPool() {
+  for (AVFrame*& frame : frames) {
+    av_frame_free(&frame);
+  }
+  for (AVPacket*& packet : packets) {
+    av_packet_free(&packet);
+  }
+  // Planes still referenced keep the pool alive until they are released
+  av_buffer_pool_uninit(&planePool);
+}
+
+AVFrame* MediaPool::GetFrame() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!frames.empty()) {
+      AVFrame* frame = frames.back();
+      frames.pop_back();
+      return frame;
+    }
+    // Room to take every frame back without growing on release
+    frames.reserve(++framesCreated);
+  }
+  poolMisses.fetch_add(1, std::memory_order_relaxed);
+  return av_frame_alloc();
+}
+
+AVFrame* MediaPool::CloneFrame(const AVFrame* source) {
+  AVFrame* frame = GetFrame();
+  if (frame && av_frame_ref(frame, source) < 0) {
+    Release(frame);
+  }
+  return frame;
+}
+
+void MediaPool::Release(AVFrame*& frame) {
+  if (!frame) {
+    return;
+  }
+  av_frame_unref(frame);
+  std::lock_guard<std::mutex> lock(mutex);
+  frames.push_back(frame);
+  frame = nullptr;
+}
+
+AVPacket* MediaPool::GetPacket() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!packets.empty()) {
+      AVPacket* packet = packets.back();
+      packets.pop_back();
+      return packet;
+    }
+    packets.reserve(++packetsCreated);
+  }
+  poolMisses.fetch_add(1, std::memory_order_relaxed);
+  return av_packet_alloc();
+}
+
+void MediaPool::Release(AVPacket*& packet) {
+  if (!packet) {
+    return;
+  }
+  av_packet_unref(packet);
+  std::lock_guard<std::mutex> lock(mutex);
+  packets.push_back(packet);
+  packet = nullptr;
+}
+
+AVBufferRef* MediaPool::AllocatePlanes(void* opaque, size_t size) {
+  static_cast<MediaPool*>(opaque)->poolMisses.fetch_add(1, std::memory_order_relaxed);
+  return av_buffer_alloc(size);
+}
+
+bool MediaPool::GetPlanes(AVFrame* frame, int format, int width, int height, size_t reserve) {
+  if (!planePool || format != planeFormat || width != planeWidth || height != planeHeight) {
+    av_buffer_pool_uninit(&planePool);
+    planeBytes = av_image_get_buffer_size((AVPixelFormat)format, width, height, PLANE_ALIGNMENT);
+    if (planeBytes <= 0) {
+      return false;
+    }
+    planePool = av_buffer_pool_init2(size_t(planeBytes), this, &MediaPool::AllocatePlanes, nullptr);
+    if (!planePool) {
+      return false;
+    }
+    planeFormat = format;
+    planeWidth = width;
+    planeHeight = height;
+
+    // Every buffer the pipeline can hold at once, so none is allocated later
+    std::vector<AVBufferRef*> buffers;
+    for (size_t i = 0; i < reserve; i++) {
+      buffers.push_back(av_buffer_pool_get(planePool));
+    }
+    for (AVBufferRef*& buffer : buffers) {
+      av_buffer_unref(&buffer);
+    }
+  }
+
+  frame->buf[0] = av_buffer_pool_get(planePool);
+  if (!frame->buf[0]) {
+    std::cerr << "Failed to allocated memory for a downscaled frame" << std::endl;
+    return false;
+  }
+  frame->format = format;
+  frame->width = width;
+  frame->height = height;
+  av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data,
+    (AVPixelFormat)format, width, height, PLANE_ALIGNMENT);
+  return true;
+}
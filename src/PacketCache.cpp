@@ -0,0 +1,151 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#include "PacketCache.h"
+
+PacketCache::PacketCache(size_t budget) : budget(budget) {}
+
+PacketCache::~PacketCache() {
+  av_buffer_unref(&arena);
+}
+
+void PacketCache::Discard() {
+  av_buffer_unref(&arena);
+  used = 0;
+  entries.clear();
+  entries.shrink_to_fit();
+  cursor = 0;
+  recording = false;
+}
+
+void PacketCache::BeginRecording(int64_t sizeHint) {
+  if (complete || overflowed || budget == 0) {
+    return;
+  }
+  Discard();
+
+  // The stream can't be larger than the file, so a known file size usually
+  // means the arena is allocated exactly once
+  size_t capacity = sizeHint > 0 ? std::min(budget, size_t(sizeHint)) : std::min<size_t>(budget, 1 << 20);
+  if (av_buffer_realloc(&arena, capacity) < 0) {
+    std::cerr << "Failed to allocate packet cache of " << capacity << " bytes" << std::endl;
+    return;
+  }
+  recording = true;
+}
+
+void PacketCache::Record(const AVPacket* packet) {
+  if (!recording) {
+    return;
+  }
+
+  size_t needed = used + size_t(packet->size) + AV_INPUT_BUFFER_PADDING_SIZE;
+  if (needed > budget) {
+    std::cerr << "Video stream exceeds the packet cache budget of " << budget << " bytes, not caching it" << std::endl;
+    Discard();
+    overflowed = true;
+    return;
+  }
+  if (needed > arena->size) {
+    // Nothing references the arena while recording, it may move
+    if (av_buffer_realloc(&arena, std::min(budget, std::max(needed, arena->size * 2))) < 0) {
+      std::cerr << "Failed to grow packet cache" << std::endl;
+      Discard();
+      return;
+    }
+  }
+
+  Entry entry;
+  entry.offset = used;
+  entry.size = packet->size;
+  entry.pts = packet->pts;
+  entry.dts = packet->dts;
+  entry.duration = packet->duration;
+  entry.flags = packet->flags;
+  std::memcpy(arena->data + used, packet->data, packet->size);
+  std::memset(arena->data + used + packet->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+  used = needed;
+  entries.push_back(entry);
+}
+
+void PacketCache::AbortRecording() {
+  if (recording) {
+    Discard();
+  }
+}
+
+void PacketCache::FinishRecording() {
+  if (!recording) {
+    return;
+  }
+  recording = false;
+  if (entries.empty()) {
+    Discard();
+    return;
+  }
+  // Give back what the size hint over-estimated, before any packet
+  // references the arena
+  av_buffer_realloc(&arena, used);
+  entries.shrink_to_fit();
+  complete = true;
+  cursor = 0;
+}
+
+bool PacketCache::Read(AVPacket* packet, int streamIndex) {
+  if (!complete || cursor >= entries.size()) {
+    return false;
+  }
+  const Entry& entry = entries[cursor];
+
+  packet->buf = av_buffer_ref(arena);
+  if (!packet->buf) {
+    return false;
+  }
+  packet->data = arena->data + entry.offset;
+  packet->size = entry.size;
+  packet->pts = entry.pts;
+  packet->dts = entry.dts;
+  packet->duration = entry.duration;
+  packet->flags = entry.flags;
+  packet->stream_index = streamIndex;
+  cursor++;
+  return true;
+}
+
+bool PacketCache::Seek(int64_t pts) {
+  if (!complete) {
+    return false;
+  }
+  size_t found = entries.size();
+  for (size_t i = 0; i < entries.size(); i++) {
+    const Entry& entry = entries[i];
+    if ((entry.flags & AV_PKT_FLAG_KEY) && entry.pts != AV_NOPTS_VALUE && entry.pts <= pts) {
+      found = i;
+    }
+  }
+  if (found == entries.size()) {
+    return false;
+  }
+  cursor = found;
+  return true;
+}
+
+bool PacketCache::SeekKeyframe(int64_t timestamp) {
+  if (!complete) {
+    return false;
+  }
+  for (size_t i = 0; i < entries.size(); i++) {
+    const Entry& entry = entries[i];
+    int64_t entryTimestamp = entry.pts != AV_NOPTS_VALUE ? entry.pts : entry.dts;
+    if ((entry.flags & AV_PKT_FLAG_KEY) && entryTimestamp != AV_NOPTS_VALUE && entryTimestamp >= timestamp) {
+      cursor = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t PacketCache::ResidentBytes() const {
+  return (arena ? arena->size : 0) + entries.capacity() * sizeof(Entry);
+}
@@ -0,0 +1,201 @@
+#include <fstream>
+#include <iostream>
+#include <utility>
+
+#include "Playlist.h"
+#include "Renderer.h"
+
+Playlist::Playlist(const std::vector<std::string>& files, const DecoderOptions& options,
+  std::chrono::nanoseconds interval, std::chrono::nanoseconds crossfade)
+  : files(files), options(options), interval(interval), crossfade(crossfade) {
+  worker = std::thread(&Playlist::WorkerLoop, this);
+  if (!files.empty()) {
+    RequestOpen(0);
+  }
+}
+
+Playlist::~Playlist() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  cond.notify_all();
+  worker.join();
+
+  delete current;
+  delete next;
+  delete prepared;
+  for (std::deque<Decoder*>* queue : { &stopQueue, &stoppedQueue, &deleteQueue }) {
+    for (Decoder* decoder : *queue) {
+      delete decoder;
+    }
+  }
+}
+
+bool Playlist::ReadFile(const std::string& filename, std::vector<std::string>* files) {
+  std::ifstream file(filename);
+  if (!file) {
+    std::cerr << "Unable to open playlist '" << filename << "'" << std::endl;
+    return false;
+  }
+  std::string line;
+  while (std::getline(file, line)) {
+    // Tolerate CRLF line endings and surrounding blanks
+    size_t begin = line.find_first_not_of(" \t\r");
+    size_t end = line.find_last_not_of(" \t\r");
+    if (begin == std::string::npos || line[begin] == '#') {
+      continue;
+    }
+    files->push_back(line.substr(begin, end - begin + 1));
+  }
+  return true;
+}
+
+void Playlist::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    cond.wait(lock, [this] {
+      return stopping || openIndex >= 0 || !stopQueue.empty() || !deleteQueue.empty();
+    });
+    if (stopping) {
+      return;
+    }
+
+    // Retiring first, it frees the cores the next video is opened with
+    if (!stopQueue.empty()) {
+      Decoder* decoder = stopQueue.front();
+      stopQueue.pop_front();
+      lock.unlock();
+      decoder->Stop();
+      lock.lock();
+      stoppedQueue.push_back(decoder);
+      continue;
+    }
+    if (!deleteQueue.empty()) {
+      Decoder* decoder = deleteQueue.front();
+      deleteQueue.pop_front();
+      lock.unlock();
+      delete decoder;
+      lock.lock();
+      continue;
+    }
+
+    size_t file = size_t(openIndex);
+    openIndex = -1;
+    lock.unlock();
+    Decoder* decoder = new Decoder(files[file], options);
+    lock.lock();
+    prepared = decoder;
+  }
+}
+
+void Playlist::RequestOpen(size_t file) {
+  requested = file;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    openIndex = int(file);
+  }
+  cond.notify_all();
+}
+
+void Playlist::Retire(Decoder* decoder) {
+  if (decoder == nullptr) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopQueue.push_back(decoder);
+  }
+  cond.notify_all();
+}
+
+void Playlist::ReclaimStopped(Renderer* renderer) {
+  std::vector<Decoder*> stopped;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopped.assign(stoppedQueue.begin(), stoppedQueue.end());
+    stoppedQueue.clear();
+  }
+  if (stopped.empty()) {
+    return;
+  }
+
+  // Lent buffers belong to the GL context, the rest is freed by the worker
+  std::vector<FrameBuffer> buffers;
+  for (Decoder* decoder : stopped) {
+    decoder->ReclaimLentBuffers(&buffers);
+  }
+  renderer->ReleaseLentBuffers(buffers);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    deleteQueue.insert(deleteQueue.end(), stopped.begin(), stopped.end());
+  }
+  cond.notify_all();
+}
+
+void Playlist::FinishSwitch(Renderer* renderer) {
+  Retire(current);
+  current = next;
+  currentStart = nextStart;
+  next = nullptr;
+  fading = false;
+  renderer->decoder = current;
+  renderer->nextDecoder = nullptr;
+
+  index = requested;
+  if (files.size() > 1) {
+    RequestOpen((index + 1) % files.size());
+  }
+}
+
+void Playlist::Present(Renderer* renderer, std::chrono::nanoseconds displayTime) {
+  ReclaimStopped(renderer);
+
+  Decoder* opened = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::swap(opened, prepared);
+  }
+  if (opened && !opened->IsRunning()) {
+    // Decoder reported why, try the video after it
+    Retire(opened);
+    opened = nullptr;
+    if (++failedOpens < files.size()) {
+      RequestOpen((requested + 1) % files.size());
+    }
+  }
+  if (opened) {
+    failedOpens = 0;
+    next = opened;
+    renderer->nextDecoder = next;
+  }
+
+  if (current == nullptr) {
+    // The first video, shown as soon as it opened
+    if (next == nullptr) {
+      return;
+    }
+    nextStart = displayTime;
+    FinishSwitch(renderer);
+  }
+
+  if (!fading && next && displayTime - currentStart >= interval && next->ReadyFrames() > 0) {
+    nextStart = displayTime;
+    if (crossfade.count() > 0) {
+      fading = true;
+    } else {
+      FinishSwitch(renderer);
+    }
+  }
+
+  if (fading) {
+    float mix = float(double((displayTime - nextStart).count()) / double(crossfade.count()));
+    if (mix < 1.0f) {
+      renderer->SetVideoFrames(current->GetFrame(displayTime - currentStart), next->GetFrame(displayTime - nextStart), mix);
+      return;
+    }
+    FinishSwitch(renderer);
+  }
+
+  renderer->SetVideoFrame(current->GetFrame(displayTime - currentStart));
+}
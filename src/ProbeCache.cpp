@@ -0,0 +1,363 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <system_error>
+
+#include "ProbeCache.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const char MAGIC[4] = { 'S', 'Y', 'D', 'P' };
+// Bump whenever the layout of an entry changes
+const uint32_t VERSION = 1;
+
+struct FileKey {
+  std::string path;
+  int64_t size = 0;
+  int64_t mtime = 0;
+};
+
+bool GetFileKey(const std::string& filename, FileKey* key) {
+  std::error_code error;
+  fs::path path = fs::absolute(filename, error);
+  if (error || !fs::is_regular_file(path, error)) {
+    return false;
+  }
+  uintmax_t size = fs::file_size(path, error);
+  if (error) {
+    return false;
+  }
+  fs::file_time_type mtime = fs::last_write_time(path, error);
+  if (error) {
+    return false;
+  }
+  key->path = path.lexically_normal().string();
+  key->size = int64_t(size);
+  key->mtime = int64_t(mtime.time_since_epoch().count());
+  return true;
+}
+
+// Entries are only read back on the machine that wrote them, so values are
+// stored in host byte order
+class Writer {
+public:
+  std::string bytes;
+
+  template <typename T>
+  void Put(const T& value) {
+    bytes.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+  void PutBytes(const void* data, size_t size) {
+    Put(uint64_t(size));
+    bytes.append(static_cast<const char*>(data), size);
+  }
+};
+
+class Reader {
+public:
+  const std::string& bytes;
+  size_t offset = 0;
+  bool ok = true;
+
+  explicit Reader(const std::string& bytes) : bytes(bytes) {}
+
+  template <typename T>
+  T Get() {
+    T value{};
+    if (!ok || bytes.size() - offset < sizeof(value)) {
+      ok = false;
+      return value;
+    }
+    std::memcpy(&value, bytes.data() + offset, sizeof(value));
+    offset += sizeof(value);
+    return value;
+  }
+  bool GetBytes(std::string* data) {
+    uint64_t size = Get<uint64_t>();
+    if (!ok || bytes.size() - offset < size) {
+      ok = false;
+      return false;
+    }
+    data->assign(bytes.data() + offset, size_t(size));
+    offset += size_t(size);
+    return true;
+  }
+};
+
+// FNV-1a, only to spread entries over file names
+uint64_t HashPath(const std::string& path) {
+  uint64_t hash = 14695981039346656037ull;
+  for (unsigned char c : path) {
+    hash = (hash ^ c) * 1099511628211ull;
+  }
+  return hash;
+}
+
+} // anonymous namespace
+
+void ProbeInfo::Capture(const AVFormatContext* pFormatContext, int streamIndex) {
+  const AVStream* stream = pFormatContext->streams[streamIndex];
+  const AVCodecParameters* codecpar = stream->codecpar;
+
+  streamCount = pFormatContext->nb_streams;
+  this->streamIndex = streamIndex;
+
+  codecId = codecpar->codec_id;
+  codecTag = codecpar->codec_tag;
+  format = codecpar->format;
+  bitRate = codecpar->bit_rate;
+  bitsPerCodedSample = codecpar->bits_per_coded_sample;
+  bitsPerRawSample = codecpar->bits_per_raw_sample;
+  profile = codecpar->profile;
+  level = codecpar->level;
+  width = codecpar->width;
+  height = codecpar->height;
+  sampleAspectRatio = codecpar->sample_aspect_ratio;
+  colorRange = codecpar->color_range;
+  colorPrimaries = codecpar->color_primaries;
+  colorTrc = codecpar->color_trc;
+  colorSpace = codecpar->color_space;
+  chromaLocation = codecpar->chroma_location;
+  fieldOrder = codecpar->field_order;
+  videoDelay = codecpar->video_delay;
+  extradata.assign(codecpar->extradata, codecpar->extradata + (codecpar->extradata ? codecpar->extradata_size : 0));
+
+  timeBase = stream->time_base;
+  avgFrameRate = stream->avg_frame_rate;
+  rFrameRate = stream->r_frame_rate;
+  startTime = stream->start_time;
+  duration = stream->duration;
+  nbFrames = stream->nb_frames;
+  formatDuration = pFormatContext->duration;
+}
+
+bool ProbeInfo::Apply(AVFormatContext* pFormatContext) const {
+  // Containers without a header (MPEG-TS) only find their streams by
+  // probing, and a different layout means the entry is stale anyway
+  if (pFormatContext->nb_streams != streamCount || streamIndex < 0 || unsigned(streamIndex) >= streamCount) {
+    return false;
+  }
+  AVStream* stream = pFormatContext->streams[streamIndex];
+  AVCodecParameters* codecpar = stream->codecpar;
+  if (codecpar->codec_type != AVMEDIA_TYPE_VIDEO ||
+      (codecpar->codec_id != AV_CODEC_ID_NONE && codecpar->codec_id != codecId)) {
+    return false;
+  }
+
+  uint8_t* data = nullptr;
+  if (!extradata.empty()) {
+    data = static_cast<uint8_t*>(av_mallocz(extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE));
+    if (!data) {
+      return false;
+    }
+    std::memcpy(data, extradata.data(), extradata.size());
+  }
+  av_freep(&codecpar->extradata);
+  codecpar->extradata = data;
+  codecpar->extradata_size = int(extradata.size());
+
+  codecpar->codec_id = codecId;
+  codecpar->codec_tag = codecTag;
+  codecpar->format = format;
+  codecpar->bit_rate = bitRate;
+  codecpar->bits_per_coded_sample = bitsPerCodedSample;
+  codecpar->bits_per_raw_sample = bitsPerRawSample;
+  codecpar->profile = profile;
+  codecpar->level = level;
+  codecpar->width = width;
+  codecpar->height = height;
+  codecpar->sample_aspect_ratio = sampleAspectRatio;
+  codecpar->color_range = AVColorRange(colorRange);
+  codecpar->color_primaries = AVColorPrimaries(colorPrimaries);
+  codecpar->color_trc = AVColorTransferCharacteristic(colorTrc);
+  codecpar->color_space = AVColorSpace(colorSpace);
+  codecpar->chroma_location = AVChromaLocation(chromaLocation);
+  codecpar->field_order = AVFieldOrder(fieldOrder);
+  codecpar->video_delay = videoDelay;
+
+  stream->time_base = timeBase;
+  stream->avg_frame_rate = avgFrameRate;
+  stream->r_frame_rate = rFrameRate;
+  stream->start_time = startTime;
+  stream->duration = duration;
+  stream->nb_frames = nbFrames;
+  pFormatContext->duration = formatDuration;
+  return true;
+}
+
+ProbeCache::ProbeCache(std::string directory) : directory(std::move(directory)) {}
+
+std::string ProbeCache::DefaultDirectory() {
+#if defined( WIN32 ) || defined( _WIN32 )
+  const char* base = std::getenv("LOCALAPPDATA");
+  return base ? (fs::path(base) / "ShadeYourDesktop" / "probe").string() : std::string();
+#elif defined( __APPLE__ )
+  const char* home = std::getenv("HOME");
+  return home ? (fs::path(home) / "Library" / "Caches" / "ShadeYourDesktop" / "probe").string() : std::string();
+#else
+  const char* base = std::getenv("XDG_CACHE_HOME");
+  if (base && *base) {
+    return (fs::path(base) / "ShadeYourDesktop" / "probe").string();
+  }
+  const char* home = std::getenv("HOME");
+  return home ? (fs::path(home) / ".cache" / "ShadeYourDesktop" / "probe").string() : std::string();
+#endif
+}
+
+std::string ProbeCache::EntryPath(const std::string& key) const {
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.probe", (unsigned long long)HashPath(key));
+  return (fs::path(directory) / name).string();
+}
+
+bool ProbeCache::Load(const std::string& filename, ProbeInfo* info) const {
+  FileKey key;
+  if (directory.empty() || !GetFileKey(filename, &key)) {
+    return false;
+  }
+
+  std::ifstream file(EntryPath(key.path), std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  std::string bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+  Reader reader(bytes);
+  char magic[sizeof(MAGIC)];
+  for (char& c : magic) {
+    c = reader.Get<char>();
+  }
+  if (!reader.ok || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || reader.Get<uint32_t>() != VERSION) {
+    return false;
+  }
+  std::string path;
+  reader.GetBytes(&path);
+  int64_t size = reader.Get<int64_t>();
+  int64_t mtime = reader.Get<int64_t>();
+  if (!reader.ok || path != key.path || size != key.size || mtime != key.mtime) {
+    // The video changed, or another path with the same hash
+    return false;
+  }
+
+  ProbeInfo loaded;
+  loaded.streamCount = reader.Get<uint32_t>();
+  loaded.streamIndex = reader.Get<int32_t>();
+  loaded.codecId = AVCodecID(reader.Get<int32_t>());
+  loaded.codecTag = reader.Get<uint32_t>();
+  loaded.format = reader.Get<int32_t>();
+  loaded.bitRate = reader.Get<int64_t>();
+  loaded.bitsPerCodedSample = reader.Get<int32_t>();
+  loaded.bitsPerRawSample = reader.Get<int32_t>();
+  loaded.profile = reader.Get<int32_t>();
+  loaded.level = reader.Get<int32_t>();
+  loaded.width = reader.Get<int32_t>();
+  loaded.height = reader.Get<int32_t>();
+  loaded.sampleAspectRatio = reader.Get<AVRational>();
+  loaded.colorRange = reader.Get<int32_t>();
+  loaded.colorPrimaries = reader.Get<int32_t>();
+  loaded.colorTrc = reader.Get<int32_t>();
+  loaded.colorSpace = reader.Get<int32_t>();
+  loaded.chromaLocation = reader.Get<int32_t>();
+  loaded.fieldOrder = reader.Get<int32_t>();
+  loaded.videoDelay = reader.Get<int32_t>();
+  std::string extradata;
+  reader.GetBytes(&extradata);
+  loaded.extradata.assign(extradata.begin(), extradata.end());
+
+  loaded.timeBase = reader.Get<AVRational>();
+  loaded.avgFrameRate = reader.Get<AVRational>();
+  loaded.rFrameRate = reader.Get<AVRational>();
+  loaded.startTime = reader.Get<int64_t>();
+  loaded.duration = reader.Get<int64_t>();
+  loaded.nbFrames = reader.Get<int64_t>();
+  loaded.formatDuration = reader.Get<int64_t>();
+
+  uint64_t keyframes = reader.Get<uint64_t>();
+  if (!reader.ok || keyframes > (bytes.size() - reader.offset) / (2 * sizeof(int64_t))) {
+    return false;
+  }
+  loaded.keyframes.resize(size_t(keyframes));
+  for (KeyframeIndex::Entry& entry : loaded.keyframes) {
+    entry.timestamp = reader.Get<int64_t>();
+    entry.pos = reader.Get<int64_t>();
+  }
+  if (!reader.ok) {
+    return false;
+  }
+
+  *info = std::move(loaded);
+  return true;
+}
+
+void ProbeCache::Store(const std::string& filename, const ProbeInfo& info) const {
+  FileKey key;
+  if (directory.empty() || !GetFileKey(filename, &key)) {
+    return;
+  }
+
+  Writer writer;
+  writer.bytes.append(MAGIC, sizeof(MAGIC));
+  writer.Put(VERSION);
+  writer.PutBytes(key.path.data(), key.path.size());
+  writer.Put(key.size);
+  writer.Put(key.mtime);
+
+  writer.Put(uint32_t(info.streamCount));
+  writer.Put(int32_t(info.streamIndex));
+  writer.Put(int32_t(info.codecId));
+  writer.Put(info.codecTag);
+  writer.Put(int32_t(info.format));
+  writer.Put(info.bitRate);
+  writer.Put(int32_t(info.bitsPerCodedSample));
+  writer.Put(int32_t(info.bitsPerRawSample));
+  writer.Put(int32_t(info.profile));
+  writer.Put(int32_t(info.level));
+  writer.Put(int32_t(info.width));
+  writer.Put(int32_t(info.height));
+  writer.Put(info.sampleAspectRatio);
+  writer.Put(int32_t(info.colorRange));
+  writer.Put(int32_t(info.colorPrimaries));
+  writer.Put(int32_t(info.colorTrc));
+  writer.Put(int32_t(info.colorSpace));
+  writer.Put(int32_t(info.chromaLocation));
+  writer.Put(int32_t(info.fieldOrder));
+  writer.Put(int32_t(info.videoDelay));
+  writer.PutBytes(info.extradata.data(), info.extradata.size());
+
+  writer.Put(info.timeBase);
+  writer.Put(info.avgFrameRate);
+  writer.Put(info.rFrameRate);
+  writer.Put(info.startTime);
+  writer.Put(info.duration);
+  writer.Put(info.nbFrames);
+  writer.Put(info.formatDuration);
+
+  writer.Put(uint64_t(info.keyframes.size()));
+  for (const KeyframeIndex::Entry& entry : info.keyframes) {
+    writer.Put(entry.timestamp);
+    writer.Put(entry.pos);
+  }
+
+  std::error_code error;
+  fs::create_directories(directory, error);
+  std::string path = EntryPath(key.path);
+  // Written aside and renamed, so a concurrent start never reads half an entry
+  std::string temporary = path + ".tmp";
+  {
+    std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+    if (!file || !file.write(writer.bytes.data(), std::streamsize(writer.bytes.size()))) {
+      std::cerr << "Failed to write probe cache entry " << temporary << std::endl;
+      return;
+    }
+  }
+  fs::rename(temporary, path, error);
+  if (error) {
+    std::cerr << "Failed to write probe cache entry " << path << ": " << error.message() << std::endl;
+    fs::remove(temporary, error);
+  }
+}
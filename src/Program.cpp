@@ -82,6 +82,11 @@ out vec4 fragColor;
 
 )";
 
+// Frame counter, only declared for shaders that don't declare it themselves
+const char FRAGMENT_SHADER_SOURCE_FRAME_UNIFORM[] = R"(
+uniform int iFrame;
+)";
+
 const char FRAGMENT_SHADER_SOURCE_MAIN_WRAPPER[] = R"(
 void main() {
   vec2 fragCoord = gl_FragCoord.xy;
@@ -217,10 +222,13 @@ std::unordered_map<std::string, Uniform> GetActiveUniforms(GLuint program) {
 std::string GetFullFragmentShaderSource(const std::string& fragment_shader_source) {
   static const std::regex mainImageReg("void\\s+mainImage\\(\\s*out\\s+vec4\\s+fragColor\\s*,\\s*in\\s+vec2\\s+fragCoord\\s*\\)");
   static const std::regex mainReg("void\\s+main\\(\\s*\\)");
+  static const std::regex frameReg("(\\bu?int|\\bfloat|#define)\\s+iFrame\\b");
 
-  std::string full_frag_shader_source =
-    std::string(FRAGMENT_SHADER_SOURCE_PREFIX) +
-    fragment_shader_source;
+  std::string full_frag_shader_source = std::string(FRAGMENT_SHADER_SOURCE_PREFIX);
+  if (!std::regex_search(fragment_shader_source, frameReg)) {
+    full_frag_shader_source += std::string(FRAGMENT_SHADER_SOURCE_FRAME_UNIFORM);
+  }
+  full_frag_shader_source += fragment_shader_source;
 
   std::smatch mainImageFuncMatch;
   std::smatch mainFuncMatch;
@@ -269,6 +277,22 @@ void Program::Use() const {
   glUseProgram(program);
 }
 
+bool Program::HasUniform(const std::string& uniform_name) const {
+  return glGetUniformLocation(program, uniform_name.c_str()) != -1;
+}
+
+GLenum Program::UniformType(const std::string& uniform_name) const {
+  const GLchar* name = uniform_name.c_str();
+  GLuint index = GL_INVALID_INDEX;
+  glGetUniformIndices(program, 1, &name, &index);
+  if (index == GL_INVALID_INDEX) {
+    return GL_NONE;
+  }
+  GLint type = GL_NONE;
+  glGetActiveUniformsiv(program, 1, &index, GL_UNIFORM_TYPE, &type);
+  return GLenum(type);
+}
+
 void Program::BindInt(const std::string& uniform_name, int value) const {
   GLint location = glGetUniformLocation(program, uniform_name.c_str());
   if (location != -1) {
@@ -278,6 +302,15 @@ void Program::BindInt(const std::string& uniform_name, int value) const {
   }
 }
 
+void Program::BindUint(const std::string& uniform_name, unsigned int value) const {
+  GLint location = glGetUniformLocation(program, uniform_name.c_str());
+  if (location != -1) {
+    glUniform1uiv(location, 1, &value);
+  } else {
+    PrintUniformLog(uniform_name);
+  }
+}
+
 void Program::BindFloat(const std::string& uniform_name, float value) const {
   GLint location = glGetUniformLocation(program, uniform_name.c_str());
   if (location != -1) {
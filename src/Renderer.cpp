@@ -14,32 +14,11 @@
 namespace {
 
 /**
- * @brief Create a texture with linear filter and clamp to edge wrap mode.
- * 
- * @param width 
- * @param height 
- * @param pixels 
- * @param texture optional, default is 0
- * @return GLuint 
+ * @brief Load an image file into `texture`, flipped so row 0 is the bottom.
+ *
+ * @return bool false if the file couldn't be decoded
  */
-GLuint NewTexture2D(int width, int height, const void* pixels = NULL, GLuint texture = 0) {
-  if (texture == 0) {
-    glGenTextures(1, &texture);
-  }
-  glActiveTexture(GL_TEXTURE0);
-  glBindTexture(GL_TEXTURE_2D, texture);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
-  glBindTexture(GL_TEXTURE_2D, NULL);
-
-  return texture;
-}
-
-GLuint NewTexture2DFromFile(const std::string& filename, GLuint texture = 0) {
+bool LoadTexture2DFromFile(TextureUploader& uploader, const std::string& filename, GLuint texture) {
   stbi_set_flip_vertically_on_load(true);
 
   int width, height, channel;
@@ -47,17 +26,398 @@ GLuint NewTexture2DFromFile(const std::string& filename, GLuint texture = 0) {
 
   if ( !pixels ) {
     std::cerr << "Failed to load texture file " << filename << std::endl;
-    return 0;
+    return false;
   }
 
-  texture = NewTexture2D( width, height, pixels, texture );
+  uploader.Upload( texture, TEXTURE_FORMAT_RGBA8, width, height, pixels );
   stbi_image_free( pixels );
 
-  return texture;
+  return true;
+}
+
+const char COLOR_CONVERSION_FRAG_SHADER_SOURCE[] = R"(
+uniform mat3 yuvToRgb;
+uniform vec3 yuvOffset;
+uniform int semiPlanar;
+
+void mainImage( out vec4 fragColor, in vec2 fragCoord ) {
+  vec2 uv = fragCoord / iResolution.xy;
+  vec3 yuv;
+  yuv.x = texture( iChannel0, uv ).r;
+  yuv.yz = semiPlanar == 1
+    ? texture( iChannel1, uv ).rg
+    : vec2( texture( iChannel1, uv ).r, texture( iChannel2, uv ).r );
+  fragColor = vec4( clamp( yuvToRgb * ( yuv - yuvOffset ), 0.0, 1.0 ), 1.0 );
+}
+)";
+
+const char CROSSFADE_FRAG_SHADER_SOURCE[] = R"(
+uniform float mixFactor;
+
+void mainImage( out vec4 fragColor, in vec2 fragCoord ) {
+  vec2 uv = fragCoord / iResolution.xy;
+  fragColor = mix( texture( iChannel0, uv ), texture( iChannel1, uv ), mixFactor );
+}
+)";
+
+const char YCOCG_FRAG_SHADER_SOURCE[] = R"(
+void mainImage( out vec4 fragColor, in vec2 fragCoord ) {
+  vec2 uv = fragCoord / iResolution.xy;
+  float y = texture( iChannel0, uv ).r;
+  vec2 cocg = texture( iChannel1, uv ).rg - 128.0 / 255.0;
+  float tmp = y - cocg.y;
+  fragColor = vec4( clamp( vec3( tmp + cocg.x, y + cocg.y, tmp - cocg.x ), 0.0, 1.0 ), 1.0 );
+}
+)";
+
+// Above this share of dirty tiles, one upload of the whole frame is cheaper
+// than many small ones.
+const double MAX_DIRTY_FRACTION = 0.5;
+
+struct PlaneLayout {
+  int count;
+  TextureFormat planes[3];
+  // log2 of the chroma subsampling
+  int chromaShiftX;
+  int chromaShiftY;
+  bool semiPlanar;
+  int depth;
+};
+
+bool GetPlaneLayout(AVPixelFormat format, PlaneLayout* layout) {
+  switch (format) {
+  case AV_PIX_FMT_YUV420P:
+    *layout = { 3, { TEXTURE_FORMAT_R8, TEXTURE_FORMAT_R8, TEXTURE_FORMAT_R8 }, 1, 1, false, 8 };
+    return true;
+  case AV_PIX_FMT_NV12:
+    *layout = { 2, { TEXTURE_FORMAT_R8, TEXTURE_FORMAT_RG8 }, 1, 1, true, 8 };
+    return true;
+  case AV_PIX_FMT_P010:
+    *layout = { 2, { TEXTURE_FORMAT_R16, TEXTURE_FORMAT_RG16 }, 1, 1, true, 10 };
+    return true;
+  case AV_PIX_FMT_YUV444P:
+    *layout = { 3, { TEXTURE_FORMAT_R8, TEXTURE_FORMAT_R8, TEXTURE_FORMAT_R8 }, 0, 0, false, 8 };
+    return true;
+  default:
+    return false;
+  }
+}
+
+/**
+ * @brief Build the YUV to RGB matrix and offsets for normalized samples.
+ *
+ * @param yuvToRgb column-major 3x3 matrix
+ * @param yuvOffset subtracted from the sampled (Y, U, V) before the matrix
+ */
+void GetColorConversion(
+  AVColorSpace colorspace,
+  AVColorRange range,
+  int height,
+  int depth,
+  std::array<float, 9>& yuvToRgb,
+  std::array<float, 3>& yuvOffset) {
+  // Luma coefficients, unspecified content is guessed from its size like
+  // players do: HD is BT.709, SD is BT.601.
+  double kr = 0.299, kb = 0.114;
+  switch (colorspace) {
+  case AVCOL_SPC_BT709:
+    kr = 0.2126; kb = 0.0722;
+    break;
+  case AVCOL_SPC_BT2020_NCL:
+  case AVCOL_SPC_BT2020_CL:
+    kr = 0.2627; kb = 0.0593;
+    break;
+  case AVCOL_SPC_SMPTE240M:
+    kr = 0.212; kb = 0.087;
+    break;
+  case AVCOL_SPC_BT470BG:
+  case AVCOL_SPC_SMPTE170M:
+  case AVCOL_SPC_FCC:
+    break;
+  default:
+    if (height >= 720) {
+      kr = 0.2126; kb = 0.0722;
+    }
+    break;
+  }
+  double kg = 1.0 - kr - kb;
+
+  // Normalized size of one code value. 10-bit P010 samples sit in the high
+  // bits of a 16-bit word.
+  double code = depth > 8 ? 64.0 / 65535.0 : 1.0 / 255.0;
+  double steps = double(1 << (depth - 8));
+  double yOffset = 0.0;
+  double yRange = double((1 << depth) - 1) * code;
+  double cRange = yRange;
+  if (range != AVCOL_RANGE_JPEG) {
+    yOffset = 16.0 * steps * code;
+    yRange = 219.0 * steps * code;
+    cRange = 224.0 * steps * code;
+  }
+  double cOffset = 128.0 * steps * code;
+
+  double y = 1.0 / yRange;
+  yuvToRgb = {
+    // Y column
+    float(y), float(y), float(y),
+    // U column
+    0.0f, float(-2.0 * kb * (1.0 - kb) / kg / cRange), float(2.0 * (1.0 - kb) / cRange),
+    // V column
+    float(2.0 * (1.0 - kr) / cRange), float(-2.0 * kr * (1.0 - kr) / kg / cRange), 0.0f,
+  };
+  yuvOffset = { float(yOffset), float(cOffset), float(cOffset) };
 }
 
 } // anonymous namespace
 
+void Renderer::SetVideoFrame(const VideoFrame* frame) {
+  UploadVideoFrame(frame, videoLayer);
+  // Frames of a past crossfade may be gone, don't mistake new ones for them
+  fadeLayers[0].lastFrame = nullptr;
+  fadeLayers[1].lastFrame = nullptr;
+
+  LendVideoBuffers();
+}
+
+void Renderer::SetVideoFrames(const VideoFrame* outgoing, const VideoFrame* incoming, float mix) {
+  if (fadeLayers[0].texture == 0) {
+    glGenTextures(1, &fadeLayers[0].texture);
+    glGenTextures(1, &fadeLayers[1].texture);
+    crossfadeProgram = new Program(CROSSFADE_FRAG_SHADER_SOURCE);
+  }
+  UploadVideoFrame(outgoing, fadeLayers[0]);
+  UploadVideoFrame(incoming, fadeLayers[1]);
+  // texture0 no longer holds a frame of its own
+  videoLayer.lastFrame = nullptr;
+  videoLayer.lastId = 0;
+
+  // The result takes the size of the incoming video, which stays
+  const VideoLayer& sized = fadeLayers[1].width > 0 ? fadeLayers[1] : fadeLayers[0];
+  if (sized.width > 0) {
+    // The mix moves on every frame
+    contentChanged = true;
+    BindVideoFramebuffer(videoLayer, sized.width, sized.height);
+    glDisable(GL_BLEND);
+
+    crossfadeProgram->Use();
+    crossfadeProgram->BindVec2("iResolution", { float(videoLayer.width), float(videoLayer.height) });
+    crossfadeProgram->BindFloat("mixFactor", mix);
+    crossfadeProgram->BindTexture2D("iChannel0", fadeLayers[0].texture, 0);
+    crossfadeProgram->BindTexture2D("iChannel1", fadeLayers[1].texture, 1);
+    DrawQuad();
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  }
+
+  LendVideoBuffers();
+}
+
+void Renderer::SetChannelVideoFrame(int channel, const VideoFrame* frame) {
+  if (channel < 1 || channel > 3) {
+    return;
+  }
+  UploadVideoFrame(frame, channelLayers[channel - 1]);
+  LendVideoBuffers();
+}
+
+void Renderer::SetCompressedVideoFrame(int frame) {
+  if (compressedVideo == nullptr || !compressedVideo->IsOpen() || frame == compressedFrame) {
+    return;
+  }
+  compressedFrame = frame;
+  contentChanged = true;
+
+  if (compressedTextures[0] == 0) {
+    glGenTextures(2, compressedTextures);
+    ycocgProgram = new Program(YCOCG_FRAG_SHADER_SOURCE);
+  }
+  uploader.UploadCompressed(compressedTextures[0], GL_COMPRESSED_RED_RGTC1, compressedVideo->width, compressedVideo->height,
+    compressedVideo->LumaBlocks(frame), GLsizei(compressedVideo->LumaBytes()));
+  uploader.UploadCompressed(compressedTextures[1], GL_COMPRESSED_RG_RGTC2, compressedVideo->ChromaWidth(), compressedVideo->ChromaHeight(),
+    compressedVideo->ChromaBlocks(frame), GLsizei(compressedVideo->ChromaBytes()));
+  videoLayer.lastFrame = nullptr;
+  videoLayer.lastId = 0;
+
+  BindVideoFramebuffer(videoLayer, compressedVideo->width, compressedVideo->height);
+  glDisable(GL_BLEND);
+
+  ycocgProgram->Use();
+  ycocgProgram->BindVec2("iResolution", { float(videoLayer.width), float(videoLayer.height) });
+  ycocgProgram->BindTexture2D("iChannel0", compressedTextures[0], 0);
+  ycocgProgram->BindTexture2D("iChannel1", compressedTextures[1], 1);
+  DrawQuad();
+
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void Renderer::ReleaseLentBuffers(const std::vector<FrameBuffer>& buffers) {
+  for (const FrameBuffer& buffer : buffers) {
+    uploader.ReleaseLent(buffer.handle);
+  }
+}
+
+void Renderer::UploadVideoFrame(const VideoFrame* frame, VideoLayer& layer) {
+  if (frame == nullptr || (frame == layer.lastFrame && frame->pts == layer.lastPts)) {
+    return;
+  }
+
+  // When a crossfade starts or ends, the frame moves to another layer. Its
+  // lent buffer went to the first upload and may be lent out again already.
+  const VideoLayer* holder = FindVideoLayer(frame, layer);
+  if (holder) {
+    CopyVideoLayer(*holder, layer);
+  } else if (frame->buffer.data) {
+    // Converted straight into one of our mapped buffers
+    if (!uploader.UploadLent(frame->buffer.handle, layer.texture, TEXTURE_FORMAT_RGBA8,
+          frame->width, frame->height, frame->linesize[0], DirtyRects(frame, layer.lastId, 0, 0))) {
+      // Given back already, the layer keeps what it shows
+      return;
+    }
+    layer.width = frame->width;
+    layer.height = frame->height;
+  } else if (frame->format == AV_PIX_FMT_RGBA) {
+    uploader.Upload(layer.texture, TEXTURE_FORMAT_RGBA8, frame->width, frame->height, frame->data[0],
+      frame->linesize[0], DirtyRects(frame, layer.lastId, 0, 0));
+    layer.width = frame->width;
+    layer.height = frame->height;
+  } else {
+    ConvertVideoPlanes(frame, layer);
+  }
+  layer.lastFrame = frame;
+  layer.lastPts = frame->pts;
+  layer.lastId = frame->id;
+  contentChanged = true;
+}
+
+/**
+ * @brief A layer other than `except` whose texture holds `frame`, null if
+ * there is none.
+ */
+const Renderer::VideoLayer* Renderer::FindVideoLayer(const VideoFrame* frame, const VideoLayer& except) const {
+  if (frame->id == 0) {
+    return nullptr;
+  }
+  const VideoLayer* layers[] = { &videoLayer, &fadeLayers[0], &fadeLayers[1], &channelLayers[0], &channelLayers[1], &channelLayers[2] };
+  for (const VideoLayer* layer : layers) {
+    if (layer != &except && layer->lastId == frame->id && layer->width > 0) {
+      return layer;
+    }
+  }
+  return nullptr;
+}
+
+void Renderer::CopyVideoLayer(const VideoLayer& source, VideoLayer& target) {
+  if (copyFramebuffer == 0) {
+    glGenFramebuffers(1, &copyFramebuffer);
+  }
+  BindVideoFramebuffer(target, source.width, source.height);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, copyFramebuffer);
+  glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, source.texture, 0);
+  glBlitFramebuffer(0, 0, source.width, source.height, 0, 0, source.width, source.height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+/**
+ * @brief The parts of `frame` to upload to a texture holding the frame
+ * `textureId`, in a plane subsampled by `shiftX` and `shiftY`.
+ *
+ * @return nullptr to upload the whole frame
+ */
+const std::vector<TileRect>* Renderer::DirtyRects(const VideoFrame* frame, uint64_t textureId, int shiftX, int shiftY) {
+  if (frame->dirtyBase == 0 || frame->dirtyBase != textureId
+      || frame->dirtyTiles.DirtyFraction() > MAX_DIRTY_FRACTION) {
+    return nullptr;
+  }
+  frame->dirtyTiles.Rects(shiftX, shiftY, &dirtyRects);
+  return &dirtyRects;
+}
+
+void Renderer::LendVideoBuffers() {
+  // All decoders share the lendable buffers, including the next one of a
+  // playlist while it is primed
+  Decoder* targets[] = { decoder, nextDecoder, channelDecoders[0], channelDecoders[1], channelDecoders[2] };
+  size_t maxLent = 0;
+  for (Decoder* target : targets) {
+    maxLent += target ? target->MaxLentBuffers() : 0;
+  }
+  for (Decoder* target : targets) {
+    LendVideoBuffers(target, maxLent);
+  }
+}
+
+void Renderer::LendVideoBuffers(Decoder* target, size_t maxLent) {
+  if (target == nullptr) {
+    return;
+  }
+
+  GLsizeiptr size = GLsizeiptr(target->output_width) * target->output_height * 4;
+  FrameBuffer buffer;
+  while (uploader.MapLendableBuffer(size, maxLent, &buffer.data, &buffer.handle)) {
+    buffer.size = size;
+    if (!target->LendBuffer(buffer)) {
+      uploader.ReleaseLent(buffer.handle);
+      break;
+    }
+  }
+}
+
+void Renderer::BindVideoFramebuffer(VideoLayer& layer, int width, int height) {
+  if (videoFramebuffer == 0) {
+    glGenFramebuffers(1, &videoFramebuffer);
+  }
+  if (layer.width != width || layer.height != height) {
+    layer.width = width;
+    layer.height = height;
+    uploader.Upload(layer.texture, TEXTURE_FORMAT_RGBA8, width, height, nullptr);
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER, videoFramebuffer);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, layer.texture, 0);
+  glViewport(0, 0, width, height);
+}
+
+void Renderer::ConvertVideoPlanes(const VideoFrame* frame, VideoLayer& layer) {
+  PlaneLayout layout;
+  if (!GetPlaneLayout(frame->format, &layout)) {
+    std::cerr << "Unsupported video frame format " << frame->format << std::endl;
+    return;
+  }
+
+  if (planeTextures[0] == 0) {
+    glGenTextures(3, planeTextures);
+    colorConversionProgram = new Program(COLOR_CONVERSION_FRAG_SHADER_SOURCE);
+  }
+
+  for (int i = 0; i < layout.count; i++) {
+    int shiftX = i == 0 ? 0 : layout.chromaShiftX;
+    int shiftY = i == 0 ? 0 : layout.chromaShiftY;
+    // Round up, odd sizes keep their last chroma column/row
+    int width = (frame->width + (1 << shiftX) - 1) >> shiftX;
+    int height = (frame->height + (1 << shiftY) - 1) >> shiftY;
+    uploader.Upload(planeTextures[i], layout.planes[i], width, height, frame->data[i], frame->linesize[i],
+      DirtyRects(frame, planeFrameId, shiftX, shiftY));
+  }
+  planeFrameId = frame->id;
+
+  std::array<float, 9> yuvToRgb;
+  std::array<float, 3> yuvOffset;
+  GetColorConversion(frame->colorspace, frame->color_range, frame->height, layout.depth, yuvToRgb, yuvOffset);
+
+  BindVideoFramebuffer(layer, frame->width, frame->height);
+  glDisable(GL_BLEND);
+
+  colorConversionProgram->Use();
+  colorConversionProgram->BindVec2("iResolution", { float(layer.width), float(layer.height) });
+  colorConversionProgram->BindMat3("yuvToRgb", yuvToRgb);
+  colorConversionProgram->BindVec3("yuvOffset", yuvOffset);
+  colorConversionProgram->BindInt("semiPlanar", layout.semiPlanar ? 1 : 0);
+  colorConversionProgram->BindTexture2D("iChannel0", planeTextures[0], 0);
+  colorConversionProgram->BindTexture2D("iChannel1", planeTextures[1], 1);
+  colorConversionProgram->BindTexture2D("iChannel2", planeTextures[2], 2);
+  DrawQuad();
+
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
 void Renderer::SetRenderState() {
   glViewport( viewport.x, viewport.y, viewport.z, viewport.w );
   glClearColor( clearColor.x, clearColor.y, clearColor.z, clearColor.w );
@@ -83,35 +443,68 @@ Renderer::Renderer()
   texture1 = textures[ 1 ];
   texture2 = textures[ 2 ];
   texture3 = textures[ 3 ];
+  videoLayer.texture = texture0;
+  channelLayers[0].texture = texture1;
+  channelLayers[1].texture = texture2;
+  channelLayers[2].texture = texture3;
 }
 
 void Renderer::SetTexture0(void* pixels, int width, int height) {
-  NewTexture2D(width, height, pixels, texture0);
+  uploader.Upload(texture0, TEXTURE_FORMAT_RGBA8, width, height, pixels);
+  contentChanged = true;
+  videoLayer.lastFrame = nullptr;
+  videoLayer.lastId = 0;
+  videoLayer.width = width;
+  videoLayer.height = height;
 }
 void Renderer::SetTexture1(void* pixels, int width, int height) {
-  NewTexture2D(width, height, pixels, texture1);
+  uploader.Upload(texture1, TEXTURE_FORMAT_RGBA8, width, height, pixels);
+  contentChanged = true;
+  channelLayers[0].lastId = 0;
 }
 void Renderer::SetTexture2(void* pixels, int width, int height) {
-  NewTexture2D(width, height, pixels, texture2);
+  uploader.Upload(texture2, TEXTURE_FORMAT_RGBA8, width, height, pixels);
+  contentChanged = true;
+  channelLayers[1].lastId = 0;
 }
 void Renderer::SetTexture3(void* pixels, int width, int height) {
-  NewTexture2D(width, height, pixels, texture3);
+  uploader.Upload(texture3, TEXTURE_FORMAT_RGBA8, width, height, pixels);
+  contentChanged = true;
+  channelLayers[2].lastId = 0;
 }
 
 void Renderer::SetTexture0(const std::string& filename) {
-  texture0 = NewTexture2DFromFile( filename, texture0 );
+  LoadTexture2DFromFile( uploader, filename, texture0 );
+  contentChanged = true;
+  videoLayer.lastId = 0;
 }
 void Renderer::SetTexture1(const std::string& filename) {
-  texture1 = NewTexture2DFromFile( filename, texture1 );
+  LoadTexture2DFromFile( uploader, filename, texture1 );
+  contentChanged = true;
+  channelLayers[0].lastId = 0;
 }
 void Renderer::SetTexture2(const std::string& filename) {
-  texture2 = NewTexture2DFromFile( filename, texture2 );
+  LoadTexture2DFromFile( uploader, filename, texture2 );
+  contentChanged = true;
+  channelLayers[1].lastId = 0;
 }
 void Renderer::SetTexture3(const std::string& filename) {
-  texture3 = NewTexture2DFromFile( filename, texture3 );
+  LoadTexture2DFromFile( uploader, filename, texture3 );
+  contentChanged = true;
+  channelLayers[2].lastId = 0;
 }
 
 Renderer::~Renderer() {
+  delete colorConversionProgram;
+  delete crossfadeProgram;
+  delete ycocgProgram;
+  glDeleteFramebuffers( 1, &videoFramebuffer );
+  glDeleteFramebuffers( 1, &copyFramebuffer );
+  for (VideoLayer& layer : fadeLayers) {
+    glDeleteTextures( 1, &layer.texture );
+  }
+  glDeleteTextures( 3, planeTextures );
+  glDeleteTextures( 2, compressedTextures );
   glDeleteVertexArrays( 1, & emptyVAO );
   glDeleteTextures( 1, &texture0 );
   glDeleteTextures( 1, &texture1 );
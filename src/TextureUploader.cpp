@@ -0,0 +1,363 @@
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+#include "TextureUploader.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Upper bound for a single fence wait, the GPU is expected to finish a
+// transfer within a couple of frames.
+const GLuint64 FENCE_TIMEOUT_NANOSECONDS = 1000000000;
+
+// Handles of lent buffers: the buffer's index + 1 in the low bits, its
+// lending count above them.
+const int LENDABLE_INDEX_BITS = 8;
+const uintptr_t LENDABLE_INDEX_MASK = (uintptr_t(1) << LENDABLE_INDEX_BITS) - 1;
+
+} // anonymous namespace
+
+UploadStats UploadStats::Since(const UploadStats& previous) const {
+  UploadStats diff;
+  diff.frames = frames - previous.frames;
+  diff.uploads = uploads - previous.uploads;
+  diff.bytes = bytes - previous.bytes;
+  diff.nanoseconds = nanoseconds - previous.nanoseconds;
+  diff.fenceWaits = fenceWaits - previous.fenceWaits;
+  diff.allocations = allocations - previous.allocations;
+  diff.zeroCopyUploads = zeroCopyUploads - previous.zeroCopyUploads;
+  diff.partialUploads = partialUploads - previous.partialUploads;
+  diff.bytesSkipped = bytesSkipped - previous.bytesSkipped;
+  return diff;
+}
+
+std::ostream& operator<<(std::ostream& os, const UploadStats& stats) {
+  double frames = stats.frames == 0 ? 1.0 : double(stats.frames);
+  os << double(stats.bytes) / frames / 1024.0 << " KiB/frame"
+     << ", " << double(stats.nanoseconds) / frames / 1e6 << " ms/frame"
+     << ", uploads " << stats.uploads << " (" << stats.zeroCopyUploads << " zero-copy"
+     << ", " << stats.partialUploads << " partial saving " << double(stats.bytesSkipped) / frames / 1024.0 << " KiB/frame)"
+     << ", fence waits " << stats.fenceWaits
+     << ", allocations " << stats.allocations
+     << " over " << stats.frames << " frames";
+  return os;
+}
+
+TextureUploader::TextureUploader(size_t ringSize) : ring(ringSize) {
+  for (PixelBuffer& pixelBuffer : ring) {
+    glGenBuffers(1, &pixelBuffer.buffer);
+  }
+}
+
+TextureUploader::~TextureUploader() {
+  for (std::vector<PixelBuffer>* buffers : { &ring, &lendable }) {
+    for (PixelBuffer& pixelBuffer : *buffers) {
+      if (pixelBuffer.fence) {
+        glDeleteSync(pixelBuffer.fence);
+      }
+      if (pixelBuffer.lent) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer.buffer);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+      }
+      glDeleteBuffers(1, &pixelBuffer.buffer);
+    }
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+/**
+ * @return bool true if the storage was (re)allocated, its content is undefined
+ */
+bool TextureUploader::EnsureStorage(GLuint texture, const TextureFormat& format, int width, int height) {
+  TextureStorage& storage = storages[texture];
+  if (storage.width == width && storage.height == height && storage.internalFormat == format.internalFormat) {
+    return false;
+  }
+
+  // GL 3.3 core has no glTexStorage2D, so the storage is specified once per
+  // size with glTexImage2D and afterwards only ever updated.
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexImage2D(GL_TEXTURE_2D, 0, format.internalFormat, width, height, 0, format.format, format.type, nullptr);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+  storage.width = width;
+  storage.height = height;
+  storage.internalFormat = format.internalFormat;
+  stats.allocations++;
+  return true;
+}
+
+TextureUploader::PixelBuffer& TextureUploader::AcquireBuffer(GLsizeiptr size) {
+  PixelBuffer& pixelBuffer = ring[next];
+  next = (next + 1) % ring.size();
+
+  if (pixelBuffer.fence) {
+    GLenum status = glClientWaitSync(pixelBuffer.fence, 0, 0);
+    if (status == GL_TIMEOUT_EXPIRED) {
+      stats.fenceWaits++;
+      status = glClientWaitSync(pixelBuffer.fence, GL_SYNC_FLUSH_COMMANDS_BIT, FENCE_TIMEOUT_NANOSECONDS);
+    }
+    if (status == GL_WAIT_FAILED) {
+      std::cerr << "glClientWaitSync failed on a pixel unpack buffer" << std::endl;
+    }
+    glDeleteSync(pixelBuffer.fence);
+    pixelBuffer.fence = nullptr;
+  }
+
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer.buffer);
+  if (pixelBuffer.size < size) {
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+    pixelBuffer.size = size;
+  }
+
+  return pixelBuffer;
+}
+
+/**
+ * @brief Transfer the image in the bound buffer, laid out as in the source,
+ * or only `rects` of it if given.
+ */
+void TextureUploader::TransferFromBuffer(PixelBuffer& pixelBuffer, GLuint texture, const TextureFormat& format, int width, int height, int linesize,
+  const std::vector<TileRect>* rects) {
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, linesize / format.bytesPerPixel);
+  if (rects) {
+    uint64_t bytes = 0;
+    for (const TileRect& rect : *rects) {
+      uintptr_t offset = uintptr_t(rect.y) * uintptr_t(linesize) + uintptr_t(rect.x) * uintptr_t(format.bytesPerPixel);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, rect.x, rect.y, rect.width, rect.height, format.format, format.type,
+        reinterpret_cast<const void*>(offset));
+      bytes += uint64_t(rect.width) * uint64_t(rect.height) * uint64_t(format.bytesPerPixel);
+    }
+    uint64_t whole = uint64_t(width) * uint64_t(height) * uint64_t(format.bytesPerPixel);
+    stats.bytes += bytes;
+    stats.bytesSkipped += whole > bytes ? whole - bytes : 0;
+    stats.partialUploads++;
+  } else {
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format.format, format.type, nullptr);
+    stats.bytes += GLsizeiptr(linesize) * height;
+  }
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+  pixelBuffer.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+  stats.uploads++;
+}
+
+void TextureUploader::Upload(GLuint texture, const TextureFormat& format, int width, int height, const void* pixels, int linesize,
+  const std::vector<TileRect>* rects) {
+  if (width <= 0 || height <= 0) {
+    return;
+  }
+
+  Clock::time_point start = Clock::now();
+
+  glActiveTexture(GL_TEXTURE0);
+  if (EnsureStorage(texture, format, width, height)) {
+    rects = nullptr;
+  }
+
+  if (pixels) {
+    if (linesize == 0) {
+      linesize = width * format.bytesPerPixel;
+    }
+    GLsizeiptr size = GLsizeiptr(linesize) * height;
+
+    PixelBuffer& pixelBuffer = AcquireBuffer(size);
+    // The fence guarantees the GPU is done with this buffer, no need to let
+    // the driver synchronize again
+    void* mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+      GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    if (mapped) {
+      CopyRows(static_cast<uint8_t*>(mapped), static_cast<const uint8_t*>(pixels), linesize,
+        width * format.bytesPerPixel, height, format.bytesPerPixel, rects);
+      glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+      TransferFromBuffer(pixelBuffer, texture, format, width, height, linesize, rects);
+    } else {
+      std::cerr << "Failed to map pixel unpack buffer" << std::endl;
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  }
+
+  glBindTexture(GL_TEXTURE_2D, 0);
+  stats.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+void TextureUploader::CopyRows(uint8_t* destination, const uint8_t* pixels, int linesize, int rowBytes, int height,
+  int bytesPerPixel, const std::vector<TileRect>* rects) {
+  if (rects) {
+    // Only the changed rows of each rect, at their place in the image
+    for (const TileRect& rect : *rects) {
+      size_t offset = size_t(rect.x) * size_t(bytesPerPixel);
+      size_t bytes = size_t(rect.width) * size_t(bytesPerPixel);
+      for (int y = rect.y; y < rect.y + rect.height; y++) {
+        size_t row = size_t(y) * size_t(linesize) + offset;
+        std::memcpy(destination + row, pixels + row, bytes);
+      }
+    }
+  } else if (rowBytes == linesize) {
+    std::memcpy(destination, pixels, size_t(linesize) * size_t(height));
+  } else {
+    for (int y = 0; y < height; y++) {
+      size_t row = size_t(y) * size_t(linesize);
+      std::memcpy(destination + row, pixels + row, size_t(rowBytes));
+    }
+  }
+}
+
+void TextureUploader::UploadCompressed(GLuint texture, GLenum internalFormat, int width, int height, const void* blocks, GLsizei size) {
+  if (width <= 0 || height <= 0 || blocks == nullptr) {
+    return;
+  }
+
+  Clock::time_point start = Clock::now();
+
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  TextureStorage& storage = storages[texture];
+  if (storage.width != width || storage.height != height || storage.internalFormat != GLint(internalFormat)) {
+    glCompressedTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, size, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    storage.width = width;
+    storage.height = height;
+    storage.internalFormat = GLint(internalFormat);
+    stats.allocations++;
+  }
+
+  PixelBuffer& pixelBuffer = AcquireBuffer(size);
+  void* mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+    GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+  if (mapped) {
+    std::memcpy(mapped, blocks, size_t(size));
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    // Blocks are always tightly packed, whatever the unpack state says
+    glCompressedTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, internalFormat, size, nullptr);
+    pixelBuffer.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    stats.uploads++;
+    stats.bytes += uint64_t(size);
+  } else {
+    std::cerr << "Failed to map pixel unpack buffer" << std::endl;
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  glBindTexture(GL_TEXTURE_2D, 0);
+  stats.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+bool TextureUploader::MapLendableBuffer(GLsizeiptr size, size_t maxLent, uint8_t** data, uintptr_t* handle) {
+  size_t lentCount = 0;
+  PixelBuffer* idle = nullptr;
+  for (PixelBuffer& pixelBuffer : lendable) {
+    if (pixelBuffer.lent) {
+      lentCount++;
+      continue;
+    }
+    if (pixelBuffer.fence) {
+      // Never block here, the buffer is lent on a later frame instead
+      if (glClientWaitSync(pixelBuffer.fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+        continue;
+      }
+      glDeleteSync(pixelBuffer.fence);
+      pixelBuffer.fence = nullptr;
+    }
+    if (!idle) {
+      idle = &pixelBuffer;
+    }
+  }
+  if (lentCount >= maxLent) {
+    return false;
+  }
+  if (!idle) {
+    // Only in flight buffers left, grow the pool up to the lent limit
+    if (lendable.size() >= maxLent + 2 || lendable.size() >= LENDABLE_INDEX_MASK) {
+      return false;
+    }
+    lendable.emplace_back();
+    glGenBuffers(1, &lendable.back().buffer);
+    idle = &lendable.back();
+  }
+
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, idle->buffer);
+  if (idle->size < size) {
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+    idle->size = size;
+  }
+  void* mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, idle->size,
+    GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  if (!mapped) {
+    std::cerr << "Failed to map pixel unpack buffer" << std::endl;
+    return false;
+  }
+
+  idle->lent = true;
+  idle->lendings++;
+  *data = (uint8_t*)mapped;
+  *handle = (idle->lendings << LENDABLE_INDEX_BITS) | (uintptr_t(idle - lendable.data()) + 1);
+  return true;
+}
+
+/**
+ * @brief The buffer lent under `handle`, null if it was given back since.
+ */
+TextureUploader::PixelBuffer* TextureUploader::LentBuffer(uintptr_t handle) {
+  size_t index = size_t(handle & LENDABLE_INDEX_MASK);
+  if (index == 0 || index > lendable.size()) {
+    return nullptr;
+  }
+  PixelBuffer& pixelBuffer = lendable[index - 1];
+  if (!pixelBuffer.lent || (handle >> LENDABLE_INDEX_BITS) != (pixelBuffer.lendings & (UINTPTR_MAX >> LENDABLE_INDEX_BITS))) {
+    return nullptr;
+  }
+  return &pixelBuffer;
+}
+
+bool TextureUploader::UploadLent(uintptr_t handle, GLuint texture, const TextureFormat& format, int width, int height, int linesize,
+  const std::vector<TileRect>* rects) {
+  PixelBuffer* lent = LentBuffer(handle);
+  if (!lent) {
+    return false;
+  }
+  PixelBuffer& pixelBuffer = *lent;
+
+  Clock::time_point start = Clock::now();
+
+  glActiveTexture(GL_TEXTURE0);
+  if (EnsureStorage(texture, format, width, height)) {
+    rects = nullptr;
+  }
+
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer.buffer);
+  glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+  pixelBuffer.lent = false;
+  TransferFromBuffer(pixelBuffer, texture, format, width, height, linesize == 0 ? width * format.bytesPerPixel : linesize, rects);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  stats.zeroCopyUploads++;
+  stats.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+  return true;
+}
+
+void TextureUploader::ReleaseLent(uintptr_t handle) {
+  PixelBuffer* lent = LentBuffer(handle);
+  if (!lent) {
+    return;
+  }
+  PixelBuffer& pixelBuffer = *lent;
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer.buffer);
+  glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  pixelBuffer.lent = false;
+}
@@ -1,6 +1,9 @@
+#include <chrono>
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <algorithm>
+#include <thread>
 
 #define PROGRAMOPTIONS_EXCEPTIONS
 // https://github.com/Fytch/ProgramOptions.hxx/issues/1
@@ -11,6 +14,10 @@
 
 #include "Program.h"
 #include "Application.h"
+#include "Benchmark.h"
+#include "BufferPass.h"
+#include "CompressedVideo.h"
+#include "ProbeCache.h"
 #include "Renderer.h"
 
 static const GLchar*
@@ -41,6 +48,166 @@ ReadShader( const char* filename )
   return const_cast<const GLchar*>(source);
 }
 
+static bool
+ParseThreadMode( const std::string& name, DecoderThreading* threading )
+{
+  if ( name == "auto" ) *threading = DecoderThreading::Auto;
+  else if ( name == "frame" || name == "throughput" ) *threading = DecoderThreading::Frame;
+  else if ( name == "slice" || name == "latency" ) *threading = DecoderThreading::Slice;
+  else if ( name == "none" ) *threading = DecoderThreading::None;
+  else return false;
+  return true;
+}
+
+static bool
+ParseScaleMode( const std::string& name, ScaleMode* mode )
+{
+  if ( name == "stretch" ) *mode = ScaleMode::Stretch;
+  else if ( name == "fit" ) *mode = ScaleMode::Fit;
+  else if ( name == "fill" ) *mode = ScaleMode::Fill;
+  else return false;
+  return true;
+}
+
+static bool
+ParseDirection( const std::string& name, PlaybackDirection* direction )
+{
+  if ( name == "forward" ) *direction = PlaybackDirection::Forward;
+  else if ( name == "reverse" ) *direction = PlaybackDirection::Reverse;
+  else if ( name == "pingpong" ) *direction = PlaybackDirection::PingPong;
+  else return false;
+  return true;
+}
+
+// Index of buffer "A" to "D", in either case, -1 for anything else
+static int
+BufferIndex( const std::string& name )
+{
+  if ( name.size() != 1 ) return -1;
+  char letter = char( toupper( (unsigned char)name[0] ) );
+  return letter >= 'A' && letter <= 'D' ? letter - 'A' : -1;
+}
+
+// Comma separated "A=value" items, or a single value for every buffer
+static bool
+SplitBufferValues( const std::string& list, std::string values[4] )
+{
+  size_t begin = 0;
+  while ( begin <= list.size() ) {
+    size_t end = list.find( ',', begin );
+    if ( end == std::string::npos ) end = list.size();
+    std::string item = list.substr( begin, end - begin );
+
+    size_t equals = item.find( '=' );
+    if ( equals == std::string::npos ) {
+      for ( int buffer = 0; buffer < 4; buffer++ ) values[buffer] = item;
+    } else {
+      int buffer = BufferIndex( item.substr( 0, equals ) );
+      if ( buffer < 0 ) return false;
+      values[buffer] = item.substr( equals + 1 );
+    }
+    begin = end + 1;
+  }
+  return true;
+}
+
+static bool
+ParseBufferFormat( const std::string& name, BufferFormat* format )
+{
+  if ( name == "rgba8" ) *format = BufferFormat::RGBA8;
+  else if ( name == "rgba16f" ) *format = BufferFormat::RGBA16F;
+  else if ( name == "rgba32f" ) *format = BufferFormat::RGBA32F;
+  else if ( name == "r11g11b10f" ) *format = BufferFormat::R11G11B10F;
+  else return false;
+  return true;
+}
+
+// "t0" to "t3" for a texture, "A" to "D" for a buffer, "none" or nothing
+static bool
+ParseChannelInput( const std::string& name, ChannelInput* input )
+{
+  if ( name.empty() || name == "none" ) {
+    *input = { ChannelSource::None, 0 };
+  } else if ( name.size() == 2 && tolower( (unsigned char)name[0] ) == 't' && name[1] >= '0' && name[1] <= '3' ) {
+    *input = { ChannelSource::Texture, name[1] - '0' };
+  } else if ( BufferIndex( name ) >= 0 ) {
+    *input = { ChannelSource::Buffer, BufferIndex( name ) };
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Semicolon separated "pass=input,input,..." items, e.g. "image=A,t1;A=A".
+// Channels not listed keep their input.
+static bool
+ParseChannels( const std::string& spec, ChannelInputs* image, ChannelInputs buffers[4] )
+{
+  size_t begin = 0;
+  while ( begin < spec.size() ) {
+    size_t end = spec.find( ';', begin );
+    if ( end == std::string::npos ) end = spec.size();
+    std::string item = spec.substr( begin, end - begin );
+    begin = end + 1;
+
+    size_t equals = item.find( '=' );
+    if ( equals == std::string::npos ) return false;
+    std::string pass = item.substr( 0, equals );
+    ChannelInputs* inputs = pass == "image" ? image : nullptr;
+    if ( BufferIndex( pass ) >= 0 ) inputs = &buffers[BufferIndex( pass )];
+    if ( inputs == nullptr ) return false;
+
+    size_t inputBegin = equals + 1;
+    for ( int channel = 0; inputBegin <= item.size(); channel++ ) {
+      size_t inputEnd = item.find( ',', inputBegin );
+      if ( inputEnd == std::string::npos ) inputEnd = item.size();
+      if ( channel >= 4 || !ParseChannelInput( item.substr( inputBegin, inputEnd - inputBegin ), &( *inputs )[channel] ) ) {
+        return false;
+      }
+      inputBegin = inputEnd + 1;
+    }
+  }
+  return true;
+}
+
+// Still images are loaded with stb_image, anything else (videos, animated
+// GIF/APNG/WebP) is decoded by FFmpeg
+static bool
+IsStillImage( const std::string& filename )
+{
+  static const char* extensions[] = { ".png", ".jpg", ".jpeg", ".bmp", ".tga", ".hdr", ".psd", ".pic", ".pnm", ".ppm", ".pgm" };
+  size_t dot = filename.find_last_of( '.' );
+  if ( dot == std::string::npos ) return false;
+  std::string extension = filename.substr( dot );
+  std::transform( extension.begin(), extension.end(), extension.begin(), []( unsigned char c ) { return char( tolower( c ) ); } );
+  for ( const char* still : extensions ) {
+    if ( extension == still ) return true;
+  }
+  return false;
+}
+
+// Comma separated CPU indices or ranges, e.g. "0,2-3"
+static bool
+ParseCpuList( const std::string& list, std::vector<int>* cpus )
+{
+  size_t begin = 0;
+  while ( begin <= list.size() ) {
+    size_t end = list.find( ',', begin );
+    if ( end == std::string::npos ) end = list.size();
+    std::string item = list.substr( begin, end - begin );
+
+    int first = -1, last = -1;
+    char dash = 0;
+    int matched = sscanf( item.c_str(), "%d%c%d", &first, &dash, &last );
+    if ( matched == 1 ) last = first;
+    else if ( matched != 3 || dash != '-' ) return false;
+    if ( first < 0 || last < first ) return false;
+
+    for ( int cpu = first; cpu <= last; cpu++ ) cpus->push_back( cpu );
+    begin = end + 1;
+  }
+  return !cpus->empty();
+}
 
 const char defaultFragShaderSource[] = R"(
 void mainImage( out vec4 fragColor, in vec2 fragCoord) {
@@ -59,6 +226,23 @@ void mainImage( out vec4 fragColor, in vec2 fragCoord) {
 }
 )";
 
+// Letterboxed: the video keeps its aspect ratio and is centered
+const char videoFitFragShaderSource[] = R"(
+void mainImage( out vec4 fragColor, in vec2 fragCoord) {
+  vec2 videoSize = vec2( textureSize( iChannel0, 0 ) );
+  vec2 scale = videoSize / iResolution.xy;
+  scale /= max( scale.x, scale.y );
+  vec2 uv = ( fragCoord / iResolution.xy - 0.5 ) / scale + 0.5;
+  if ( any( lessThan( uv, vec2( 0.0 ) ) ) || any( greaterThan( uv, vec2( 1.0 ) ) ) ) {
+    fragColor = vec4( 0.0, 0.0, 0.0, 1.0 );
+    return;
+  }
+  // flip Y
+  uv.y = 1.0 - uv.y;
+  fragColor = texture( iChannel0, uv );
+}
+)";
+
 int main(int argc, char **argv /* , char *envp[] */) {
   po::parser parser;
   auto& video = parser["video"]
@@ -66,21 +250,148 @@ int main(int argc, char **argv /* , char *envp[] */) {
     .description( "Video file name" )
     .type( po::string );
 
+  auto& playlistFile = parser["playlist"]
+    .description( "File listing one video per line, played in turn instead of --video" )
+    .type( po::string );
+
+  auto& interval = parser["interval"]
+    .description( "Seconds each video of the playlist is shown, default is 300" )
+    .type( po::f64 );
+
+  auto& crossfade = parser["crossfade"]
+    .description( "Seconds to crossfade between videos of the playlist, default is 0 (cut)" )
+    .type( po::f64 );
+
+  auto& bufferedFrames = parser["buffered-frames"]
+    .description( "Maximum number of decoded video frames kept in memory, default is 4" )
+    .type( po::u32 );
+
+  auto& loopPrewarm = parser["loop-prewarm"]
+    .description( "Number of decoded frames kept to hide the rewind at the loop point, 0 to disable, default is 8" )
+    .type( po::u32 );
+
+  auto& packetCache = parser["packet-cache"]
+    .description( "Memory budget in MiB for keeping the compressed video in memory after the first loop, 0 to disable, default is 64" )
+    .type( po::u32 );
+
+  auto& frameCache = parser["frame-cache"]
+    .description( "Memory budget in MiB for replaying decoded frames instead of decoding every loop, default is 0 (disabled)" )
+    .type( po::u32 );
+
+  auto& scaleMode = parser["scale-mode"]
+    .description( "How the video covers the screen: stretch, fit (letterboxed) or fill (cropped), default is stretch" )
+    .type( po::string );
+
+  auto& fullResolution = parser["full-resolution"]
+    .description( "Decode videos larger than the screen at their full resolution instead of downscaling them" );
+
+  auto& start = parser["start"]
+    .description( "Start playback the given number of seconds into the video" )
+    .type( po::f64 );
+
+  auto& syncTimeOfDay = parser["sync-time-of-day"]
+    .description( "Start playback where a loop started at midnight would be now" );
+
+  auto& direction = parser["direction"]
+    .description( "Playback direction: forward, reverse or pingpong, default is forward" )
+    .type( po::string );
+
+  auto& readAhead = parser["read-ahead"]
+    .description( "How far ahead of the demuxer the video file is paged in, in MiB, default is 8" )
+    .type( po::u32 );
+
+  auto& noMmap = parser["no-mmap"]
+    .description( "Read the video file on a read-ahead thread instead of memory mapping it" );
+
+  auto& noProbeCache = parser["no-probe-cache"]
+    .description( "Probe the video on every start instead of caching its stream parameters" );
+
+  auto& gpuConvert = parser["gpu-convert"]
+    .description( "Upload native YUV video planes and convert them to RGB on the GPU" );
+
+  auto& noSkipUnchanged = parser["no-skip-unchanged"]
+    .description( "Convert, upload and draw every video frame, even when it repeats the frame before" );
+
+  auto& fullUploads = parser["full-uploads"]
+    .description( "Upload every video frame whole instead of only the tiles that changed" );
+
+  auto& adaptiveQuality = parser["adaptive-quality"]
+    .description( "Lower decoding quality step by step (loop filter, IDCT, lowres, frame rate) while the machine is loaded, and restore it when it isn't" );
+
+  auto& threadMode = parser["thread-mode"]
+    .description( "Decoder threading: auto, frame (throughput), slice (latency) or none, default is auto" )
+    .type( po::string );
+
+  auto& decodeThreads = parser["decode-threads"]
+    .description( "Number of decoder threads, default is 0 (one per core)" )
+    .type( po::u32 );
+
+  auto& convertThreads = parser["convert-threads"]
+    .description( "Number of threads converting each video frame to RGBA, default is 0 (half the cores, at most 4)" )
+    .type( po::u32 );
+
+  auto& swscale = parser["swscale"]
+    .description( "Convert video frames to RGBA with swscale instead of the built-in SIMD converter" );
+
+  auto& affinity = parser["affinity"]
+    .description( "CPUs to run the video pipeline threads on, e.g. 0,2-3" )
+    .type( po::string );
+
+  auto& bench = parser["bench"]
+    .description( "Decode the video for the given number of seconds per threading mode and print the frame rates, without a window" )
+    .type( po::f64 );
+
+  auto& benchConvert = parser["bench-convert"]
+    .description( "Convert the first frames of the video to RGBA for the given number of seconds with swscale and the built-in converter, check they match and print both rates" )
+    .type( po::f64 );
+
+  auto& prepare = parser["prepare"]
+    .description( "Transcode --video once into the given .sydv file of GPU-compressed frames, played without decoding; with --bench, compare both afterwards" )
+    .type( po::string );
+
+  auto& stats = parser["stats"]
+    .description( "Print video decoder statistics every second" );
+
   auto& fragShaderFilename = parser["fs"]
     .description( "Fragment shader file name" )
     .type( po::string );
 
+  auto& bufferA = parser["buffer-a"]
+    .description( "Buffer A fragment shader file name, drawn into a texture before the image every frame" )
+    .type( po::string );
+  auto& bufferB = parser["buffer-b"]
+    .description( "Buffer B fragment shader file name" )
+    .type( po::string );
+  auto& bufferC = parser["buffer-c"]
+    .description( "Buffer C fragment shader file name" )
+    .type( po::string );
+  auto& bufferD = parser["buffer-d"]
+    .description( "Buffer D fragment shader file name" )
+    .type( po::string );
+
+  auto& channels = parser["channels"]
+    .description( "What each pass samples on iChannel0 to iChannel3: t0 to t3 for the textures, A to D for the buffers, e.g. \"image=A,t1;A=A,t0\", default is t0,t1,t2,t3" )
+    .type( po::string );
+
+  auto& bufferScale = parser["buffer-scale"]
+    .description( "Resolution of the buffers relative to the screen, for all or per buffer, e.g. 0.5 or A=0.5,B=0.25, default is 1" )
+    .type( po::string );
+
+  auto& bufferFormat = parser["buffer-format"]
+    .description( "Texture format of the buffers, rgba8, rgba16f, rgba32f or r11g11b10f, for all or per buffer, e.g. A=rgba16f, default is rgba32f" )
+    .type( po::string );
+
   auto& texture0 = parser["t0"]
-    .description( "texture 0 file name" )
+    .description( "texture 0 file name, an image, animated image or video" )
     .type( po::string );
   auto& texture1 = parser["t1"]
-    .description( "texture 1 file name" )
+    .description( "texture 1 file name, an image, animated image or video" )
     .type( po::string );
   auto& texture2 = parser["t2"]
-    .description( "texture 2 file name" )
+    .description( "texture 2 file name, an image, animated image or video" )
     .type( po::string );
   auto& texture3 = parser["t3"]
-    .description( "texture 3 file name" )
+    .description( "texture 3 file name, an image, animated image or video" )
     .type( po::string );
 
   auto& help = parser["help"]
@@ -96,6 +407,160 @@ int main(int argc, char **argv /* , char *envp[] */) {
     return 0;
   }
 
+  DecoderOptions decoderOptions;
+  // The renderer lends mapped pixel buffers, converted frames are written
+  // straight into them
+  decoderOptions.lentBuffers = true;
+  if ( gpuConvert.was_set() ) decoderOptions.output = VideoOutput::Planar;
+  if ( adaptiveQuality.was_set() ) decoderOptions.adaptiveQuality = true;
+  if ( noSkipUnchanged.was_set() ) decoderOptions.skipUnchangedFrames = false;
+  if ( fullUploads.was_set() ) decoderOptions.diffTiles = false;
+  if ( bufferedFrames.was_set() ) {
+    // At least one frame on screen and one being converted
+    decoderOptions.maxBufferedFrames = std::max( 2u, bufferedFrames.get().u32 );
+  }
+  if ( loopPrewarm.was_set() ) decoderOptions.loopPrewarmFrames = loopPrewarm.get().u32;
+  if ( packetCache.was_set() ) decoderOptions.packetCacheBytes = size_t( packetCache.get().u32 ) << 20;
+  if ( frameCache.was_set() ) decoderOptions.frameCacheBytes = size_t( frameCache.get().u32 ) << 20;
+  if ( threadMode.was_set() && !ParseThreadMode( threadMode.get().string, &decoderOptions.threading ) ) {
+    std::cerr << "Unknown thread mode '" << threadMode.get().string << "'" << std::endl;
+    return -1;
+  }
+  if ( scaleMode.was_set() && !ParseScaleMode( scaleMode.get().string, &decoderOptions.scaleMode ) ) {
+    std::cerr << "Unknown scale mode '" << scaleMode.get().string << "'" << std::endl;
+    return -1;
+  }
+  if ( readAhead.was_set() ) decoderOptions.readAheadBytes = size_t( readAhead.get().u32 ) << 20;
+  if ( noMmap.was_set() ) decoderOptions.mapInput = false;
+  if ( !noProbeCache.was_set() ) decoderOptions.probeCacheDirectory = ProbeCache::DefaultDirectory();
+  if ( start.was_set() ) decoderOptions.startSeconds = std::max( 0.0, start.get().f64 );
+  if ( syncTimeOfDay.was_set() ) decoderOptions.syncTimeOfDay = true;
+  if ( direction.was_set() && !ParseDirection( direction.get().string, &decoderOptions.direction ) ) {
+    std::cerr << "Unknown playback direction '" << direction.get().string << "'" << std::endl;
+    return -1;
+  }
+  if ( decodeThreads.was_set() ) decoderOptions.decodeThreads = int( decodeThreads.get().u32 );
+  if ( convertThreads.was_set() ) decoderOptions.convertThreads = int( convertThreads.get().u32 );
+  if ( swscale.was_set() ) decoderOptions.swscaleConvert = true;
+  if ( affinity.was_set() && !ParseCpuList( affinity.get().string, &decoderOptions.cpus ) ) {
+    std::cerr << "Invalid CPU list '" << affinity.get().string << "'" << std::endl;
+    return -1;
+  }
+
+  if ( prepare.was_set() ) {
+    if ( !video.was_set() ) {
+      std::cerr << "--prepare needs a video" << std::endl;
+      return -1;
+    }
+    if ( !CompressedVideo::IsCompressedVideo( prepare.get().string ) ) {
+      std::cerr << "Prepared videos are written to .sydv files" << std::endl;
+      return -1;
+    }
+    if ( !PrepareCompressedVideo( video.get().string, prepare.get().string, decoderOptions ) ) {
+      return -1;
+    }
+    if ( bench.was_set() ) {
+      DecoderThreading mode = threadMode.was_set() ? decoderOptions.threading : DecoderThreading::Auto;
+      if ( !RunDecoderBenchmark( video.get().string, decoderOptions, { mode }, bench.get().f64 ) ||
+           !RunCompressedVideoBenchmark( prepare.get().string, bench.get().f64 ) ) {
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  if ( benchConvert.was_set() ) {
+    if ( !video.was_set() ) {
+      std::cerr << "--bench-convert needs a video" << std::endl;
+      return -1;
+    }
+    return RunConverterBenchmark( video.get().string, decoderOptions, benchConvert.get().f64 ) ? 0 : -1;
+  }
+
+  if ( bench.was_set() ) {
+    if ( !video.was_set() ) {
+      std::cerr << "--bench needs a video" << std::endl;
+      return -1;
+    }
+    if ( CompressedVideo::IsCompressedVideo( video.get().string ) ) {
+      return RunCompressedVideoBenchmark( video.get().string, bench.get().f64 ) ? 0 : -1;
+    }
+    std::vector<DecoderThreading> modes;
+    if ( threadMode.was_set() ) {
+      modes.push_back( decoderOptions.threading );
+    } else {
+      modes = { DecoderThreading::None, DecoderThreading::Slice, DecoderThreading::Frame, DecoderThreading::Auto };
+    }
+    return RunDecoderBenchmark( video.get().string, decoderOptions, modes, bench.get().f64 ) ? 0 : -1;
+  }
+
+  std::vector<std::string> playlistFiles;
+  if ( playlistFile.was_set() ) {
+    if ( !Playlist::ReadFile( playlistFile.get().string, &playlistFiles ) ) {
+      return -1;
+    }
+    if ( playlistFiles.empty() ) {
+      std::cerr << "Playlist '" << playlistFile.get().string << "' has no videos" << std::endl;
+      return -1;
+    }
+  }
+  bool playsVideo = video.was_set() || !playlistFiles.empty();
+
+  // Buffer A to D passes, only for the buffers given a shader
+  const po::option* bufferShaders[4] = { &bufferA, &bufferB, &bufferC, &bufferD };
+  std::string bufferShaderSources[4];
+  for ( int buffer = 0; buffer < 4; buffer++ ) {
+    if ( bufferShaders[buffer]->was_set() ) {
+      const char *cSource = ReadShader( bufferShaders[buffer]->get().string.c_str() );
+      if ( cSource == nullptr ) {
+        std::cerr << "Can't read buffer shader '" << bufferShaders[buffer]->get().string << "'" << std::endl;
+        return -1;
+      }
+      bufferShaderSources[buffer] = std::string( cSource );
+    }
+  }
+  ChannelInputs imageChannels = DEFAULT_CHANNEL_INPUTS;
+  ChannelInputs bufferChannels[4] = { DEFAULT_CHANNEL_INPUTS, DEFAULT_CHANNEL_INPUTS, DEFAULT_CHANNEL_INPUTS, DEFAULT_CHANNEL_INPUTS };
+  if ( channels.was_set() && !ParseChannels( channels.get().string, &imageChannels, bufferChannels ) ) {
+    std::cerr << "Invalid channels '" << channels.get().string << "'" << std::endl;
+    return -1;
+  }
+  float bufferScales[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+  std::string scaleValues[4];
+  if ( bufferScale.was_set() && !SplitBufferValues( bufferScale.get().string, scaleValues ) ) {
+    std::cerr << "Invalid buffer scale '" << bufferScale.get().string << "'" << std::endl;
+    return -1;
+  }
+  BufferFormat bufferFormats[4] = { BufferFormat::RGBA32F, BufferFormat::RGBA32F, BufferFormat::RGBA32F, BufferFormat::RGBA32F };
+  std::string formatValues[4];
+  if ( bufferFormat.was_set() && !SplitBufferValues( bufferFormat.get().string, formatValues ) ) {
+    std::cerr << "Invalid buffer format '" << bufferFormat.get().string << "'" << std::endl;
+    return -1;
+  }
+  for ( int buffer = 0; buffer < 4; buffer++ ) {
+    if ( !scaleValues[buffer].empty() ) {
+      bufferScales[buffer] = float( atof( scaleValues[buffer].c_str() ) );
+      if ( bufferScales[buffer] <= 0.0f || bufferScales[buffer] > 4.0f ) {
+        std::cerr << "Buffer scale '" << scaleValues[buffer] << "' is not between 0 and 4" << std::endl;
+        return -1;
+      }
+    }
+    if ( !formatValues[buffer].empty() && !ParseBufferFormat( formatValues[buffer], &bufferFormats[buffer] ) ) {
+      std::cerr << "Unknown buffer format '" << formatValues[buffer] << "'" << std::endl;
+      return -1;
+    }
+  }
+  const ChannelInputs* passChannels[5] = { &imageChannels, &bufferChannels[0], &bufferChannels[1], &bufferChannels[2], &bufferChannels[3] };
+  for ( int pass = 0; pass < 5; pass++ ) {
+    if ( pass > 0 && bufferShaderSources[pass - 1].empty() ) continue;
+    for ( const ChannelInput& input : *passChannels[pass] ) {
+      if ( input.source == ChannelSource::Buffer && bufferShaderSources[input.index].empty() ) {
+        std::cerr << "Buffer " << char( 'A' + input.index ) << " is sampled but has no shader, use --buffer-" << char( 'a' + input.index ) << std::endl;
+        return -1;
+      }
+    }
+  }
+
   std::string fragShaderSource( defaultFragShaderSource );
 
   if ( fragShaderFilename.was_set() ) {
@@ -105,8 +570,8 @@ int main(int argc, char **argv /* , char *envp[] */) {
     }
 
     fragShaderSource = std::string( cSource );
-  } else if ( video.was_set() ) {
-    fragShaderSource = std::string( videoDefaultFragShaderSource );
+  } else if ( playsVideo ) {
+    fragShaderSource = std::string( decoderOptions.scaleMode == ScaleMode::Fit ? videoFitFragShaderSource : videoDefaultFragShaderSource );
   } else {
     std::cout << parser << std::endl;
 
@@ -114,16 +579,85 @@ int main(int argc, char **argv /* , char *envp[] */) {
               << fragShaderSource << std::endl;
   }
 
+  // Channels given a video or animated image, --video takes iChannel0
+  std::string channelVideos[4];
+  const po::option* textures[4] = { &texture0, &texture1, &texture2, &texture3 };
+  if ( texture0.was_set() && playsVideo ) {
+    std::cerr << "--t0 can't be combined with --video or --playlist, they play on iChannel0" << std::endl;
+    return -1;
+  }
+  int videoCount = playsVideo ? 1 : 0;
+  for ( int channel = 0; channel < 4; channel++ ) {
+    if ( !textures[channel]->was_set() || IsStillImage( textures[channel]->get().string ) ) continue;
+    channelVideos[channel] = textures[channel]->get().string;
+    if ( CompressedVideo::IsCompressedVideo( channelVideos[channel] ) ) {
+      // Played without a decoder, by the renderer's texture0 path only
+      if ( channel != 0 ) {
+        std::cerr << "Prepared video '" << channelVideos[channel] << "' can only play on iChannel0, pass it as --video or --t0" << std::endl;
+        return -1;
+      }
+    } else {
+      videoCount++;
+    }
+  }
+
   Application *app = new Application();
 
-  if ( texture0.was_set() ) app->renderer->SetTexture0( texture0.get().string );
-  if ( texture1.was_set() ) app->renderer->SetTexture1( texture1.get().string );
-  if ( texture2.was_set() ) app->renderer->SetTexture2( texture2.get().string );
-  if ( texture3.was_set() ) app->renderer->SetTexture3( texture3.get().string );
+  if ( texture0.was_set() && channelVideos[0].empty() ) app->renderer->SetTexture0( texture0.get().string );
+  if ( texture1.was_set() && channelVideos[1].empty() ) app->renderer->SetTexture1( texture1.get().string );
+  if ( texture2.was_set() && channelVideos[2].empty() ) app->renderer->SetTexture2( texture2.get().string );
+  if ( texture3.was_set() && channelVideos[3].empty() ) app->renderer->SetTexture3( texture3.get().string );
 
-  if ( video.was_set() ) app->renderer->decoder = new Decoder( video.get().string );
+  if ( videoCount > 0 ) {
+    decoderOptions.targetWidth = int( app->renderer->viewport.z );
+    decoderOptions.targetHeight = int( app->renderer->viewport.w );
+    decoderOptions.downscale = !fullResolution.was_set();
+    if ( videoCount > 1 && !decodeThreads.was_set() ) {
+      // Share the cores between the videos instead of one codec thread per
+      // core each
+      unsigned int cores = std::max( 1u, std::thread::hardware_concurrency() );
+      decoderOptions.decodeThreads = int( std::max( 1u, cores / unsigned( videoCount ) ) );
+    }
+  }
+  for ( int channel = 1; channel < 4; channel++ ) {
+    if ( !channelVideos[channel].empty() ) {
+      app->renderer->channelDecoders[channel - 1] = new Decoder( channelVideos[channel], decoderOptions );
+    }
+  }
+  if ( !channelVideos[0].empty() && CompressedVideo::IsCompressedVideo( channelVideos[0] ) ) {
+    app->renderer->compressedVideo = new CompressedVideo( channelVideos[0] );
+    if ( !app->renderer->compressedVideo->IsOpen() ) {
+      return -1;
+    }
+  } else if ( !channelVideos[0].empty() ) {
+    app->renderer->decoder = new Decoder( channelVideos[0], decoderOptions );
+  }
+  if ( !playlistFiles.empty() ) {
+    double intervalSeconds = interval.was_set() ? std::max( 1.0, interval.get().f64 ) : 300.0;
+    double crossfadeSeconds = crossfade.was_set() ? std::max( 0.0, crossfade.get().f64 ) : 0.0;
+    app->playlist = new Playlist( playlistFiles, decoderOptions,
+      std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::duration<double>( intervalSeconds ) ),
+      std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::duration<double>( crossfadeSeconds ) ) );
+  } else if ( video.was_set() && CompressedVideo::IsCompressedVideo( video.get().string ) ) {
+    app->renderer->compressedVideo = new CompressedVideo( video.get().string );
+    if ( !app->renderer->compressedVideo->IsOpen() ) {
+      return -1;
+    }
+  } else if ( video.was_set() ) {
+    app->renderer->decoder = new Decoder( video.get().string, decoderOptions );
+  }
+  app->printStats = stats.was_set();
+  app->skipUnchangedRedraws = !noSkipUnchanged.was_set();
 
   app->mainShaderProgram = new Program( fragShaderSource );
+  Program** bufferPrograms[4] = { &app->bufferAShaderProgram, &app->bufferBShaderProgram, &app->bufferCShaderProgram, &app->bufferDShaderProgram };
+  for ( int buffer = 0; buffer < 4; buffer++ ) {
+    if ( !bufferShaderSources[buffer].empty() ) {
+      *bufferPrograms[buffer] = new Program( bufferShaderSources[buffer] );
+      app->bufferPasses[buffer] = new BufferPass( bufferFormats[buffer], bufferScales[buffer], bufferChannels[buffer] );
+    }
+  }
+  app->imageChannels = imageChannels;
   assert(glGetError() == GL_NO_ERROR);
 
   app->run();
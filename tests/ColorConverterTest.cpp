@@ -0,0 +1,124 @@
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#ifdef __cplusplus
+extern "C" {
+#include <libavutil/frame.h>
+}
+#endif // __cplusplus
+
+#include "ColorConverter.h"
+#include "Expect.h"
+
+namespace {
+
+// The kernels share the scalar kernel's integer math, so their results are
+// expected to be identical
+const int TOLERANCE = 0;
+
+/**
+ * @brief Frame with planes of random samples, each row padded to a wider
+ * pitch than it needs.
+ */
+class SyntheticFrame
+{
+private:
+  std::vector<uint8_t> planes[3];
+
+public:
+  AVFrame* frame = nullptr;
+
+  SyntheticFrame(AVPixelFormat format, int width, int height, AVColorSpace colorspace, AVColorRange range,
+    uint32_t seed) {
+    frame = av_frame_alloc();
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+    frame->colorspace = colorspace;
+    frame->color_range = range;
+
+    bool subsampled = format != AV_PIX_FMT_YUV444P && format != AV_PIX_FMT_YUVJ444P;
+    int chromaWidth = subsampled ? (width + 1) / 2 : width;
+    int chromaHeight = subsampled ? (height + 1) / 2 : height;
+    int count = format == AV_PIX_FMT_NV12 ? 2 : 3;
+    for (int plane = 0; plane < count; plane++) {
+      int rowBytes = plane == 0 ? width : (format == AV_PIX_FMT_NV12 ? chromaWidth * 2 : chromaWidth);
+      int rows = plane == 0 ? height : chromaHeight;
+      frame->linesize[plane] = (rowBytes + 16 + 31) & ~31;
+      planes[plane].resize(size_t(frame->linesize[plane]) * rows);
+      for (uint8_t& sample : planes[plane]) {
+        seed = seed * 1664525u + 1013904223u;
+        sample = uint8_t(seed >> 24);
+      }
+      frame->data[plane] = planes[plane].data();
+    }
+  }
+
+  ~SyntheticFrame() {
+    for (uint8_t*& data : frame->data) {
+      data = nullptr;
+    }
+    av_frame_free(&frame);
+  }
+
+  SyntheticFrame(const SyntheticFrame&) = delete;
+  SyntheticFrame& operator=(const SyntheticFrame&) = delete;
+};
+
+/**
+ * @brief Convert one frame with `kernel` and with the scalar kernel, on
+ * `threads` threads, and compare every byte.
+ */
+void TestKernel(const char* kernel, AVPixelFormat format, int width, int height, AVColorSpace colorspace,
+  AVColorRange range, int threads) {
+  SyntheticFrame source(format, width, height, colorspace, range, uint32_t(width * 7919 + height * 31 + format));
+  int stride = width * 4;
+  std::vector<uint8_t> expected(size_t(stride) * height, 0);
+  std::vector<uint8_t> actual(size_t(stride) * height, 0);
+
+  ColorConverter reference(1);
+  EXPECT(reference.SelectKernel("scalar"), "scalar kernel isn't available");
+  EXPECT(reference.Convert(source.frame, expected.data(), stride), "format " << format << " isn't supported");
+
+  ColorConverter converter(threads);
+  EXPECT(converter.SelectKernel(kernel), "kernel " << kernel << " isn't available");
+  EXPECT(converter.Convert(source.frame, actual.data(), stride), "format " << format << " isn't supported");
+
+  int mismatches = 0;
+  int largest = 0;
+  for (size_t i = 0; i < expected.size(); i++) {
+    int difference = std::abs(int(expected[i]) - int(actual[i]));
+    largest = difference > largest ? difference : largest;
+    mismatches += difference > TOLERANCE;
+  }
+  EXPECT(mismatches == 0, kernel << " differs from scalar by up to " << largest << " in " << mismatches
+    << " bytes, format " << format << ", " << width << "x" << height << ", colorspace " << colorspace
+    << ", range " << range << ", " << threads << " threads");
+}
+
+} // anonymous namespace
+
+int main() {
+  const AVPixelFormat formats[] = {
+    AV_PIX_FMT_YUV420P, AV_PIX_FMT_YUVJ420P, AV_PIX_FMT_NV12, AV_PIX_FMT_YUV444P, AV_PIX_FMT_YUVJ444P,
+  };
+  const AVColorSpace colorspaces[] = { AVCOL_SPC_BT470BG, AVCOL_SPC_BT709 };
+  const AVColorRange ranges[] = { AVCOL_RANGE_MPEG, AVCOL_RANGE_JPEG };
+  // Odd sizes leave a tail after the vector loops and a chroma sample
+  // covering a single pixel; the tall one is split into bands
+  const int sizes[][2] = { { 1, 1 }, { 7, 3 }, { 17, 9 }, { 33, 15 }, { 101, 67 } };
+
+  for (const char* kernel : ColorConverter::KernelNames()) {
+    for (AVPixelFormat format : formats) {
+      for (AVColorSpace colorspace : colorspaces) {
+        for (AVColorRange range : ranges) {
+          for (const auto& size : sizes) {
+            TestKernel(kernel, format, size[0], size[1], colorspace, range, size[1] > 64 ? 2 : 1);
+          }
+        }
+      }
+    }
+  }
+  return ExpectFailures() == 0 ? 0 : 1;
+}
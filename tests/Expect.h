@@ -0,0 +1,17 @@
+#pragma once
+
+#include <iostream>
+
+// Failed expectations so far, main() returns non-zero if there are any.
+inline int& ExpectFailures() {
+  static int failures = 0;
+  return failures;
+}
+
+#define EXPECT( condition, message ) \
+  do { \
+    if ( !( condition ) ) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": " << message << std::endl; \
+      ExpectFailures()++; \
+    } \
+  } while ( false )
@@ -0,0 +1,102 @@
+#include <cstdint>
+#include <vector>
+
+#ifdef __cplusplus
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+}
+#endif // __cplusplus
+
+#include "Expect.h"
+#include "MediaPool.h"
+
+namespace {
+
+const size_t FRAMES = 4;
+const size_t PACKETS = 8;
+// Plane buffers the pipeline holds at once
+const size_t PLANES = 2;
+const int WIDTH = 64;
+const int HEIGHT = 36;
+
+/**
+ * @brief One frame's worth of the decoder's traffic: a GOP of packets read
+ * and released, a decoded frame downscaled into pooled planes and passed on
+ * as a clone, everything back in the pool at the end.
+ *
+ * @return bool false if the pool ran out of memory
+ */
+bool PlayFrame(MediaPool& pool) {
+  std::vector<AVPacket*> packets;
+  for (size_t i = 0; i < PACKETS; i++) {
+    packets.push_back(pool.GetPacket());
+  }
+  bool ok = packets.back() != nullptr;
+  for (AVPacket*& packet : packets) {
+    pool.Release(packet);
+  }
+
+  AVFrame* decoded = pool.GetFrame();
+  AVFrame* scaled = pool.GetFrame();
+  ok = ok && decoded && scaled && pool.GetPlanes(scaled, AV_PIX_FMT_YUV420P, WIDTH, HEIGHT, PLANES);
+  AVFrame* queued = ok ? pool.CloneFrame(scaled) : nullptr;
+  ok = ok && queued && queued->data[0] == scaled->data[0];
+  pool.Release(queued);
+  pool.Release(scaled);
+  pool.Release(decoded);
+  return ok;
+}
+
+void TestSteadyState() {
+  MediaPool pool(FRAMES, PACKETS);
+  EXPECT(pool.PoolMisses() == FRAMES + PACKETS, "creating the working set counted " << pool.PoolMisses()
+    << " misses, expected " << FRAMES + PACKETS);
+
+  // The first frame creates the plane pool and its reserve
+  EXPECT(PlayFrame(pool), "warm-up frame failed");
+  uint64_t warmedUp = pool.PoolMisses();
+  EXPECT(warmedUp == FRAMES + PACKETS + PLANES, "warming up counted " << warmedUp << " misses, expected "
+    << FRAMES + PACKETS + PLANES);
+
+  const int frames = 1000;
+  for (int i = 0; i < frames; i++) {
+    if (!PlayFrame(pool)) {
+      EXPECT(false, "frame " << i << " failed");
+      break;
+    }
+  }
+  EXPECT(pool.PoolMisses() == warmedUp, frames << " frames after warming up counted "
+    << pool.PoolMisses() - warmedUp << " misses");
+}
+
+void TestGrowth() {
+  MediaPool pool(FRAMES, 0);
+  std::vector<AVFrame*> held;
+  for (size_t i = 0; i < FRAMES + 2; i++) {
+    held.push_back(pool.GetFrame());
+  }
+  EXPECT(pool.PoolMisses() == FRAMES + 2, "holding " << FRAMES + 2 << " frames counted " << pool.PoolMisses()
+    << " misses, expected " << FRAMES + 2);
+  for (AVFrame*& frame : held) {
+    pool.Release(frame);
+  }
+
+  // Every frame created is kept and reused
+  for (size_t i = 0; i < FRAMES + 2; i++) {
+    held[i] = pool.GetFrame();
+  }
+  EXPECT(pool.PoolMisses() == FRAMES + 2, "reusing released frames counted "
+    << pool.PoolMisses() - (FRAMES + 2) << " misses");
+  for (AVFrame*& frame : held) {
+    pool.Release(frame);
+  }
+}
+
+} // anonymous namespace
+
+int main() {
+  TestSteadyState();
+  TestGrowth();
+  return ExpectFailures() == 0 ? 0 : 1;
+}
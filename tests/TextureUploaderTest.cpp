@@ -0,0 +1,146 @@
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if !defined( WIN32 ) && !defined( _WIN32 )
+  #include <sys/mman.h>
+  #include <unistd.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#include <libavutil/frame.h>
+}
+#endif // __cplusplus
+
+#include "Expect.h"
+#include "TextureUploader.h"
+
+namespace {
+
+// Plane memory whose last byte is followed by an inaccessible page where
+// that can be arranged, so reading past the plane crashes the test.
+class GuardedPlane
+{
+private:
+  uint8_t* mapping = nullptr;
+  size_t mappingSize = 0;
+  std::vector<uint8_t> fallback;
+
+public:
+  uint8_t* data = nullptr;
+
+  explicit GuardedPlane(size_t size) {
+#if !defined( WIN32 ) && !defined( _WIN32 )
+    size_t page = size_t(sysconf(_SC_PAGESIZE));
+    size_t pages = (size + page - 1) / page;
+    mappingSize = (pages + 1) * page;
+    void* address = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (address != MAP_FAILED) {
+      mapping = static_cast<uint8_t*>(address);
+      mprotect(mapping + pages * page, page, PROT_NONE);
+      data = mapping + pages * page - size;
+      return;
+    }
+#endif
+    fallback.resize(size);
+    data = fallback.data();
+  }
+
+  ~GuardedPlane() {
+#if !defined( WIN32 ) && !defined( _WIN32 )
+    if (mapping) {
+      munmap(mapping, mappingSize);
+    }
+#endif
+  }
+};
+
+uint8_t Pattern(int plane, int x, int y) {
+  return uint8_t(plane * 71 + x * 7 + y * 13);
+}
+
+/**
+ * @brief Crop a synthetic YUV420P frame like Decoder::CropFrame does and
+ * copy its planes like TextureUploader::Upload does.
+ */
+void TestCroppedPlanes(int cropLeft, int cropTop, int cropRight, int cropBottom) {
+  const int width = 100;
+  const int height = 48;
+  const int linesizes[3] = { 128, 64, 64 };
+  const int heights[3] = { height, height / 2, height / 2 };
+
+  GuardedPlane planes[3] = {
+    GuardedPlane(size_t(linesizes[0]) * heights[0]),
+    GuardedPlane(size_t(linesizes[1]) * heights[1]),
+    GuardedPlane(size_t(linesizes[2]) * heights[2]),
+  };
+  AVFrame* frame = av_frame_alloc();
+  frame->format = AV_PIX_FMT_YUV420P;
+  frame->width = width;
+  frame->height = height;
+  for (int plane = 0; plane < 3; plane++) {
+    frame->data[plane] = planes[plane].data;
+    frame->linesize[plane] = linesizes[plane];
+    for (int y = 0; y < heights[plane]; y++) {
+      for (int x = 0; x < linesizes[plane]; x++) {
+        frame->data[plane][y * linesizes[plane] + x] = Pattern(plane, x, y);
+      }
+    }
+  }
+  frame->crop_left = size_t(cropLeft);
+  frame->crop_top = size_t(cropTop);
+  frame->crop_right = size_t(cropRight);
+  frame->crop_bottom = size_t(cropBottom);
+  EXPECT(av_frame_apply_cropping(frame, AV_FRAME_CROP_UNALIGNED) >= 0, "cropping failed");
+
+  for (int plane = 0; plane < 3; plane++) {
+    int shift = plane == 0 ? 0 : 1;
+    int planeWidth = (frame->width + shift) >> shift;
+    int planeHeight = (frame->height + shift) >> shift;
+    std::vector<uint8_t> copy(size_t(frame->linesize[plane]) * planeHeight, 0);
+    TextureUploader::CopyRows(copy.data(), frame->data[plane], frame->linesize[plane], planeWidth, planeHeight, 1);
+
+    int mismatches = 0;
+    for (int y = 0; y < planeHeight; y++) {
+      for (int x = 0; x < planeWidth; x++) {
+        uint8_t expected = Pattern(plane, x + (cropLeft >> shift), y + (cropTop >> shift));
+        mismatches += copy[size_t(y) * frame->linesize[plane] + x] != expected;
+      }
+    }
+    EXPECT(mismatches == 0, "plane " << plane << " cropped by " << cropLeft << "," << cropTop
+      << " has " << mismatches << " wrong bytes");
+  }
+  av_frame_free(&frame);
+}
+
+void TestRects() {
+  const int linesize = 40;
+  const int height = 8;
+  std::vector<uint8_t> pixels(size_t(linesize) * height);
+  for (size_t i = 0; i < pixels.size(); i++) {
+    pixels[i] = uint8_t(i);
+  }
+  std::vector<uint8_t> copy(pixels.size(), 0);
+  std::vector<TileRect> rects = { { 2, 1, 3, 2 } };
+  TextureUploader::CopyRows(copy.data(), pixels.data(), linesize, 10 * 4, height, 4, &rects);
+
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < linesize; x++) {
+      bool inside = y >= 1 && y < 3 && x >= 2 * 4 && x < 5 * 4;
+      uint8_t expected = inside ? pixels[size_t(y) * linesize + x] : 0;
+      EXPECT(copy[size_t(y) * linesize + x] == expected, "byte " << x << " of row " << y << " in a rect copy");
+    }
+  }
+}
+
+} // anonymous namespace
+
+int main() {
+  TestCroppedPlanes(0, 0, 0, 0);
+  // Cropped on the left and top, the last row ends before the pitch does
+  TestCroppedPlanes(6, 4, 0, 0);
+  TestCroppedPlanes(10, 8, 12, 6);
+  TestRects();
+  return ExpectFailures() == 0 ? 0 : 1;
+}